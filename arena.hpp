@@ -0,0 +1,113 @@
+#pragma once
+
+#include <vector>
+#include <algorithm>
+#include <stddef.h>
+#include <stdint.h>
+
+// Bump allocator for data that only lives until the end of the frame, such
+// as the staging arrays that are copied into GPU buffers. Allocating moves a
+// pointer forward, and reset() at the end of the frame frees everything at
+// once. If a frame needs more than the current block, more blocks are added,
+// and the next reset() replaces them with one block big enough for the whole
+// frame (up to max_retained bytes, so a single huge frame doesn't pin its
+// memory forever).
+//
+// Memory is returned uninitialized and no destructors are run, so it's only
+// meant for plain data like GLfloat. Not thread safe.
+class FrameArena {
+public:
+  static const size_t ALIGN = 16;
+
+  struct Block {
+    uint8_t* data;
+    size_t size;
+    size_t used;
+  };
+
+  std::vector<Block> blocks;
+  size_t max_retained;
+  size_t frame_bytes;       // Bytes allocated since the last reset()
+  size_t peak_bytes;        // Most bytes allocated in a single frame
+  int frame_allocations;    // Allocations since the last reset()
+
+  FrameArena(size_t initial_size = 1 << 20, size_t max_retained_size = 16 << 20) {
+    max_retained = max_retained_size;
+    frame_bytes = 0;
+    peak_bytes = 0;
+    frame_allocations = 0;
+
+    addBlock(initial_size);
+  }
+
+  ~FrameArena() {
+    for(int i = 0; i < (int)blocks.size(); ++i)
+      delete [] blocks[i].data;
+  }
+
+  FrameArena(const FrameArena&) = delete;
+  FrameArena& operator=(const FrameArena&) = delete;
+
+  template<typename T>
+  T* alloc(size_t count) {
+    return (T*)allocBytes(count * sizeof(T));
+  }
+
+  void* allocBytes(size_t size) {
+    size = (size + ALIGN - 1) / ALIGN * ALIGN;
+
+    Block* b = &blocks.back();
+
+    if(b->size - b->used < size)
+      b = addBlock(std::max(size, b->size * 2));
+
+    void* p = b->data + b->used;
+
+    b->used += size;
+    frame_bytes += size;
+    ++frame_allocations;
+
+    return p;
+  }
+
+  // Frees everything allocated since the last reset
+  void reset() {
+    peak_bytes = std::max(peak_bytes, frame_bytes);
+
+    if(blocks.size() > 1) {
+      size_t size = std::min(std::max(frame_bytes, blocks[0].size), std::max(max_retained, blocks[0].size));
+
+      for(int i = 0; i < (int)blocks.size(); ++i)
+        delete [] blocks[i].data;
+
+      blocks.clear();
+      addBlock(size);
+    }
+
+    blocks[0].used = 0;
+    frame_bytes = 0;
+    frame_allocations = 0;
+  }
+
+  // Bytes currently reserved by the arena
+  size_t capacity() {
+    size_t total = 0;
+
+    for(int i = 0; i < (int)blocks.size(); ++i)
+      total += blocks[i].size;
+
+    return total;
+  }
+
+private:
+  Block* addBlock(size_t size) {
+    Block b;
+
+    b.data = new uint8_t[size];
+    b.size = size;
+    b.used = 0;
+    blocks.push_back(b);
+
+    return &blocks.back();
+  }
+};
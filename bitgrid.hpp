@@ -0,0 +1,198 @@
+#pragma once
+
+#include <vector>
+#include <algorithm>
+#include <stdint.h>
+
+// Occupancy only (empty/solid) version of Grid3D storing one bit per voxel.
+// Each row along x starts on a new 64 bit word, and the padding bits at the end
+// of a row are always 0, so bulk operations can work a word at a time.
+class BitGrid3D {
+public:
+  std::vector<uint64_t> bits;
+  int x_size, y_size, z_size;
+  int words_per_row;
+
+  BitGrid3D(int xx, int yy, int zz) {
+    x_size = xx;
+    y_size = yy;
+    z_size = zz;
+    words_per_row = (xx + 63) / 64;
+
+    bits.assign(words_per_row * yy * zz, 0);
+  }
+
+  bool validPos(int x, int y, int z) {
+    return x >= 0 && x < x_size && y >= 0 && y < y_size && z >= 0 && z < z_size;
+  }
+
+  uint64_t* row(int y, int z) {
+    return &bits[(y + z * y_size) * words_per_row];
+  }
+
+  bool get(int x, int y, int z) {
+    return (row(y, z)[x >> 6] >> (x & 63)) & 1;
+  }
+
+  void set(int x, int y, int z, bool value) {
+    uint64_t& word = row(y, z)[x >> 6];
+    uint64_t mask = (uint64_t)1 << (x & 63);
+
+    if(value)
+      word |= mask;
+    else
+      word &= ~mask;
+  }
+
+  // Mask of the valid bits in the last word of each row
+  uint64_t lastWordMask() {
+    int used = x_size & 63;
+
+    return used == 0 ? ~(uint64_t)0 : ((uint64_t)1 << used) - 1;
+  }
+
+  void clear() {
+    std::fill(bits.begin(), bits.end(), 0);
+  }
+
+  // Number of solid voxels
+  int count() {
+    int total = 0;
+
+    for(int i = 0; i < (int)bits.size(); ++i)
+      total += __builtin_popcountll(bits[i]);
+
+    return total;
+  }
+
+  bool any() {
+    for(int i = 0; i < (int)bits.size(); ++i) {
+      if(bits[i] != 0)
+        return true;
+    }
+
+    return false;
+  }
+
+  // The bulk operations below require both grids to have the same dimensions
+
+  void andWith(BitGrid3D& g) {
+    for(int i = 0; i < (int)bits.size(); ++i)
+      bits[i] &= g.bits[i];
+  }
+
+  void orWith(BitGrid3D& g) {
+    for(int i = 0; i < (int)bits.size(); ++i)
+      bits[i] |= g.bits[i];
+  }
+
+  void andNot(BitGrid3D& g) {
+    for(int i = 0; i < (int)bits.size(); ++i)
+      bits[i] &= ~g.bits[i];
+  }
+
+  void invert() {
+    uint64_t last = lastWordMask();
+
+    for(int i = 0; i < (int)bits.size(); ++i) {
+      bits[i] = ~bits[i];
+
+      if(i % words_per_row == words_per_row - 1)
+        bits[i] &= last;
+    }
+  }
+
+  // Returns a grid where voxel (x, y, z) holds the value of voxel
+  // (x + dx, y + dy, z + dz) of this grid. Voxels outside the grid read as empty.
+  BitGrid3D shifted(int dx, int dy, int dz) {
+    BitGrid3D out(x_size, y_size, z_size);
+    uint64_t last = lastWordMask();
+
+    int word_shift = dx >= 0 ? dx / 64 : -((-dx + 63) / 64);
+    int bit_shift = dx - word_shift * 64;
+
+    for(int z = 0; z < z_size; ++z) {
+      int sz = z + dz;
+
+      if(sz < 0 || sz >= z_size)
+        continue;
+
+      for(int y = 0; y < y_size; ++y) {
+        int sy = y + dy;
+
+        if(sy < 0 || sy >= y_size)
+          continue;
+
+        uint64_t* src = row(sy, sz);
+        uint64_t* dest = out.row(y, z);
+
+        // Bit b of dest word w comes from bit (b + bit_shift) of source word
+        // (w + word_shift), spilling into the next word
+        for(int w = 0; w < words_per_row; ++w) {
+          int sw = w + word_shift;
+          uint64_t lo = (sw >= 0 && sw < words_per_row) ? src[sw] : 0;
+          uint64_t hi = (sw + 1 >= 0 && sw + 1 < words_per_row) ? src[sw + 1] : 0;
+
+          dest[w] = bit_shift == 0 ? lo : (lo >> bit_shift) | (hi << (64 - bit_shift));
+        }
+
+        dest[words_per_row - 1] &= last;
+      }
+    }
+
+    return out;
+  }
+
+  // Voxels whose given face is visible, i.e. solid voxels whose neighbor on
+  // that side is empty or outside the grid (see Grid3D::shouldGeneratePoly)
+  BitGrid3D exposedFaces(int face) {
+    int offset[6][3] = {
+      { 0, -1, 0 },
+      { 0, 1, 0 },
+      { -1, 0, 0 },
+      { 0, 0, 1 },
+      { 1, 0, 0 },
+      { 0, 0, -1 }
+    };
+
+    BitGrid3D neighbor = shifted(offset[face][0], offset[face][1], offset[face][2]);
+    BitGrid3D out = *this;
+
+    out.andNot(neighbor);
+
+    return out;
+  }
+
+  // Works on anything with get(x, y, z), such as Grid3D
+  template<typename G, typename T>
+  void fromGrid(G& g, T empty) {
+    for(int z = 0; z < z_size; ++z) {
+      for(int y = 0; y < y_size; ++y) {
+        uint64_t* r = row(y, z);
+
+        for(int w = 0; w < words_per_row; ++w) {
+          uint64_t word = 0;
+          int end = std::min(64, x_size - w * 64);
+
+          for(int b = 0; b < end; ++b) {
+            if(g.get(w * 64 + b, y, z) != empty)
+              word |= (uint64_t)1 << b;
+          }
+
+          r[w] = word;
+        }
+      }
+    }
+  }
+
+  template<typename G, typename T>
+  void toGrid(G& g, T solid, T empty) {
+    for(int z = 0; z < z_size; ++z) {
+      for(int y = 0; y < y_size; ++y) {
+        for(int x = 0; x < x_size; ++x) {
+          g.get(x, y, z) = get(x, y, z) ? solid : empty;
+        }
+      }
+    }
+  }
+};
@@ -0,0 +1,375 @@
+#pragma once
+
+#include <vector>
+#include <algorithm>
+#include <stdint.h>
+
+#include "grid.hpp"
+#include "parallel.hpp"
+
+// Finds the connected components of the solid voxels of a grid (voxels
+// sharing a face are connected). Every chunk is labeled on its own (in
+// parallel), and the labels touching across chunk borders are then joined
+// with a union-find over the labels rather than the voxels. Labels, sizes and
+// border links are kept per chunk, so after an edit only the chunks marked
+// dirty are labeled again.
+//
+// A component is anchored if it touches the bottom (y = 0) of the grid; if
+// none does, the largest component is. Every other component is floating.
+template<typename T, typename Layout = LinearLayout>
+class GridComponents {
+public:
+  struct Component {
+    int size;
+    int x1, y1, z1, x2, y2, z2;     // Bounding box, [x1, x2) x [y1, y2) x [z1, z2)
+    bool anchored;
+  };
+
+  typedef std::pair<uint16_t, uint16_t> Link;
+
+  Grid3D<T, Layout>* grid;
+  T empty;
+  ChunkGrid chunks;
+
+  std::vector<std::vector<uint16_t> > local;      // Label of every voxel of a chunk (0 if empty)
+  std::vector<std::vector<Component> > stats;     // Size and bounds of every label of a chunk
+  std::vector<std::vector<Link> > links[3];       // Labels touching the next chunk along x, y and z
+  std::vector<bool> stale;
+  std::vector<int> stale_chunks;
+
+  std::vector<int> first_label;     // Global label of the first label of each chunk
+  std::vector<int> component_of;    // Component of each global label
+  std::vector<Component> components;
+
+  GridComponents(Grid3D<T, Layout>* g, T empty_value) {
+    grid = g;
+    empty = empty_value;
+    chunks.init(g->x_size, g->y_size, g->z_size);
+
+    local.resize(chunks.total());
+    stats.resize(chunks.total());
+
+    for(int i = 0; i < 3; ++i)
+      links[i].resize(chunks.total());
+
+    stale.assign(chunks.total(), false);
+
+    for(int i = 0; i < chunks.total(); ++i)
+      markChunkDirty(i);
+  }
+
+  void markDirty(int x, int y, int z) {
+    markChunkDirty(chunks.chunkOf(x, y, z));
+  }
+
+  void markChunkDirty(int chunk) {
+    if(!stale[chunk]) {
+      stale[chunk] = true;
+      stale_chunks.push_back(chunk);
+    }
+  }
+
+  // Labels the dirty chunks again and rebuilds the components
+  void update() {
+    std::vector<int> relink;
+
+    for(int i = 0; i < (int)stale_chunks.size(); ++i) {
+      int c = stale_chunks[i];
+      int cx = c % chunks.chunks_x;
+      int cy = c / chunks.chunks_x % chunks.chunks_y;
+      int cz = c / (chunks.chunks_x * chunks.chunks_y);
+
+      // Links are stored on the lower chunk of each pair
+      relink.push_back(c);
+
+      if(cx > 0)
+        relink.push_back(chunks.index(cx - 1, cy, cz));
+
+      if(cy > 0)
+        relink.push_back(chunks.index(cx, cy - 1, cz));
+
+      if(cz > 0)
+        relink.push_back(chunks.index(cx, cy, cz - 1));
+    }
+
+    std::sort(relink.begin(), relink.end());
+    relink.erase(std::unique(relink.begin(), relink.end()), relink.end());
+
+    parallelFor(stale_chunks.size(), [&](int i) {
+      labelChunk(stale_chunks[i]);
+    });
+
+    parallelFor(relink.size(), [&](int i) {
+      linkChunk(relink[i]);
+    });
+
+    for(int i = 0; i < (int)stale_chunks.size(); ++i)
+      stale[stale_chunks[i]] = false;
+
+    stale_chunks.clear();
+
+    merge();
+  }
+
+  // Flood fills the solid voxels of a chunk
+  void labelChunk(int chunk) {
+    int x1, y1, z1, x2, y2, z2;
+
+    chunks.bounds(chunk, x1, y1, z1, x2, y2, z2);
+
+    int w = x2 - x1;
+    int h = y2 - y1;
+    int d = z2 - z1;
+    std::vector<uint16_t>& labels = local[chunk];
+    std::vector<Component>& s = stats[chunk];
+    std::vector<int> stack;
+    std::vector<bool> solid(w * h * d);
+
+    for(int z = 0, i = 0; z < d; ++z) {
+      for(int y = 0; y < h; ++y) {
+        for(int x = 0; x < w; ++x, ++i) {
+          solid[i] = grid->get(x1 + x, y1 + y, z1 + z) != empty;
+        }
+      }
+    }
+
+    labels.assign(w * h * d, 0);
+    s.clear();
+
+    for(int start = 0; start < w * h * d; ++start) {
+      if(labels[start] != 0 || !solid[start])
+        continue;
+
+      Component c = { 0, x2, y2, z2, x1, y1, z1, false };
+      uint16_t label = s.size() + 1;
+
+      labels[start] = label;
+      stack.push_back(start);
+
+      while(stack.size() != 0) {
+        int v = stack.back();
+        int x = v % w;
+        int y = v / w % h;
+        int z = v / (w * h);
+
+        stack.pop_back();
+
+        ++c.size;
+        c.x1 = std::min(c.x1, x1 + x);
+        c.y1 = std::min(c.y1, y1 + y);
+        c.z1 = std::min(c.z1, z1 + z);
+        c.x2 = std::max(c.x2, x1 + x + 1);
+        c.y2 = std::max(c.y2, y1 + y + 1);
+        c.z2 = std::max(c.z2, z1 + z + 1);
+
+        int neighbor[6][2] = {
+          { x > 0, v - 1 },
+          { x < w - 1, v + 1 },
+          { y > 0, v - w },
+          { y < h - 1, v + w },
+          { z > 0, v - w * h },
+          { z < d - 1, v + w * h }
+        };
+
+        for(int i = 0; i < 6; ++i) {
+          int n = neighbor[i][1];
+
+          if(neighbor[i][0] && labels[n] == 0 && solid[n]) {
+            labels[n] = label;
+            stack.push_back(n);
+          }
+        }
+      }
+
+      s.push_back(c);
+    }
+  }
+
+  // Finds the pairs of labels touching across the borders between a chunk and
+  // the next chunks along x, y and z
+  void linkChunk(int chunk) {
+    int cx = chunk % chunks.chunks_x;
+    int cy = chunk / chunks.chunks_x % chunks.chunks_y;
+    int cz = chunk / (chunks.chunks_x * chunks.chunks_y);
+    int next[3] = {
+      cx + 1 < chunks.chunks_x ? chunks.index(cx + 1, cy, cz) : -1,
+      cy + 1 < chunks.chunks_y ? chunks.index(cx, cy + 1, cz) : -1,
+      cz + 1 < chunks.chunks_z ? chunks.index(cx, cy, cz + 1) : -1
+    };
+
+    int x1, y1, z1, x2, y2, z2;
+
+    chunks.bounds(chunk, x1, y1, z1, x2, y2, z2);
+
+    for(int axis = 0; axis < 3; ++axis) {
+      std::vector<Link>& l = links[axis][chunk];
+
+      l.clear();
+
+      if(next[axis] == -1)
+        continue;
+
+      // Walk the shared face: (u, v) are the two other axes
+      int lo[3] = { x1, y1, z1 };
+      int hi[3] = { x2, y2, z2 };
+      int u = (axis + 1) % 3;
+      int v = (axis + 2) % 3;
+
+      for(int i = lo[u]; i < hi[u]; ++i) {
+        for(int j = lo[v]; j < hi[v]; ++j) {
+          int p[3];
+
+          p[axis] = hi[axis] - 1;
+          p[u] = i;
+          p[v] = j;
+
+          uint16_t a = labelAt(chunk, p[0], p[1], p[2]);
+
+          if(a == 0)
+            continue;
+
+          p[axis] = hi[axis];
+
+          uint16_t b = labelAt(next[axis], p[0], p[1], p[2]);
+
+          if(b != 0)
+            l.push_back(Link(a, b));
+        }
+      }
+
+      std::sort(l.begin(), l.end());
+      l.erase(std::unique(l.begin(), l.end()), l.end());
+    }
+  }
+
+  uint16_t labelAt(int chunk, int x, int y, int z) const {
+    int x1, y1, z1, x2, y2, z2;
+
+    chunks.bounds(chunk, x1, y1, z1, x2, y2, z2);
+
+    return local[chunk][(x - x1) + ((y - y1) + (z - z1) * (y2 - y1)) * (x2 - x1)];
+  }
+
+  static int findRoot(std::vector<int>& parent, int a) {
+    while(parent[a] != a) {
+      parent[a] = parent[parent[a]];
+      a = parent[a];
+    }
+
+    return a;
+  }
+
+  // Joins the labels of all chunks into components
+  void merge() {
+    int total_labels = 0;
+
+    first_label.resize(chunks.total());
+
+    for(int i = 0; i < chunks.total(); ++i) {
+      first_label[i] = total_labels;
+      total_labels += stats[i].size();
+    }
+
+    std::vector<int> parent(total_labels);
+
+    for(int i = 0; i < total_labels; ++i)
+      parent[i] = i;
+
+    for(int c = 0; c < chunks.total(); ++c) {
+      int cx = c % chunks.chunks_x;
+      int cy = c / chunks.chunks_x % chunks.chunks_y;
+      int cz = c / (chunks.chunks_x * chunks.chunks_y);
+      int next[3] = { chunks.index(cx + 1, cy, cz), chunks.index(cx, cy + 1, cz), chunks.index(cx, cy, cz + 1) };
+
+      for(int axis = 0; axis < 3; ++axis) {
+        std::vector<Link>& l = links[axis][c];
+
+        for(int i = 0; i < (int)l.size(); ++i) {
+          int a = findRoot(parent, first_label[c] + l[i].first - 1);
+          int b = findRoot(parent, first_label[next[axis]] + l[i].second - 1);
+
+          if(a != b)
+            parent[std::max(a, b)] = std::min(a, b);
+        }
+      }
+    }
+
+    // Number the roots and add up their labels
+    component_of.assign(total_labels, -1);
+    components.clear();
+
+    for(int c = 0; c < chunks.total(); ++c) {
+      for(int i = 0; i < (int)stats[c].size(); ++i) {
+        int root = findRoot(parent, first_label[c] + i);
+        Component& s = stats[c][i];
+
+        if(component_of[root] == -1) {
+          component_of[root] = components.size();
+          components.push_back(s);
+        }
+        else {
+          Component& total = components[component_of[root]];
+
+          total.size += s.size;
+          total.x1 = std::min(total.x1, s.x1);
+          total.y1 = std::min(total.y1, s.y1);
+          total.z1 = std::min(total.z1, s.z1);
+          total.x2 = std::max(total.x2, s.x2);
+          total.y2 = std::max(total.y2, s.y2);
+          total.z2 = std::max(total.z2, s.z2);
+        }
+
+        component_of[first_label[c] + i] = component_of[root];
+      }
+    }
+
+    int largest = -1;
+    bool any_anchored = false;
+
+    for(int i = 0; i < (int)components.size(); ++i) {
+      components[i].anchored = components[i].y1 == 0;
+      any_anchored |= components[i].anchored;
+
+      if(largest == -1 || components[i].size > components[largest].size)
+        largest = i;
+    }
+
+    if(!any_anchored && largest != -1)
+      components[largest].anchored = true;
+  }
+
+  // Component of voxel (x, y, z), or -1 if it's empty. Only valid after
+  // update() if no chunk is dirty.
+  int componentAt(int x, int y, int z) const {
+    int chunk = chunks.chunkOf(x, y, z);
+    uint16_t label = labelAt(chunk, x, y, z);
+
+    return label == 0 ? -1 : component_of[first_label[chunk] + label - 1];
+  }
+
+  std::vector<int> floatingComponents() const {
+    std::vector<int> floating;
+
+    for(int i = 0; i < (int)components.size(); ++i) {
+      if(!components[i].anchored)
+        floating.push_back(i);
+    }
+
+    return floating;
+  }
+
+  // Calls f(x, y, z) for every voxel of a component
+  template<typename F>
+  void forEachVoxel(int component, F f) const {
+    const Component& c = components[component];
+
+    for(int z = c.z1; z < c.z2; ++z) {
+      for(int y = c.y1; y < c.y2; ++y) {
+        for(int x = c.x1; x < c.x2; ++x) {
+          if(componentAt(x, y, z) == component)
+            f(x, y, z);
+        }
+      }
+    }
+  }
+};
@@ -0,0 +1,1578 @@
+#pragma once
+
+#include <vector>
+#include <string>
+#include <map>
+#include <tuple>
+#include <memory>
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <cctype>
+#include <cstdlib>
+#include <stdint.h>
+
+#include "jit.hpp"
+#include "noise.hpp"
+
+enum FormulaOp {
+  FORMULA_CONST,
+  FORMULA_X,
+  FORMULA_Y,
+  FORMULA_Z,
+  FORMULA_R,
+  FORMULA_PARAM,      // Named parameter, value is its index
+
+  FORMULA_ADD,
+  FORMULA_SUB,
+  FORMULA_MUL,
+  FORMULA_DIV,
+  FORMULA_POW,
+  FORMULA_EQ,
+  FORMULA_LT,
+  FORMULA_GT,
+  FORMULA_LE,
+  FORMULA_GE,
+  FORMULA_AND,
+  FORMULA_OR,
+
+  FORMULA_COS,
+  FORMULA_SIN,
+  FORMULA_SQRT,
+  FORMULA_ABS,
+  FORMULA_NOT,
+
+  FORMULA_SELECT,     // b if a isn't 0, else c
+
+  // Noise of (a, b, c), in the order of NoiseType
+  FORMULA_PERLIN,
+  FORMULA_SIMPLEX,
+  FORMULA_VALUE,
+  FORMULA_FBM
+};
+
+// Formula in reverse polish notation (as in formula.txt) compiled into a
+// program for a register machine. While parsing, every operation becomes a
+// node of a DAG:
+//
+//  - operations on constants are folded into a constant
+//  - an operation that already exists with the same operands reuses its node,
+//    so `cx 5 /` written twice, or sr and cr used several times, are computed
+//    once
+//  - x * 1, x / 1 and x - 0 are replaced by x
+//
+// Only the nodes the result depends on are turned into instructions. Every
+// node gets its own register, and constants are loaded once per evaluation
+// instead of once per voxel.
+//
+// Instructions are grouped by the coordinates they depend on. When a block is
+// evaluated, instructions that depend on none of them (only on r and
+// constants) run once, those that only depend on z once per slice, those
+// that only depend on y and z once per row, and only the rest run for every
+// voxel. The per-voxel instructions run a whole row at a time, each one over
+// the row before the next, so the loop over the instructions isn't repeated
+// for every voxel.
+//
+// On x86-64 CPUs with AVX the per-voxel instructions are also compiled to
+// machine code that evaluates 8 voxels at a time (see compileJit()), giving
+// bit for bit the same results as the interpreter, which is used otherwise.
+// Every compiled formula is checked against the interpreter on a probe block
+// and falls back to it if any result differs.
+//
+// Variables: x, y, z, r (half the smallest dimension of the grid), cx, cy, cz
+// (coordinates relative to the center), sr (distance to the center), cr
+// (distance to the vertical axis through the center), sphere, PI and E.
+// Functions: cos, sin, sqrt, abs and not. Operators: + - * / ^ = < > <= >= & |
+// (= is true if the values are less than 1 apart).
+//
+// The old per-voxel interpreter computed cos for sin, so formulas using sin
+// (like the first one in formula.txt) now give different worlds than before.
+// Replace sin with cos to get an old world back.
+//
+// Materials: `cond a b select` is a if cond isn't 0 (NaN counts as true, as
+// for & and |) and b otherwise, so a formula can give different solid voxels
+// different values, which the grid keeps as material IDs:
+// `sphere y 20 < 2 3 select 0 select` is a sphere with a bottom of material 2
+// and a top of material 3.
+//
+// Noise: perlin, simplex, value and fbm take 3 operands (x y z perlin) and
+// return seeded noise from noise.hpp, roughly in [-1, 1]. Rows of voxels are
+// evaluated 8 at a time with the same results as one at a time.
+//
+// Parameters: $name is a named parameter and t the time, both 0 until set
+// with setParameter(). They don't vary over a block, so changing one doesn't
+// recompile anything. mayChange() tells if changing them can change any
+// voxel of a block, from the range of values the formula can take there
+// (interval arithmetic), so only those blocks need to be generated again.
+//
+// Formulas comparing y with something that doesn't depend on y, such as
+// terrain written as `x 0 z perlin 10 * 20 + y >=`, are heightmaps: the height
+// is evaluated once per column instead of once per voxel, and every column is
+// filled with the span of y values passing the comparison (see
+// evaluateColumns()).
+class Formula {
+public:
+  struct Node {
+    int op;
+    int a, b, c;              // Operand nodes, -1 if unused
+    float value;              // Value of a FORMULA_CONST node
+  };
+
+  struct Instruction {
+    int op;
+    int dst, a, b, c;         // Registers
+    bool a_row, b_row, c_row; // Operand varies along the row (depends on x)
+  };
+
+  enum {
+    LEVEL_BLOCK,              // Depends on no coordinate
+    LEVEL_SLICE,              // Depends on z
+    LEVEL_ROW,                // Depends on y and maybe z
+    LEVEL_VOXEL,              // Depends on x
+    TOTAL_LEVELS
+  };
+
+  std::string source;
+  std::vector<Node> nodes;
+  std::vector<Instruction> program;
+  std::vector<float> initial_registers;     // Constants, loaded before running
+  int input_register[4];                    // Registers of x, y, z and r, -1 if unused
+  int result_register;
+  bool result_row;                          // Result depends on x
+  int level_start[TOTAL_LEVELS + 1];        // Instructions of each level, in program order
+  int total_operations;                     // Operations in the source, for comparing with program.size()
+  uint32_t seed;                            // Seed of the noise functions
+
+  std::vector<std::string> parameter_names; // Without the $, in order of first use
+  std::vector<float> parameter_values;
+  std::vector<int> parameter_register;      // -1 if the result doesn't depend on the parameter
+
+  // Generated code for the per-voxel instructions, NULL if not compiled
+  typedef void (*RowFunction)(const float* registers, float* scratch, float* out, long groups);
+
+  RowFunction row_function;
+  std::shared_ptr<ExecutableCode> jit;
+
+  // For heightmaps, the formula of the height h and the comparison of y with
+  // it (y op h), NULL otherwise
+  std::shared_ptr<Formula> height;
+  int height_op;
+
+  Formula() {
+    compile("1");
+  }
+
+  explicit Formula(const std::string& exp, uint32_t noise_seed = 0, bool use_jit = true) {
+    compile(exp, noise_seed, use_jit);
+  }
+
+  // Throws a std::string if the formula is malformed
+  void compile(const std::string& exp, uint32_t noise_seed = 0, bool use_jit = true) {
+    std::vector<std::string> tokens;
+    std::vector<int> stack;
+
+    source = exp;
+    seed = noise_seed;
+    nodes.clear();
+    cse.clear();
+    total_operations = 0;
+    parameter_names.clear();
+    parameter_values.clear();
+
+    tokenize(exp, tokens);
+
+    for(int i = 0; i < (int)tokens.size(); ++i) {
+      const std::string& t = tokens[i];
+
+      if(isdigit(t[0])) {
+        stack.push_back(constant(atof(t.c_str())));
+      }
+      else if(isOperator(t[0])) {
+        if(stack.size() < 2)
+          throw "Too few operands for operator '" + t + "'";
+
+        int b = stack.back();
+        stack.pop_back();
+
+        int a = stack.back();
+        stack.pop_back();
+
+        stack.push_back(binary(operatorOp(t[0]), a, b));
+      }
+      else if(t[0] == '~') {
+        // Parenthesized tokens are comments
+      }
+      else if(t[0] == '$') {
+        stack.push_back(parameter(t.substr(1)));
+      }
+      else if(t == "cos" || t == "sin" || t == "sqrt" || t == "abs" || t == "not") {
+        if(stack.size() < 1)
+          throw "Too few operands for function '" + t + "'";
+
+        int op = t == "cos" ? FORMULA_COS :
+          t == "sin" ? FORMULA_SIN :
+          t == "sqrt" ? FORMULA_SQRT :
+          t == "abs" ? FORMULA_ABS :
+          FORMULA_NOT;
+
+        int a = stack.back();
+
+        stack.pop_back();
+        stack.push_back(unary(op, a));
+      }
+      else if(t == "select" || t == "perlin" || t == "simplex" || t == "value" || t == "fbm") {
+        if(stack.size() < 3)
+          throw "Too few operands for function '" + t + "'";
+
+        int op = t == "select" ? FORMULA_SELECT :
+          t == "perlin" ? FORMULA_PERLIN :
+          t == "simplex" ? FORMULA_SIMPLEX :
+          t == "value" ? FORMULA_VALUE :
+          FORMULA_FBM;
+
+        int c = stack.back();
+        stack.pop_back();
+
+        int b = stack.back();
+        stack.pop_back();
+
+        int a = stack.back();
+        stack.pop_back();
+
+        stack.push_back(ternary(op, a, b, c));
+      }
+      else {
+        stack.push_back(variable(t));
+      }
+    }
+
+    if(stack.size() == 0)
+      throw std::string("Empty formula");
+
+    // Like the stack evaluator this replaces, the bottom of the stack is the
+    // result and anything left above it is never used
+    emit(stack[0]);
+
+    row_function = NULL;
+    jit.reset();
+
+    if(use_jit)
+      compileJit();
+
+    findHeight(stack[0], use_jit);
+  }
+
+  // Evaluates the formula at one voxel. registers must hold totalRegisters()
+  // floats and start out as a copy of initial_registers (see evaluateBlock()).
+  float evaluate(int x, int y, int z, int r, float* registers) const {
+    setInputs(x, y, z, r, registers);
+
+    for(int i = 0; i < (int)program.size(); ++i)
+      execute(program[i], registers);
+
+    return registers[result_register];
+  }
+
+  // Sets a parameter used by the formula. Returns false if there's no
+  // parameter with that name.
+  bool setParameter(const std::string& name, float value) {
+    int i = std::find(parameter_names.begin(), parameter_names.end(), name) - parameter_names.begin();
+
+    if(i == (int)parameter_names.size())
+      return false;
+
+    parameter_values[i] = value;
+
+    if(parameter_register[i] >= 0)
+      initial_registers[parameter_register[i]] = value;
+
+    if(height)
+      height->setParameter(name, value);
+
+    return true;
+  }
+
+  bool hasParameter(const std::string& name) const {
+    return std::find(parameter_names.begin(), parameter_names.end(), name) != parameter_names.end();
+  }
+
+  float evaluate(int x, int y, int z, int r) const {
+    std::vector<float> registers(initial_registers);
+
+    return evaluate(x, y, z, r, &registers[0]);
+  }
+
+  // Evaluates the block [x, x + w) x [y, y + h) x [z, z + d), calling
+  // store(y, z, values) with the w values of each row
+  template<typename F>
+  void evaluateRows(int x, int y, int z, int w, int h, int d, int r, F store) const {
+    if(height) {
+      std::vector<int> begin(w), end(w);
+      std::vector<float> row(w);
+
+      for(int zz = z; zz < z + d; ++zz) {
+        evaluateColumns(x, y, zz, w, h, 1, r, [&](int xx, int, int y1, int y2) {
+          begin[xx - x] = y1;
+          end[xx - x] = y2;
+        });
+
+        for(int yy = y; yy < y + h; ++yy) {
+          for(int i = 0; i < w; ++i)
+            row[i] = yy >= begin[i] && yy < end[i];
+
+          store(yy, zz, &row[0]);
+        }
+      }
+
+      return;
+    }
+
+    evaluateVoxels(x, y, z, w, h, d, r, store);
+  }
+
+  // Like evaluateRows() but evaluates every voxel, even for heightmaps
+  template<typename F>
+  void evaluateVoxels(int x, int y, int z, int w, int h, int d, int r, F store) const {
+    int total = totalRegisters();
+    int groups = (w + 7) / 8;
+    std::vector<float> registers(initial_registers);
+    std::vector<float> rows(row_function ? groups * 8 : total * w);
+    std::vector<float> scratch(row_function ? (total + 3) * 8 : 0);
+
+    setInputs(x, y, z, r, &registers[0]);
+
+    if(input_register[0] >= 0 && !row_function) {
+      for(int i = 0; i < w; ++i)
+        rows[input_register[0] * w + i] = x + i;
+    }
+
+    run(LEVEL_BLOCK, &registers[0]);
+
+    for(int zz = z; zz < z + d; ++zz) {
+      setInputs(x, y, zz, r, &registers[0]);
+      run(LEVEL_SLICE, &registers[0]);
+
+      for(int yy = y; yy < y + h; ++yy) {
+        setInputs(x, yy, zz, r, &registers[0]);
+        run(LEVEL_ROW, &registers[0]);
+
+        if(row_function) {
+          // The generated code steps x itself
+          for(int i = 0; i < 8; ++i)
+            scratch[input_register[0] * 8 + i] = x + i;
+
+          row_function(&registers[0], &scratch[0], &rows[0], groups);
+          store(yy, zz, &rows[0]);
+        }
+        else if(result_row) {
+          runRow(&registers[0], &rows[0], w);
+          store(yy, zz, &rows[result_register * w]);
+        }
+        else {
+          float* row = &rows[result_register * w];
+
+          std::fill(row, row + w, registers[result_register]);
+          store(yy, zz, row);
+        }
+      }
+    }
+  }
+
+  // Evaluates the block [x, x + w) x [y, y + h) x [z, z + d) into out, x
+  // fastest, then y, then z
+  template<typename T>
+  void evaluateBlock(int x, int y, int z, int w, int h, int d, int r, T* out) const {
+    evaluateRows(x, y, z, w, h, d, r, [&](int yy, int zz, const float* values) {
+      for(int i = 0; i < w; ++i)
+        *out++ = values[i];
+    });
+  }
+
+  // Evaluates the height of every column of a heightmap in the block
+  // [x, x + w) x [y, y + h) x [z, z + d), calling store(x, z, y1, y2) where
+  // the voxels [y1, y2) of the column are 1 and the rest 0
+  template<typename F>
+  void evaluateColumns(int x, int y, int z, int w, int h, int d, int r, F store) const {
+    height->evaluateVoxels(x, y, z, w, 1, d, r, [&](int, int zz, const float* values) {
+      for(int i = 0; i < w; ++i) {
+        int y1, y2;
+
+        columnSpan(values[i], y, y + h, y1, y2);
+        store(x + i, zz, y1, y2);
+      }
+    });
+  }
+
+  // Voxels [y1, y2) of [y_min, y_max) where y op h is true. y is compared as
+  // a float, the same as when every voxel is evaluated.
+  void columnSpan(float h, int y_min, int y_max, int& y1, int& y2) const {
+    y1 = y_min;
+    y2 = y_max;
+
+    if(h != h) {
+      y2 = y_min;
+      return;
+    }
+
+    double bound = height_op == FORMULA_LT || height_op == FORMULA_GE ? std::ceil((double)h) : std::floor((double)h) + 1;
+    int limit = (int)std::max((double)y_min, std::min((double)y_max, bound));
+
+    if(height_op == FORMULA_LT || height_op == FORMULA_LE)
+      y2 = limit;
+    else
+      y1 = limit;
+  }
+
+  // Fills a grid, with r set to half its smallest dimension
+  template<typename G>
+  void generate(G& g) const {
+    int r = std::min(g.x_size, std::min(g.y_size, g.z_size)) / 2;
+
+    if(height) {
+      evaluateColumns(0, 0, 0, g.x_size, g.y_size, g.z_size, r, [&](int x, int z, int y1, int y2) {
+        for(int y = 0; y < g.y_size; ++y)
+          g.get(x, y, z) = y >= y1 && y < y2;
+      });
+
+      return;
+    }
+
+    evaluateRows(0, 0, 0, g.x_size, g.y_size, g.z_size, r, [&](int y, int z, const float* values) {
+      for(int x = 0; x < g.x_size; ++x)
+        g.get(x, y, z) = values[x];
+    });
+  }
+
+  // Range of values, for interval arithmetic
+  struct Interval {
+    float lo, hi;
+    bool nan;                 // Can also be NaN
+  };
+
+  // Range of the values of the formula over the voxels [x1, x2) x [y1, y2) x
+  // [z1, z2) when every parameter i is anywhere in [low[i], high[i]]
+  Interval bounds(int x1, int y1, int z1, int x2, int y2, int z2, int r, const std::vector<float>& low, const std::vector<float>& high) const {
+    std::vector<Interval> registers(initial_registers.size());
+    int lo[4] = { x1, y1, z1, r };
+    int hi[4] = { x2 - 1, y2 - 1, z2 - 1, r };
+
+    for(int i = 0; i < (int)registers.size(); ++i) {
+      float v = initial_registers[i];
+
+      // Constants folded into NaN, such as `-1 sqrt`
+      registers[i] = v == v ? exact(v, v) : exact(-INFINITY, INFINITY, true);
+    }
+
+    for(int i = 0; i < 4; ++i) {
+      if(input_register[i] >= 0)
+        registers[input_register[i]] = exact(lo[i], hi[i]);
+    }
+
+    for(int i = 0; i < (int)parameter_register.size(); ++i) {
+      if(parameter_register[i] >= 0)
+        registers[parameter_register[i]] = exact(low[i], high[i]);
+    }
+
+    for(int i = 0; i < (int)program.size(); ++i) {
+      const Instruction& in = program[i];
+      Interval none = exact(0, 0);
+
+      registers[in.dst] = applyInterval(in.op, registers[in.a], in.b >= 0 ? registers[in.b] : none, in.c >= 0 ? registers[in.c] : none);
+    }
+
+    return registers[result_register];
+  }
+
+  // True if changing the parameters from old_values to their current values
+  // can change any voxel of [x1, x2) x [y1, y2) x [z1, z2). Voxels can only
+  // stay the same for sure where the formula has the same value for every
+  // parameter value in between.
+  bool mayChange(int x1, int y1, int z1, int x2, int y2, int z2, int r, const std::vector<float>& old_values) const {
+    std::vector<float> low(parameter_values);
+    std::vector<float> high(parameter_values);
+    bool changed = false;
+
+    for(int i = 0; i < (int)parameter_values.size(); ++i) {
+      if(bits(old_values[i]) != bits(parameter_values[i]) && parameter_register[i] >= 0) {
+        low[i] = std::min(old_values[i], parameter_values[i]);
+        high[i] = std::max(old_values[i], parameter_values[i]);
+        changed = true;
+      }
+    }
+
+    if(!changed)
+      return false;
+
+    Interval i = bounds(x1, y1, z1, x2, y2, z2, r, low, high);
+
+    return i.nan || i.lo != i.hi;
+  }
+
+  static Interval exact(float lo, float hi, bool nan = false) {
+    Interval i = { lo, hi, nan };
+
+    return i;
+  }
+
+  // Interval computed in double precision, widened by a float step on both
+  // sides to cover the rounding of the float operations
+  static Interval rounded(double lo, double hi, bool nan) {
+    const float inf = INFINITY;
+
+    if(lo != lo || hi != hi)
+      return exact(-inf, inf, true);
+
+    return exact(std::nextafter((float)lo, -inf), std::nextafter((float)hi, inf), nan);
+  }
+
+  // Result of a comparison or logical operation, 0 or 1
+  static Interval boolean(bool can_be_false, bool can_be_true) {
+    return exact(can_be_false ? 0 : 1, can_be_true ? 1 : 0);
+  }
+
+  static bool finite(const Interval& i) {
+    return !i.nan && std::isfinite(i.lo) && std::isfinite(i.hi);
+  }
+
+  static bool maybeZero(const Interval& i) {
+    return i.lo <= 0 && i.hi >= 0;
+  }
+
+  // NaN counts as true, as in apply()
+  static bool maybeNonZero(const Interval& i) {
+    return i.nan || i.lo != 0 || i.hi != 0;
+  }
+
+  // True if x + 2 pi k is in [lo, hi] for some integer k
+  static bool containsAngle(double lo, double hi, double x) {
+    const double TWO_PI = 6.283185307179586;
+
+    return x + TWO_PI * std::ceil((lo - x) / TWO_PI) <= hi;
+  }
+
+  // Interval version of apply() and applyTernary(), never narrower than the
+  // values they can return for operands in a, b and c
+  static Interval applyInterval(int op, const Interval& a, const Interval& b, const Interval& c) {
+    const float inf = INFINITY;
+
+    if(op == FORMULA_SELECT) {
+      if(!maybeNonZero(a))
+        return c;
+
+      if(!maybeZero(a))
+        return b;
+
+      return exact(std::min(b.lo, c.lo), std::max(b.hi, c.hi), b.nan || c.nan);
+    }
+
+    bool nan = !finite(a) || (isBinary(op) && !finite(b));
+
+    switch(op) {
+      case FORMULA_ADD:
+        return rounded((double)a.lo + b.lo, (double)a.hi + b.hi, nan);
+
+      case FORMULA_SUB:
+        return rounded((double)a.lo - b.hi, (double)a.hi - b.lo, nan);
+
+      case FORMULA_MUL:
+      case FORMULA_DIV: {
+        if(op == FORMULA_DIV && (maybeZero(b) || b.nan))
+          return exact(-inf, inf, true);
+
+        double p[4];
+
+        for(int i = 0; i < 4; ++i) {
+          double x = i & 1 ? a.hi : a.lo;
+          double y = i & 2 ? b.hi : b.lo;
+
+          p[i] = op == FORMULA_MUL ? x * y : x / y;
+        }
+
+        return rounded(*std::min_element(p, p + 4), *std::max_element(p, p + 4), nan);
+      }
+
+      case FORMULA_POW: {
+        // Only a constant non-negative integer exponent is narrowed
+        int k = (int)b.lo;
+
+        if(nan || b.lo != b.hi || b.lo != k || k < 0 || k > 64)
+          return exact(-inf, inf, true);
+
+        double lo = pow((double)a.lo, k);
+        double hi = pow((double)a.hi, k);
+
+        if(k % 2 == 0 && maybeZero(a))
+          return rounded(0, std::max(lo, hi), false);
+
+        return rounded(std::min(lo, hi), std::max(lo, hi), false);
+      }
+
+      case FORMULA_EQ: {
+        Interval d = applyInterval(FORMULA_SUB, a, b, c);
+
+        return boolean(d.nan || d.lo <= -1 || d.hi >= 1, d.lo < 1 && d.hi > -1);
+      }
+
+      case FORMULA_LT: return boolean(a.nan || b.nan || a.hi >= b.lo, a.lo < b.hi);
+      case FORMULA_GT: return boolean(a.nan || b.nan || a.lo <= b.hi, a.hi > b.lo);
+      case FORMULA_LE: return boolean(a.nan || b.nan || a.hi > b.lo, a.lo <= b.hi);
+      case FORMULA_GE: return boolean(a.nan || b.nan || a.lo < b.hi, a.hi >= b.lo);
+      case FORMULA_AND: return boolean(maybeZero(a) || maybeZero(b), maybeNonZero(a) && maybeNonZero(b));
+      case FORMULA_OR: return boolean(maybeZero(a) && maybeZero(b), maybeNonZero(a) || maybeNonZero(b));
+      case FORMULA_NOT: return boolean(maybeNonZero(a), maybeZero(a));
+
+      case FORMULA_COS:
+      case FORMULA_SIN: {
+        const double PI = 3.141592653589793;
+
+        if(nan)
+          return exact(-1, 1, true);
+
+        // Shift cos to sin, whose maximum is at pi / 2 and minimum at -pi / 2
+        double shift = op == FORMULA_COS ? PI / 2 : 0;
+        double lo = sin(a.lo + shift);
+        double hi = sin(a.hi + shift);
+
+        if(lo > hi)
+          std::swap(lo, hi);
+
+        if(containsAngle(a.lo + shift, a.hi + shift, PI / 2))
+          hi = 1;
+
+        if(containsAngle(a.lo + shift, a.hi + shift, -PI / 2))
+          lo = -1;
+
+        Interval i = rounded(lo, hi, false);
+
+        return exact(std::max(i.lo, -1.0f), std::min(i.hi, 1.0f));
+      }
+
+      case FORMULA_SQRT:
+        if(a.hi < 0)
+          return exact(0, 0, true);
+
+        return rounded(sqrt(std::max((double)a.lo, 0.0)), sqrt((double)a.hi), a.nan || a.lo < 0);
+
+      case FORMULA_ABS:
+        if(maybeZero(a))
+          return exact(0, std::max(-a.lo, a.hi), a.nan);
+
+        return exact(std::min(std::fabs(a.lo), std::fabs(a.hi)), std::max(std::fabs(a.lo), std::fabs(a.hi)), a.nan);
+    }
+
+    if(isNoise(op)) {
+      // Noise is only bounded for the coordinates noise.hpp supports, which
+      // must stay in the range of an int even after fbm scales them by 16
+      const float range = 1 << 24;
+
+      if(nan || !finite(b) || !finite(c) || std::max(-a.lo, a.hi) > range || std::max(-b.lo, b.hi) > range ||
+          std::max(-c.lo, c.hi) > range)
+        return exact(-inf, inf, true);
+
+      // Largest magnitude each noise function can return (see noise.hpp),
+      // rounded up
+      float limit = op == FORMULA_SIMPLEX ? 19 : op == FORMULA_VALUE ? 1.001f : 2.001f;
+
+      return exact(-limit, limit);
+    }
+
+    return exact(-inf, inf, true);
+  }
+
+  static bool isBinary(int op) {
+    return op >= FORMULA_ADD && op <= FORMULA_OR;
+  }
+
+  int totalRegisters() const {
+    return initial_registers.size();
+  }
+
+  static float apply(int op, float a, float b) {
+    switch(op) {
+      case FORMULA_ADD: return a + b;
+      case FORMULA_SUB: return a - b;
+      case FORMULA_MUL: return a * b;
+      case FORMULA_DIV: return a / b;
+      case FORMULA_POW: return pow((double)a, (double)b);
+      case FORMULA_EQ: return std::fabs(a - b) < 1;
+      case FORMULA_LT: return a < b;
+      case FORMULA_GT: return a > b;
+      case FORMULA_LE: return a <= b;
+      case FORMULA_GE: return a >= b;
+      case FORMULA_AND: return a && b;
+      case FORMULA_OR: return a || b;
+      case FORMULA_COS: return cos((double)a);
+      case FORMULA_SIN: return sin((double)a);  // Not cos, see above
+      case FORMULA_SQRT: return std::sqrt(a);
+      case FORMULA_ABS: return std::fabs(a);
+      case FORMULA_NOT: return !a;
+    }
+
+    return 0;
+  }
+
+  static bool isOperator(char c) {
+    return c == '+' ||
+      c == '-' ||
+      c == '*' ||
+      c == '/' ||
+      c == '^' ||
+      c == '=' ||
+      c == '<' ||
+      c == '>' ||
+      c == '!' ||
+      c == '@' ||
+      c == '&' ||
+      c == '|';
+  }
+
+  // Value of select or of a noise function for operands a, b and c
+  static float applyTernary(int op, float a, float b, float c, uint32_t seed) {
+    if(op == FORMULA_SELECT)
+      return a ? b : c;
+
+    return noise(op - FORMULA_PERLIN, a, b, c, seed);
+  }
+
+  static bool isNoise(int op) {
+    return op >= FORMULA_PERLIN;
+  }
+
+  // The formula without comments, with its tokens separated by one space, so
+  // formulas that only differ in those compare equal. Throws like compile().
+  static std::string normalize(const std::string& exp) {
+    std::vector<std::string> tokens;
+    std::string result;
+
+    tokenize(exp, tokens);
+
+    for(int i = 0; i < (int)tokens.size(); ++i) {
+      if(tokens[i][0] == '~')
+        continue;
+
+      if(result.size() != 0)
+        result += ' ';
+
+      result += tokens[i];
+    }
+
+    return result;
+  }
+
+  // Splits a formula into numbers, operators (<= and >= become ! and @),
+  // names and parenthesized comments (which start with ~)
+  static void tokenize(const std::string& exp, std::vector<std::string>& tokens) {
+    const char* start = exp.c_str();
+    const char* end = start + exp.size();
+
+    while(start < end) {
+      if(isspace(*start)) {
+        ++start;
+      }
+      else if(isdigit(*start)) {
+        std::string token;
+
+        while(start < end && (isdigit(*start) || *start == '.')) {
+          token += *start;
+          ++start;
+        }
+
+        tokens.push_back(token);
+      }
+      else if(isOperator(*start)) {
+        if((*start == '<' || *start == '>') && start + 1 < end && start[1] == '=') {
+          tokens.push_back(*start == '<' ? "!" : "@");
+          start += 2;
+        }
+        else {
+          tokens.push_back(std::string(start, start + 1));
+          ++start;
+        }
+      }
+      else if(*start == '$') {
+        std::string token = "$";
+
+        ++start;
+
+        while(start < end && (isalnum(*start) || *start == '_')) {
+          token += *start;
+          ++start;
+        }
+
+        if(token.size() == 1)
+          throw std::string("Missing parameter name after '$'");
+
+        tokens.push_back(token);
+      }
+      else if(isalpha(*start) || *start == '(') {
+        std::string token;
+        bool par = false;
+
+        while(start < end && (isalpha(*start) || *start == '(')) {
+          token += *start;
+          par |= *start == '(';
+          ++start;
+        }
+
+        if(par) {
+          while(start < end && *start != ')') {
+            token += *start;
+            ++start;
+          }
+
+          if(start == end)
+            throw "Unmatched parenthesis in expression";
+
+          ++start;
+          token = "~" + token;
+        }
+
+        tokens.push_back(token);
+      }
+      else {
+        throw "Unexpected character: " + std::string(start, start + 1);
+      }
+    }
+  }
+
+private:
+  typedef std::tuple<int, int, int, int, uint32_t> NodeKey;
+
+  std::map<NodeKey, int> cse;
+
+  static int operatorOp(char c) {
+    switch(c) {
+      case '+': return FORMULA_ADD;
+      case '-': return FORMULA_SUB;
+      case '*': return FORMULA_MUL;
+      case '/': return FORMULA_DIV;
+      case '^': return FORMULA_POW;
+      case '=': return FORMULA_EQ;
+      case '<': return FORMULA_LT;
+      case '>': return FORMULA_GT;
+      case '!': return FORMULA_LE;
+      case '@': return FORMULA_GE;
+      case '&': return FORMULA_AND;
+    }
+
+    return FORMULA_OR;
+  }
+
+  static bool isCommutative(int op) {
+    return op == FORMULA_ADD || op == FORMULA_MUL || op == FORMULA_EQ || op == FORMULA_AND || op == FORMULA_OR;
+  }
+
+  // Returns the node for an operation, reusing an identical one if there is
+  int node(int op, int a, int b, float value, int c = -1) {
+    NodeKey key(op, a, b, c, bits(value));
+    std::map<NodeKey, int>::iterator i = cse.find(key);
+
+    if(i != cse.end())
+      return i->second;
+
+    Node n = { op, a, b, c, value };
+
+    nodes.push_back(n);
+    cse[key] = nodes.size() - 1;
+
+    return nodes.size() - 1;
+  }
+
+  int constant(float value) {
+    return node(FORMULA_CONST, -1, -1, value);
+  }
+
+  int parameter(const std::string& name) {
+    int i = std::find(parameter_names.begin(), parameter_names.end(), name) - parameter_names.begin();
+
+    if(i == (int)parameter_names.size()) {
+      parameter_names.push_back(name);
+      parameter_values.push_back(0);
+    }
+
+    return node(FORMULA_PARAM, -1, -1, i);
+  }
+
+  bool isConstant(int n, float value) {
+    return nodes[n].op == FORMULA_CONST && memcmp(&nodes[n].value, &value, sizeof(float)) == 0;
+  }
+
+  int unary(int op, int a) {
+    ++total_operations;
+
+    if(nodes[a].op == FORMULA_CONST)
+      return constant(apply(op, nodes[a].value, 0));
+
+    return node(op, a, -1, 0);
+  }
+
+  int binary(int op, int a, int b) {
+    ++total_operations;
+
+    if(nodes[a].op == FORMULA_CONST && nodes[b].op == FORMULA_CONST)
+      return constant(apply(op, nodes[a].value, nodes[b].value));
+
+    // Identities that give exactly the same float
+    if((op == FORMULA_MUL || op == FORMULA_DIV) && isConstant(b, 1))
+      return a;
+
+    if(op == FORMULA_MUL && isConstant(a, 1))
+      return b;
+
+    if(op == FORMULA_SUB && isConstant(b, 0))
+      return a;
+
+    if(isCommutative(op) && a > b)
+      std::swap(a, b);
+
+    return node(op, a, b, 0);
+  }
+
+  int ternary(int op, int a, int b, int c) {
+    ++total_operations;
+
+    if(nodes[a].op == FORMULA_CONST && nodes[b].op == FORMULA_CONST && nodes[c].op == FORMULA_CONST)
+      return constant(applyTernary(op, nodes[a].value, nodes[b].value, nodes[c].value, seed));
+
+    // Only the selected operand is needed if the condition is known
+    if(op == FORMULA_SELECT && nodes[a].op == FORMULA_CONST)
+      return nodes[a].value ? b : c;
+
+    if(op == FORMULA_SELECT && b == c)
+      return b;
+
+    return node(op, a, b, 0, c);
+  }
+
+  int variable(const std::string& t) {
+    if(t == "x")
+      return node(FORMULA_X, -1, -1, 0);
+
+    if(t == "y")
+      return node(FORMULA_Y, -1, -1, 0);
+
+    if(t == "z")
+      return node(FORMULA_Z, -1, -1, 0);
+
+    if(t == "r")
+      return node(FORMULA_R, -1, -1, 0);
+
+    if(t == "t")
+      return parameter("t");
+
+    if(t == "PI")
+      return constant(3.1415926);
+
+    if(t == "E")
+      return constant(2.71828);
+
+    if(t == "cx")
+      return binary(FORMULA_SUB, variable("x"), variable("r"));
+
+    if(t == "cy")
+      return binary(FORMULA_SUB, variable("y"), variable("r"));
+
+    if(t == "cz")
+      return binary(FORMULA_SUB, variable("z"), variable("r"));
+
+    if(t == "sr" || t == "cr" || t == "sphere") {
+      int xx = variable("cx");
+      int zz = variable("cz");
+      int sum = binary(FORMULA_MUL, xx, xx);
+
+      if(t != "cr") {
+        int yy = variable("cy");
+
+        sum = binary(FORMULA_ADD, sum, binary(FORMULA_MUL, yy, yy));
+      }
+
+      sum = binary(FORMULA_ADD, sum, binary(FORMULA_MUL, zz, zz));
+
+      if(t == "sphere") {
+        int r = variable("r");
+
+        return binary(FORMULA_LT, sum, binary(FORMULA_MUL, r, r));
+      }
+
+      return unary(FORMULA_SQRT, sum);
+    }
+
+    throw "Unknown name in expression: " + t;
+  }
+
+  // Turns the nodes the result depends on into instructions
+  void emit(int result) {
+    std::vector<bool> live(nodes.size(), false);
+    std::vector<int> reg(nodes.size(), -1);
+
+    live[result] = true;
+
+    // Operands always come before the nodes using them
+    for(int i = result; i >= 0; --i) {
+      if(!live[i])
+        continue;
+
+      if(nodes[i].a >= 0)
+        live[nodes[i].a] = true;
+
+      if(nodes[i].b >= 0)
+        live[nodes[i].b] = true;
+
+      if(nodes[i].c >= 0)
+        live[nodes[i].c] = true;
+    }
+
+    // Coordinates each node depends on (bit 0: x, 1: y, 2: z)
+    std::vector<int> depends(nodes.size(), 0);
+    std::vector<Instruction> levels[TOTAL_LEVELS];
+
+    initial_registers.clear();
+
+    for(int i = 0; i < 4; ++i)
+      input_register[i] = -1;
+
+    parameter_register.assign(parameter_names.size(), -1);
+
+    for(int i = 0; i <= result; ++i) {
+      if(!live[i])
+        continue;
+
+      Node& n = nodes[i];
+
+      reg[i] = initial_registers.size();
+      initial_registers.push_back(n.op == FORMULA_CONST ? n.value : 0);
+
+      if(n.op == FORMULA_PARAM) {
+        // Set like a constant, so it's at the block level
+        parameter_register[(int)n.value] = reg[i];
+        initial_registers[reg[i]] = parameter_values[(int)n.value];
+      }
+      else if(n.op >= FORMULA_X && n.op <= FORMULA_R) {
+        input_register[n.op - FORMULA_X] = reg[i];
+        depends[i] = n.op == FORMULA_R ? 0 : 1 << (n.op - FORMULA_X);
+      }
+      else if(n.op != FORMULA_CONST) {
+        depends[i] = depends[n.a] | (n.b >= 0 ? depends[n.b] : 0) | (n.c >= 0 ? depends[n.c] : 0);
+
+        Instruction in = {
+          n.op,
+          reg[i],
+          reg[n.a],
+          n.b >= 0 ? reg[n.b] : -1,
+          n.c >= 0 ? reg[n.c] : -1,
+          (depends[n.a] & 1) != 0,
+          n.b >= 0 && (depends[n.b] & 1) != 0,
+          n.c >= 0 && (depends[n.c] & 1) != 0
+        };
+
+        levels[levelOf(depends[i])].push_back(in);
+      }
+    }
+
+    // An instruction's level is never lower than its operands', so running
+    // the levels in order keeps operands before their uses
+    program.clear();
+
+    for(int i = 0; i < TOTAL_LEVELS; ++i) {
+      level_start[i] = program.size();
+      program.insert(program.end(), levels[i].begin(), levels[i].end());
+    }
+
+    level_start[TOTAL_LEVELS] = program.size();
+    result_register = reg[result];
+    result_row = (depends[result] & 1) != 0;
+  }
+
+  // Checks if the result compares y with a height that doesn't depend on y,
+  // and if so compiles the height into its own formula
+  void findHeight(int result, bool use_jit) {
+    const Node& n = nodes[result];
+
+    height.reset();
+
+    if(n.op != FORMULA_LT && n.op != FORMULA_GT && n.op != FORMULA_LE && n.op != FORMULA_GE)
+      return;
+
+    int op = n.op;
+    int h = n.b;
+
+    if(nodes[n.b].op == FORMULA_Y) {
+      // h op y is y op' h
+      op = op == FORMULA_LT ? FORMULA_GT :
+        op == FORMULA_GT ? FORMULA_LT :
+        op == FORMULA_LE ? FORMULA_GE :
+        FORMULA_LE;
+      h = n.a;
+    }
+    else if(nodes[n.a].op != FORMULA_Y) {
+      return;
+    }
+
+    if(dependsOnY(h))
+      return;
+
+    height = std::make_shared<Formula>();
+    height->source = source;
+    height->seed = seed;
+    height->parameter_names = parameter_names;
+    height->parameter_values = parameter_values;
+    height->nodes = nodes;
+    height->emit(h);
+    height->total_operations = total_operations;
+
+    if(use_jit)
+      height->compileJit();
+
+    height_op = op;
+  }
+
+  bool dependsOnY(int node) const {
+    std::vector<bool> y(node + 1, false);
+
+    for(int i = 0; i <= node; ++i) {
+      const Node& n = nodes[i];
+
+      y[i] = n.op == FORMULA_Y ||
+        (n.a >= 0 && y[n.a]) ||
+        (n.b >= 0 && y[n.b]) ||
+        (n.c >= 0 && y[n.c]);
+    }
+
+    return y[node];
+  }
+
+  static int levelOf(int depends) {
+    if(depends & 1)
+      return LEVEL_VOXEL;
+
+    if(depends & 2)
+      return LEVEL_ROW;
+
+    if(depends & 4)
+      return LEVEL_SLICE;
+
+    return LEVEL_BLOCK;
+  }
+
+  void execute(const Instruction& in, float* registers) const {
+    if(in.c >= 0)
+      registers[in.dst] = applyTernary(in.op, registers[in.a], registers[in.b], registers[in.c], seed);
+    else
+      registers[in.dst] = apply(in.op, registers[in.a], in.b >= 0 ? registers[in.b] : 0);
+  }
+
+  void run(int level, float* registers) const {
+    for(int i = level_start[level]; i < level_start[level + 1]; ++i)
+      execute(program[i], registers);
+  }
+
+  // Runs the per-voxel instructions over a row of w voxels. rows holds w
+  // values for every register; operands that don't vary along the row are
+  // read from registers instead.
+  void runRow(const float* registers, float* rows, int w) const {
+    for(int i = level_start[LEVEL_VOXEL]; i < level_start[LEVEL_VOXEL + 1]; ++i) {
+      const Instruction& in = program[i];
+      const float* a = in.a_row ? &rows[in.a * w] : &registers[in.a];
+      const float* b = in.b < 0 ? a : in.b_row ? &rows[in.b * w] : &registers[in.b];
+      int sa = in.a_row;
+      int sb = in.b < 0 ? sa : in.b_row;
+      float* out = &rows[in.dst * w];
+
+      if(in.op == FORMULA_SELECT) {
+        const float* c = in.c_row ? &rows[in.c * w] : &registers[in.c];
+        int sc = in.c_row;
+
+        for(int j = 0; j < w; ++j)
+          out[j] = a[j * sa] ? b[j * sb] : c[j * sc];
+
+        continue;
+      }
+
+      if(isNoise(in.op)) {
+        const float* c = in.c_row ? &rows[in.c * w] : &registers[in.c];
+
+        noiseRow(in.op, a, sa, b, sb, c, in.c_row, out, w);
+        continue;
+      }
+
+      switch(in.op) {
+        case FORMULA_ADD: rowLoop(a, sa, b, sb, out, w, [](float a, float b) -> float { return a + b; }); break;
+        case FORMULA_SUB: rowLoop(a, sa, b, sb, out, w, [](float a, float b) -> float { return a - b; }); break;
+        case FORMULA_MUL: rowLoop(a, sa, b, sb, out, w, [](float a, float b) -> float { return a * b; }); break;
+        case FORMULA_DIV: rowLoop(a, sa, b, sb, out, w, [](float a, float b) -> float { return a / b; }); break;
+        case FORMULA_LT: rowLoop(a, sa, b, sb, out, w, [](float a, float b) -> float { return a < b; }); break;
+        case FORMULA_GT: rowLoop(a, sa, b, sb, out, w, [](float a, float b) -> float { return a > b; }); break;
+        case FORMULA_LE: rowLoop(a, sa, b, sb, out, w, [](float a, float b) -> float { return a <= b; }); break;
+        case FORMULA_GE: rowLoop(a, sa, b, sb, out, w, [](float a, float b) -> float { return a >= b; }); break;
+        default: {
+          int op = in.op;
+
+          rowLoop(a, sa, b, sb, out, w, [op](float a, float b) -> float { return apply(op, a, b); });
+        }
+      }
+    }
+  }
+
+  // Evaluates noise 8 voxels at a time. Operands with stride 0 are the same
+  // for the whole row.
+  void noiseRow(int op, const float* a, int sa, const float* b, int sb, const float* c, int sc, float* out, int w) const {
+    Noise8Function f = noise8Function();
+    float lanes[4][8];
+
+    for(int i = 0; i < w; i += 8) {
+      int n = std::min(8, w - i);
+
+      for(int j = 0; j < 8; ++j) {
+        int k = i + std::min(j, n - 1);
+
+        lanes[0][j] = a[k * sa];
+        lanes[1][j] = b[k * sb];
+        lanes[2][j] = c[k * sc];
+      }
+
+      f(op - FORMULA_PERLIN, lanes[0], lanes[1], lanes[2], lanes[3], seed);
+      std::copy(lanes[3], lanes[3] + n, out + i);
+    }
+  }
+
+  template<typename F>
+  static void rowLoop(const float* a, int sa, const float* b, int sb, float* out, int w, F f) {
+    if(sa && sb) {
+      for(int i = 0; i < w; ++i)
+        out[i] = f(a[i], b[i]);
+    }
+    else if(sa) {
+      float vb = *b;
+
+      for(int i = 0; i < w; ++i)
+        out[i] = f(a[i], vb);
+    }
+    else {
+      float va = *a;
+
+      for(int i = 0; i < w; ++i)
+        out[i] = f(va, b[i * sb]);
+    }
+  }
+
+  // Translates the per-voxel instructions into AVX code for
+  //
+  //   void row(const float* registers, float* scratch, float* out, long groups)
+  //
+  // which evaluates groups * 8 voxels of a row into out. scratch holds 8
+  // floats for every register (the values for the current 8 voxels, starting
+  // with x, x + 1, ..., x + 7 for the x register) and 3 temporaries. Operands
+  // that don't vary along the row are broadcast from registers. cos, sin and
+  // ^ call apply() for every lane and noise calls noise8(), so every
+  // operation rounds exactly like the interpreter.
+  //
+  // Values are kept in ymm3-ymm15 from the instruction computing them to
+  // their last use, unless they have to live across a call (calls clobber
+  // every ymm register) or no register is free; those go to scratch. ymm0-2
+  // are temporaries.
+  void compileJit() {
+    if(!jitSupported() || level_start[LEVEL_VOXEL] == level_start[TOTAL_LEVELS])
+      return;
+
+    typedef X86Emitter E;
+
+    const int ONE = 0;
+    const int ABS_MASK = 32;
+    const int EIGHT = 64;
+    const int ZERO = 96;
+    const int CODE_START = 128;
+    const int IN_MEMORY = -1;
+
+    E e;
+    int total = totalRegisters();
+    int temp[3] = { total * 32, (total + 1) * 32, (total + 2) * 32 };
+    int first = level_start[LEVEL_VOXEL];
+    int count = level_start[LEVEL_VOXEL + 1] - first;
+
+    // Where each register is, and the last instruction using it (count for
+    // the result)
+    std::vector<int> ymm(total, IN_MEMORY);
+    std::vector<int> last_use(total, -1);
+    std::vector<int> free_ymm;
+    std::vector<int> calls;
+
+    for(int i = 0; i < count; ++i) {
+      const Instruction& in = program[first + i];
+
+      if(in.a_row)
+        last_use[in.a] = i;
+
+      if(in.b >= 0 && in.b_row)
+        last_use[in.b] = i;
+
+      if(in.c >= 0 && in.c_row)
+        last_use[in.c] = i;
+
+      if(!isNative(in.op))
+        calls.push_back(i);
+    }
+
+    last_use[result_register] = count;
+
+    for(int i = 15; i >= 3; --i)
+      free_ymm.push_back(i);
+
+    // Constants, 8 of each
+    float one = 1;
+    float eight = 8;
+
+    for(int i = 0; i < 8; ++i)
+      e.int32(bits(one));
+
+    for(int i = 0; i < 8; ++i)
+      e.int32(0x7FFFFFFF);
+
+    for(int i = 0; i < 8; ++i)
+      e.int32(bits(eight));
+
+    for(int i = 0; i < 8; ++i)
+      e.int32(0);
+
+    while(e.offset() < CODE_START)
+      e.byte(0xCC);
+
+    // Pushing 5 registers on top of the return address keeps the stack 16
+    // byte aligned for calls
+    e.push(E::RBX);
+    e.push(E::R12);
+    e.push(E::R13);
+    e.push(E::R14);
+    e.push(E::R15);
+    e.mov(E::RBX, E::RDI);
+    e.mov(E::R12, E::RSI);
+    e.mov(E::R13, E::RDX);
+    e.mov(E::R14, E::RCX);
+    e.leaRip(E::R15, 0);
+
+    size_t loop = e.offset();
+
+    for(int i = 0; i < count; ++i) {
+      const Instruction& in = program[first + i];
+      bool binary = in.b >= 0;
+
+      // Operands, loaded into ymm0, ymm1 and ymm2 unless they're in a register
+      int ra = operand(e, in.a, in.a_row, ymm, 0);
+      int rb = binary ? operand(e, in.b, in.b_row, ymm, 1) : ra;
+      int rc = in.c >= 0 ? operand(e, in.c, in.c_row, ymm, 2) : ra;
+
+      if(in.a_row && last_use[in.a] == i && ymm[in.a] != IN_MEMORY)
+        free_ymm.push_back(ymm[in.a]);
+
+      if(binary && in.b_row && in.b != in.a && last_use[in.b] == i && ymm[in.b] != IN_MEMORY)
+        free_ymm.push_back(ymm[in.b]);
+
+      if(in.c >= 0 && in.c_row && in.c != in.a && in.c != in.b && last_use[in.c] == i && ymm[in.c] != IN_MEMORY)
+        free_ymm.push_back(ymm[in.c]);
+
+      if(isNoise(in.op)) {
+        // noise8(type, a, b, c, out, seed)
+        e.vstore(E::R12, temp[0], ra);
+        e.vstore(E::R12, temp[1], rb);
+        e.vstore(E::R12, temp[2], rc);
+        e.vzeroupper();
+        e.movImm32(E::RDI, in.op - FORMULA_PERLIN);
+        e.lea(E::RSI, E::R12, temp[0]);
+        e.lea(E::RDX, E::R12, temp[1]);
+        e.lea(E::RCX, E::R12, temp[2]);
+        e.lea(E::R8, E::R12, in.dst * 32);
+        e.movImm32(E::R9, seed);
+        e.movImm64(E::RAX, (uint64_t)noise8Function());
+        e.call(E::RAX);
+        continue;
+      }
+
+      if(!isNative(in.op)) {
+        // applyGroup(op, a, b, out)
+        e.vstore(E::R12, temp[0], ra);
+        e.vstore(E::R12, temp[1], rb);
+        e.vzeroupper();
+        e.movImm32(E::RDI, in.op);
+        e.lea(E::RSI, E::R12, temp[0]);
+        e.lea(E::RDX, E::R12, temp[1]);
+        e.lea(E::RCX, E::R12, in.dst * 32);
+        e.movImm64(E::RAX, (uint64_t)&applyGroup);
+        e.call(E::RAX);
+        continue;
+      }
+
+      bool crosses_call = false;
+
+      for(int j = 0; j < (int)calls.size(); ++j)
+        crosses_call |= calls[j] > i && calls[j] < last_use[in.dst];
+
+      int d = 0;
+
+      if(!crosses_call && free_ymm.size() != 0) {
+        d = free_ymm.back();
+        free_ymm.pop_back();
+        ymm[in.dst] = d;
+      }
+
+      switch(in.op) {
+        case FORMULA_ADD: e.vop(E::VADDPS, d, ra, rb); break;
+        case FORMULA_SUB: e.vop(E::VSUBPS, d, ra, rb); break;
+        case FORMULA_MUL: e.vop(E::VMULPS, d, ra, rb); break;
+        case FORMULA_DIV: e.vop(E::VDIVPS, d, ra, rb); break;
+        case FORMULA_SQRT: e.vsqrt(d, ra); break;
+        case FORMULA_ABS: e.vopMem(E::VANDPS, d, ra, E::R15, ABS_MASK); break;
+
+        case FORMULA_LT:
+        case FORMULA_GT:
+        case FORMULA_LE:
+        case FORMULA_GE:
+          e.vcmp(d, ra, rb, in.op == FORMULA_LT ? E::CMP_LT_OS :
+            in.op == FORMULA_GT ? E::CMP_GT_OS :
+            in.op == FORMULA_LE ? E::CMP_LE_OS :
+            E::CMP_GE_OS);
+          e.vopMem(E::VANDPS, d, d, E::R15, ONE);
+          break;
+
+        case FORMULA_EQ:
+          e.vop(E::VSUBPS, d, ra, rb);
+          e.vopMem(E::VANDPS, d, d, E::R15, ABS_MASK);
+          e.vcmpMem(d, d, E::R15, ONE, E::CMP_LT_OS);
+          e.vopMem(E::VANDPS, d, d, E::R15, ONE);
+          break;
+
+        case FORMULA_AND:
+        case FORMULA_OR:
+          // Like C, NaN counts as true. b is compared first since d may be
+          // the register b was in.
+          e.vop(E::VXORPS, 2, 2, 2);
+          e.vcmp(1, rb, 2, E::CMP_NEQ_UQ);
+          e.vcmp(d, ra, 2, E::CMP_NEQ_UQ);
+          e.vop(in.op == FORMULA_AND ? E::VANDPS : E::VORPS, d, d, 1);
+          e.vopMem(E::VANDPS, d, d, E::R15, ONE);
+          break;
+
+        case FORMULA_NOT:
+          e.vop(E::VXORPS, 2, 2, 2);
+          e.vcmp(d, ra, 2, E::CMP_EQ_OQ);
+          e.vopMem(E::VANDPS, d, d, E::R15, ONE);
+          break;
+
+        case FORMULA_SELECT:
+          // (mask & b) | (~mask & c), with the mask in ymm0. ymm0 is either
+          // free or holds a, and ymm2 either free or holds c, so neither
+          // overwrites an operand still needed; d is written last since it
+          // may be the register a, b or c was in.
+          e.vcmpMem(0, ra, E::R15, ZERO, E::CMP_NEQ_UQ);
+          e.vop(E::VANDNPS, 2, 0, rc);
+          e.vop(E::VANDPS, 0, 0, rb);
+          e.vop(E::VORPS, d, 0, 2);
+          break;
+      }
+
+      if(ymm[in.dst] == IN_MEMORY)
+        e.vstore(E::R12, in.dst * 32, d);
+    }
+
+    e.vstore(E::R13, 0, operand(e, result_register, true, ymm, 0));
+
+    // Next 8 voxels
+    e.vload(0, E::R12, input_register[0] * 32);
+    e.vopMem(E::VADDPS, 0, 0, E::R15, EIGHT);
+    e.vstore(E::R12, input_register[0] * 32, 0);
+    e.addImm8(E::R13, 32);
+    e.dec(E::R14);
+    e.jnz(loop);
+
+    e.vzeroupper();
+    e.pop(E::R15);
+    e.pop(E::R14);
+    e.pop(E::R13);
+    e.pop(E::R12);
+    e.pop(E::RBX);
+    e.ret();
+
+    std::shared_ptr<ExecutableCode> code = std::make_shared<ExecutableCode>();
+
+    if(!code->load(e.code))
+      return;
+
+    jit = code;
+    row_function = (RowFunction)jit->address(CODE_START);
+
+    if(!jitMatchesInterpreter()) {
+      row_function = NULL;
+      jit.reset();
+    }
+  }
+
+  // Evaluates a probe block around the origin (with a partial group of 8 at
+  // the end of each row) with the generated code and with the interpreter.
+  // Any bit that differs means the JIT is wrong for this formula, which is
+  // then left to the interpreter. NaNs only have to be NaN on both sides.
+  bool jitMatchesInterpreter() {
+    const int X = -9, Y = -3, Z = -2, W = 19, H = 6, D = 4, R = 16;
+
+    std::vector<float> compiled, interpreted;
+    RowFunction f = row_function;
+
+    evaluateVoxels(X, Y, Z, W, H, D, R, [&](int, int, const float* values) {
+      compiled.insert(compiled.end(), values, values + W);
+    });
+
+    row_function = NULL;
+
+    evaluateVoxels(X, Y, Z, W, H, D, R, [&](int, int, const float* values) {
+      interpreted.insert(interpreted.end(), values, values + W);
+    });
+
+    row_function = f;
+
+    for(int i = 0; i < (int)compiled.size(); ++i) {
+      bool nan = compiled[i] != compiled[i] && interpreted[i] != interpreted[i];
+
+      if(!nan && memcmp(&compiled[i], &interpreted[i], sizeof(float)) != 0)
+        return false;
+    }
+
+    return true;
+  }
+
+  // Operations the JIT does inline; the rest call applyGroup()
+  static bool isNative(int op) {
+    return op != FORMULA_POW && op != FORMULA_COS && op != FORMULA_SIN && !isNoise(op);
+  }
+
+  // Returns the ymm register holding a register's values for the current 8
+  // voxels, loading them into ymm temp if they're not in one
+  static int operand(X86Emitter& e, int reg, bool row, const std::vector<int>& ymm, int temp) {
+    if(!row)
+      e.vbroadcast(temp, X86Emitter::RBX, reg * 4);
+    else if(ymm[reg] < 0)
+      e.vload(temp, X86Emitter::R12, reg * 32);
+    else
+      return ymm[reg];
+
+    return temp;
+  }
+
+  static void applyGroup(int op, const float* a, const float* b, float* out) {
+    for(int i = 0; i < 8; ++i)
+      out[i] = apply(op, a[i], b[i]);
+  }
+
+  static uint32_t bits(float f) {
+    uint32_t b;
+
+    memcpy(&b, &f, sizeof(b));
+
+    return b;
+  }
+
+  void setInputs(int x, int y, int z, int r, float* registers) const {
+    int values[4] = { x, y, z, r };
+
+    for(int i = 0; i < 4; ++i) {
+      if(input_register[i] >= 0)
+        registers[input_register[i]] = values[i];
+    }
+  }
+};
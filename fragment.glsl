@@ -2,11 +2,47 @@
 out vec4 color;
 
 in vec4 fragmentColor;
+in vec3 fragmentPosition_modelspace;
+flat in vec3 faceCorner;
+
+// Color of the tinted faces of the mesh
+uniform vec3 tint;
+
+// Brightness of a face between 0.3 and 1, from a hash of the face: its corner
+// and the direction it faces, found from the slope of the position across the
+// screen. Neither depends on where the face is in the buffers, so the shading
+// stays the same as the mesh is edited and doesn't depend on the color buffer.
+float faceShade() {
+  vec3 n = cross(dFdx(fragmentPosition_modelspace), dFdy(fragmentPosition_modelspace));
+  vec3 a = abs(n);
+  uint axis = a.x > a.y && a.x > a.z ? 0u : a.y > a.z ? 2u : 4u;
+  float side = axis == 0u ? n.x : axis == 2u ? n.y : n.z;
+  uvec3 corner = floatBitsToUint(faceCorner);
+  uint h = axis + (side > 0.0 ? 1u : 0u);
+  
+  h = (h * 0x9e3779b9u) ^ corner.x;
+  h = (h * 0x9e3779b9u) ^ corner.y;
+  h = (h * 0x9e3779b9u) ^ corner.z;
+  
+  h ^= h >> 16;
+  h *= 0x7feb352du;
+  h ^= h >> 15;
+  h *= 0x846ca68bu;
+  h ^= h >> 16;
+  
+  return 0.3 + 0.7 * float(h & 0xffffu) / 65535.0;
+}
 
 void main(){
-  color = fragmentColor;
+  // Derivatives are only defined before any fragment is discarded
+  float shade = faceShade();
   
-  if(color.a == 0) {
+  // Alpha 0: hidden, 1: tinted, 2: painted with the vertex color
+  if(fragmentColor.a < 0.5) {
     discard;
   }
-}
\ No newline at end of file
+  
+  vec3 base = fragmentColor.a > 1.5 ? fragmentColor.rgb : tint;
+  
+  color = vec4(base * shade, 1);
+}
@@ -1,20 +1,30 @@
+#pragma once
+
 #include <cstring>
 #include <vector>
 #include <algorithm>
 #include <string>
 #include <cctype>
+#include <memory>
+#include <functional>
+#include <atomic>
+#include <thread>
+#include <stdint.h>
 
 #include "glm/glm.hpp"
+#include "formula.hpp"
+#include "bitgrid.hpp"
 
 struct Triangle {
   glm::vec3 v[3];
-  float r, g, b;
+  int material;       // Value of the voxel the face belongs to
 };
 
 struct Quad {
   glm::vec3 v[4];
   
-  void triangulate(Triangle& a, Triangle& b) {
+  // Both triangles end with v[2], which the shaders use to tell faces apart
+  void triangulate(Triangle& a, Triangle& b, int material) {
     a.v[0] = v[0];
     a.v[1] = v[1];
     a.v[2] = v[2];
@@ -22,6 +32,9 @@ struct Quad {
     b.v[0] = v[3];
     b.v[1] = v[0];
     b.v[2] = v[2];
+    
+    a.material = material;
+    b.material = material;
   }
 };
 
@@ -82,6 +95,68 @@ struct Cube {
   
 };
 
+// Edge length (in voxels) of the cubic chunks that grids are split into for
+// per-chunk processing (LOD, storage, persistence)
+const int GRID_CHUNK_SHIFT = 4;
+const int GRID_CHUNK_SIZE = 1 << GRID_CHUNK_SHIFT;
+
+// Splits a grid into chunks of GRID_CHUNK_SIZE^3 voxels. Chunks on the far
+// edges of the grid are cut short if the size isn't a multiple of the chunk size.
+struct ChunkGrid {
+  int x_size, y_size, z_size;
+  int chunks_x, chunks_y, chunks_z;
+  
+  ChunkGrid() {
+    init(0, 0, 0);
+  }
+  
+  ChunkGrid(int xx, int yy, int zz) {
+    init(xx, yy, zz);
+  }
+  
+  void init(int xx, int yy, int zz) {
+    x_size = xx;
+    y_size = yy;
+    z_size = zz;
+    
+    chunks_x = (xx + GRID_CHUNK_SIZE - 1) >> GRID_CHUNK_SHIFT;
+    chunks_y = (yy + GRID_CHUNK_SIZE - 1) >> GRID_CHUNK_SHIFT;
+    chunks_z = (zz + GRID_CHUNK_SIZE - 1) >> GRID_CHUNK_SHIFT;
+  }
+  
+  int total() const {
+    return chunks_x * chunks_y * chunks_z;
+  }
+  
+  int index(int cx, int cy, int cz) const {
+    return cx + cy * chunks_x + cz * chunks_y * chunks_x;
+  }
+  
+  // Chunk containing voxel (x, y, z)
+  int chunkOf(int x, int y, int z) const {
+    return index(x >> GRID_CHUNK_SHIFT, y >> GRID_CHUNK_SHIFT, z >> GRID_CHUNK_SHIFT);
+  }
+  
+  // Voxels covered by a chunk: [x1, x2) x [y1, y2) x [z1, z2)
+  void bounds(int chunk, int& x1, int& y1, int& z1, int& x2, int& y2, int& z2) const {
+    x1 = (chunk % chunks_x) << GRID_CHUNK_SHIFT;
+    y1 = ((chunk / chunks_x) % chunks_y) << GRID_CHUNK_SHIFT;
+    z1 = (chunk / (chunks_x * chunks_y)) << GRID_CHUNK_SHIFT;
+    
+    x2 = std::min(x1 + GRID_CHUNK_SIZE, x_size);
+    y2 = std::min(y1 + GRID_CHUNK_SIZE, y_size);
+    z2 = std::min(z1 + GRID_CHUNK_SIZE, z_size);
+  }
+  
+  int volume(int chunk) const {
+    int x1, y1, z1, x2, y2, z2;
+    
+    bounds(chunk, x1, y1, z1, x2, y2, z2);
+    
+    return (x2 - x1) * (y2 - y1) * (z2 - z1);
+  }
+};
+
 struct TriangleRun {
   int start;
   int end;
@@ -93,7 +168,123 @@ struct TriangleRun {
   }
 };
 
-template<typename T>
+// Spreads the lower 10 bits of v so there are two zero bits between each one
+inline uint32_t mortonSpread(uint32_t v) {
+  v = (v | (v << 16)) & 0x030000FF;
+  v = (v | (v << 8)) & 0x0300F00F;
+  v = (v | (v << 4)) & 0x030C30C3;
+  v = (v | (v << 2)) & 0x09249249;
+  
+  return v;
+}
+
+// Inverse of mortonSpread()
+inline uint32_t mortonCompact(uint32_t v) {
+  v &= 0x09249249;
+  v = (v | (v >> 2)) & 0x030C30C3;
+  v = (v | (v >> 4)) & 0x0300F00F;
+  v = (v | (v >> 8)) & 0x030000FF;
+  v = (v | (v >> 16)) & 0x000003FF;
+  
+  return v;
+}
+
+inline uint32_t mortonEncode(int x, int y, int z) {
+  return mortonSpread(x) | (mortonSpread(y) << 1) | (mortonSpread(z) << 2);
+}
+
+inline void mortonDecode(uint32_t code, int& x, int& y, int& z) {
+  x = mortonCompact(code);
+  y = mortonCompact(code >> 1);
+  z = mortonCompact(code >> 2);
+}
+
+// Layout policies decide where voxel (x, y, z) lives in Grid3D::data
+
+// Row major: x, then y, then z
+struct LinearLayout {
+  int x_size, y_size, z_size;
+  
+  void init(int xx, int yy, int zz) {
+    x_size = xx;
+    y_size = yy;
+    z_size = zz;
+  }
+  
+  int size() {
+    return x_size * y_size * z_size;
+  }
+  
+  int index(int x, int y, int z) {
+    return x + y * x_size + z * y_size * x_size;
+  }
+};
+
+// The grid is split into bricks of GRID_CHUNK_SIZE^3 voxels stored one after
+// the other. Voxels inside a brick are in Morton (Z-order), so neighbors in
+// any direction and the octants of any aligned power of two cube are close
+// together in memory. Sizes are padded up to a whole number of bricks.
+struct MortonLayout {
+  int bricks_x, bricks_y, bricks_z;
+  
+  void init(int xx, int yy, int zz) {
+    bricks_x = (xx + GRID_CHUNK_SIZE - 1) >> GRID_CHUNK_SHIFT;
+    bricks_y = (yy + GRID_CHUNK_SIZE - 1) >> GRID_CHUNK_SHIFT;
+    bricks_z = (zz + GRID_CHUNK_SIZE - 1) >> GRID_CHUNK_SHIFT;
+  }
+  
+  int size() {
+    return bricks_x * bricks_y * bricks_z * GRID_CHUNK_SIZE * GRID_CHUNK_SIZE * GRID_CHUNK_SIZE;
+  }
+  
+  int index(int x, int y, int z) {
+    const int mask = GRID_CHUNK_SIZE - 1;
+    int brick = (x >> GRID_CHUNK_SHIFT) + ((y >> GRID_CHUNK_SHIFT) + (z >> GRID_CHUNK_SHIFT) * bricks_y) * bricks_x;
+    
+    return (brick << (GRID_CHUNK_SHIFT * 3)) + mortonEncode(x & mask, y & mask, z & mask);
+  }
+  
+  // Inverse of index()
+  void position(int index, int& x, int& y, int& z) {
+    int brick = index >> (GRID_CHUNK_SHIFT * 3);
+    
+    mortonDecode(index & ((1 << (GRID_CHUNK_SHIFT * 3)) - 1), x, y, z);
+    
+    x += (brick % bricks_x) << GRID_CHUNK_SHIFT;
+    y += ((brick / bricks_x) % bricks_y) << GRID_CHUNK_SHIFT;
+    z += (brick / (bricks_x * bricks_y)) << GRID_CHUNK_SHIFT;
+  }
+};
+
+// Bricks of GRID_CHUNK_SIZE^3 voxels like MortonLayout, but the voxels of a
+// brick are ordered like the chunks of a grid file: x, then y, then z. A raw
+// chunk of a file can then be mapped straight into its brick (see
+// loadMappedGrid()).
+struct BrickLayout {
+  int bricks_x, bricks_y, bricks_z;
+  
+  void init(int xx, int yy, int zz) {
+    bricks_x = (xx + GRID_CHUNK_SIZE - 1) >> GRID_CHUNK_SHIFT;
+    bricks_y = (yy + GRID_CHUNK_SIZE - 1) >> GRID_CHUNK_SHIFT;
+    bricks_z = (zz + GRID_CHUNK_SIZE - 1) >> GRID_CHUNK_SHIFT;
+  }
+  
+  int size() {
+    return bricks_x * bricks_y * bricks_z * GRID_CHUNK_SIZE * GRID_CHUNK_SIZE * GRID_CHUNK_SIZE;
+  }
+  
+  int index(int x, int y, int z) {
+    const int mask = GRID_CHUNK_SIZE - 1;
+    int brick = (x >> GRID_CHUNK_SHIFT) + ((y >> GRID_CHUNK_SHIFT) + (z >> GRID_CHUNK_SHIFT) * bricks_y) * bricks_x;
+    
+    return (brick << (GRID_CHUNK_SHIFT * 3)) + (x & mask) + (((y & mask) + ((z & mask) << GRID_CHUNK_SHIFT)) << GRID_CHUNK_SHIFT);
+  }
+};
+
+template<typename T, typename Layout>
+class GridSnapshot;
+
+template<typename T, typename Layout = LinearLayout>
 class Grid3D {
 public:
   T* data;
@@ -101,11 +292,39 @@ public:
   float grid_dx, grid_dy, grid_dz;
   float voxel_radius;
   TriangleRun* triangle_run;
+  Layout layout;
   
+  // Snapshot that chunks are copied into before they change, NULL if none is
+  // pinned (see GridSnapshot)
+  GridSnapshot<T, Layout>* pinned;
+  
+  
+  // Frees data when the grid is destroyed
+  std::function<void(T*)> free_data;
   
   Grid3D(int xx, int yy, int zz, float dx, float dy, float dz, T default_value) {
-    data = new T[xx * yy * zz];
-    triangle_run = new TriangleRun[xx * yy * zz];
+    init(xx, yy, zz, dx, dy, dz);
+    
+    data = new T[layout.size()];
+    free_data = [](T* d) { delete [] d; };
+    
+    for(int i = 0; i < layout.size(); ++i)
+      data[i] = default_value;
+  }
+  
+  // Wraps layout.size() voxels that are already in the layout of the grid
+  // and were allocated by someone else, who frees them with free_voxels
+  Grid3D(int xx, int yy, int zz, float dx, float dy, float dz, T* voxels, std::function<void(T*)> free_voxels) {
+    init(xx, yy, zz, dx, dy, dz);
+    
+    data = voxels;
+    free_data = free_voxels;
+  }
+  
+  void init(int xx, int yy, int zz, float dx, float dy, float dz) {
+    layout.init(xx, yy, zz);
+    
+    triangle_run = new TriangleRun[layout.size()];
     
     x_size = xx;
     y_size = yy;
@@ -115,8 +334,9 @@ public:
     grid_dy = dy;
     grid_dz = dz;
     
-    for(int i = 0; i < xx * yy * zz; ++i) {
-      data[i] = default_value;
+    pinned = NULL;
+    
+    for(int i = 0; i < layout.size(); ++i) {
       triangle_run[i].start = -1;
       triangle_run[i].end = -1;
     }
@@ -125,18 +345,54 @@ public:
     voxel_radius = sqrt(3 * r * r) * .75;
   }
   
+  ~Grid3D() {
+    free_data(data);
+    delete [] triangle_run;
+  }
+  
+  // Grids own their data, so they can't be copied
+  Grid3D(const Grid3D&) = delete;
+  Grid3D& operator=(const Grid3D&) = delete;
+  
   bool validPos(int x, int y, int z) {
     return x >= 0 && x < x_size && y >= 0 && y < y_size && z >= 0 && z < z_size;
   }
   
+  // The voxel may be written through the returned reference, so its chunk is
+  // copied into the pinned snapshot first (once per snapshot)
   T& get(int x, int y, int z) {
-    return data[x + y * x_size + z * y_size * x_size];
+    if(pinned)
+      pinned->preserve(x, y, z);
+    
+    return data[layout.index(x, y, z)];
+  }
+  
+  // Pins a snapshot of the grid as it is now. Only one snapshot can be pinned
+  // at a time.
+  std::shared_ptr<GridSnapshot<T, Layout> > snapshot() {
+    if(pinned)
+      throw "The grid already has a snapshot";
+    
+    std::shared_ptr<GridSnapshot<T, Layout> > s = std::make_shared<GridSnapshot<T, Layout> >(this);
+    
+    pinned = s.get();
+    
+    return s;
+  }
+  
+  // Stops copying chunks into the pinned snapshot, which must no longer be
+  // read from
+  void releaseSnapshot() {
+    pinned = NULL;
   }
   
   int index(int x, int y, int z) {
-    return x + y * x_size + z * y_size * x_size;
+    return layout.index(x, y, z);
   }
   
+  // True if the given face of voxel (x, y, z) is visible: on the border of the
+  // grid or next to an empty voxel. Faces between solid voxels are hidden
+  // whatever their materials, so they're never generated.
   bool shouldGeneratePoly(int x, int y, int z, int face, T& empty) {
     enum {
       FACE_TOP,
@@ -165,13 +421,10 @@ public:
   }
   
   void generate(T (*eval)(int x, int y, int z, Grid3D& g)) {
-    T* ptr = data;
-    
     for(int z = 0; z < z_size; ++z) {
       for(int y = 0; y < y_size; ++y) {
         for(int x = 0; x < x_size; ++x) {
-          *ptr = eval(x, y, z, *this);
-          ++ptr;
+          get(x, y, z) = eval(x, y, z, *this);
         }
       }
     }
@@ -214,7 +467,7 @@ public:
         Quad q;
         Triangle a, b;
         
-        c.getFace(Cube::oppositeFace(i)).triangulate(a, b);
+        c.getFace(Cube::oppositeFace(i)).triangulate(a, b, (int)get(xx, yy, zz));
         v.push_back(a);
         v.push_back(b);
         new_run->end += 2;
@@ -225,335 +478,312 @@ public:
   }
   
   std::vector<Triangle> triangulate(T empty) {
-    T* ptr = data;
     std::vector<Triangle> t;
     
     for(int z = 0; z < z_size; ++z) {
       for(int y = 0; y < y_size; ++y) {
         for(int x = 0; x < x_size; ++x) {
-          if(*ptr != empty) {
-            int pos = ptr - data;
-            
-            triangle_run[pos].start = t.size();
-            triangle_run[pos].end = (int)t.size() - 1;
-            
-            for(int i = 0; i < 6; ++i) {
-              Cube c;
-              c.x_size = grid_dx;
-              c.y_size = grid_dy;
-              c.z_size = grid_dz;
+          if(data[index(x, y, z)] != empty)
+            triangulateVoxel(x, y, z, empty, t);
+        }
+      }
+    }
+    
+    return t;
+  }
+  
+  // Appends the visible faces of voxel (x, y, z) to t and makes them the only
+  // triangles in its triangle run
+  void triangulateVoxel(int x, int y, int z, T empty, std::vector<Triangle>& t) {
+    int pos = index(x, y, z);
+    
+    clearTriangleRun(pos);
+    
+    triangle_run[pos].start = t.size();
+    triangle_run[pos].end = (int)t.size() - 1;
+    
+    Cube c;
+    c.x_size = grid_dx;
+    c.y_size = grid_dy;
+    c.z_size = grid_dz;
+    
+    c.setPos(glm::vec3(x * grid_dx, y * grid_dy, z * grid_dz));
+    
+    for(int i = 0; i < 6; ++i) {
+      if(shouldGeneratePoly(x, y, z, i, empty)) {
+        Triangle a, b;
+        
+        c.getFace(i).triangulate(a, b, (int)data[pos]);
+        t.push_back(a);
+        t.push_back(b);
+        triangle_run[pos].end += 2;
+      }
+    }
+  }
+  
+  // Forgets the triangles of the voxel at index pos
+  void clearTriangleRun(int pos) {
+    TriangleRun* run = triangle_run[pos].next;
+    
+    while(run) {
+      TriangleRun* next = run->next;
+      delete run;
+      run = next;
+    }
+    
+    triangle_run[pos].start = -1;
+    triangle_run[pos].end = -1;
+    triangle_run[pos].next = NULL;
+  }
+  
+  // Triangulates the voxels in [x1, x2) x [y1, y2) x [z1, z2) without touching
+  // triangle_run. If border_faces is set, faces on the boundary of the region
+  // are always generated instead of being culled against the neighboring voxel.
+  // The visible faces are found 64 voxels at a time on the occupancy of the
+  // region (see BitGrid3D::exposedFaces()).
+  void triangulateRegion(int x1, int y1, int z1, int x2, int y2, int z2, T empty, bool border_faces, std::vector<Triangle>& t) {
+    int w = x2 - x1;
+    int h = y2 - y1;
+    int d = z2 - z1;
+    
+    // The region and the voxels around it, which are left empty outside the
+    // grid or with border_faces so the faces next to them are generated
+    BitGrid3D solid(w + 2, h + 2, d + 2);
+    
+    for(int z = z1 - 1; z <= z2; ++z) {
+      for(int y = y1 - 1; y <= y2; ++y) {
+        for(int x = x1 - 1; x <= x2; ++x) {
+          bool inside = x >= x1 && x < x2 && y >= y1 && y < y2 && z >= z1 && z < z2;
+          
+          if((inside || !border_faces) && validPos(x, y, z) && get(x, y, z) != empty)
+            solid.set(x - x1 + 1, y - y1 + 1, z - z1 + 1, true);
+        }
+      }
+    }
+    
+    Cube c;
+    c.x_size = grid_dx;
+    c.y_size = grid_dy;
+    c.z_size = grid_dz;
+    
+    for(int i = 0; i < 6; ++i) {
+      BitGrid3D exposed = solid.exposedFaces(i);
+      
+      for(int z = 1; z <= d; ++z) {
+        for(int y = 1; y <= h; ++y) {
+          uint64_t* row = exposed.row(y, z);
+          
+          for(int word = 0; word < exposed.words_per_row; ++word) {
+            for(uint64_t bits = row[word]; bits != 0; bits &= bits - 1) {
+              int x = word * 64 + __builtin_ctzll(bits);
               
-              c.setPos(glm::vec3(x * grid_dx, y * grid_dy, z * grid_dz));
+              // Skips the voxels around the region
+              if(x == 0 || x > w)
+                continue;
               
-              if(shouldGeneratePoly(x, y, z, i, empty)) {
-                Quad q;
-                Triangle a, b;
-                
-                c.getFace(i).triangulate(a, b);
-                t.push_back(a);
-                t.push_back(b);
-                triangle_run[pos].end += 2;
-              }
+              int xx = x1 + x - 1;
+              int yy = y1 + y - 1;
+              int zz = z1 + z - 1;
+              Triangle a, b;
+              
+              c.setPos(glm::vec3(xx * grid_dx, yy * grid_dy, zz * grid_dz));
+              c.getFace(i).triangulate(a, b, (int)get(xx, yy, zz));
+              t.push_back(a);
+              t.push_back(b);
             }
           }
-          
-          ++ptr;
         }
       }
     }
-    
-    return t;
   }
   
-  
 };
 
-template<typename T>
-class Grid3D_Helper {
+// Read only view of a Grid3D as it was when Grid3D::snapshot() was called,
+// for reading the grid on another thread while it's edited. Taking it copies
+// nothing: while it's pinned, the grid copies a chunk into it the first time
+// get() is called on the chunk, before the caller can change it. Copied
+// chunks are read from their copy, the others straight from the grid.
+//
+// Every chunk has a state that the grid and the readers switch with compare
+// and swap, so a chunk is never copied while a reader reads it from the grid
+// (or read while it's being copied). Pinning and releasing only happen on the
+// thread that owns the grid, so whether a write has to copy never depends on
+// when another thread drops its reference to the snapshot.
+template<typename T, typename Layout>
+class GridSnapshot {
 public:
-  static std::string expression;
+  enum {
+    CHUNK_LIVE,       // Unchanged, read from the grid
+    CHUNK_READING,    // Being read from the grid
+    CHUNK_COPYING,    // Being copied before a write
+    CHUNK_COPIED      // Read from copies
+  };
   
-  static T generateCircle(int x, int y, int z, Grid3D<T> &g) {
-    int r = std::min(g.x_size, std::min(g.y_size, g.z_size)) / 2;
+  Grid3D<T, Layout>* grid;
+  int x_size, y_size, z_size;
+  float grid_dx, grid_dy, grid_dz;
+  ChunkGrid chunks;
+  std::unique_ptr<std::atomic<int>[]> state;
+  std::vector<std::unique_ptr<T[]> > copies;   // Voxels of the copied chunks, x fastest
+  std::atomic<int> total_copies;
+  
+  GridSnapshot(Grid3D<T, Layout>* g) : chunks(g->x_size, g->y_size, g->z_size) {
+    grid = g;
+    x_size = g->x_size;
+    y_size = g->y_size;
+    z_size = g->z_size;
+    grid_dx = g->grid_dx;
+    grid_dy = g->grid_dy;
+    grid_dz = g->grid_dz;
+    total_copies = 0;
     
-    x = x - g.x_size / 2;
-    y = y - g.y_size / 2;
-    z = z - g.z_size / 2;
+    state.reset(new std::atomic<int>[chunks.total()]);
+    copies.resize(chunks.total());
     
-    return x * x + y * y + z * z < r * r;
+    for(int i = 0; i < chunks.total(); ++i)
+      state[i] = CHUNK_LIVE;
   }
   
-  static T generateCone(int x, int y, int z, Grid3D<T> &g) {
-    int r = (std::min(g.x_size, g.z_size) / 2) * (float)y / g.y_size;
-    
-    x = x - g.x_size / 2;
-    z = z - g.z_size / 2;
-    
-    return x * x + z * z < r * r;
+  bool validPos(int x, int y, int z) const {
+    return x >= 0 && x < x_size && y >= 0 && y < y_size && z >= 0 && z < z_size;
   }
   
-  static bool isOperator(char c) {
-    return c == '+' ||
-      c == '-' ||
-      c == '*' ||
-      c == '/' ||
-      c == '^' ||
-      c == '=' ||
-      c == '<' ||
-      c == '>' ||
-      c == '!' ||
-      c == '@' ||
-      c == '&' ||
-      c == '|';
+  // Copies the chunk holding voxel (x, y, z) unless it already was. Called
+  // by the grid, possibly from several threads writing to different chunks.
+  void preserve(int x, int y, int z) {
+    int chunk = chunks.chunkOf(x, y, z);
+    
+    while(state[chunk] != CHUNK_COPIED) {
+      int s = CHUNK_LIVE;
+      
+      if(state[chunk].compare_exchange_weak(s, CHUNK_COPYING)) {
+        copies[chunk].reset(new T[chunks.volume(chunk)]);
+        readLive(chunk, copies[chunk].get());
+        ++total_copies;
+        state[chunk] = CHUNK_COPIED;
+        return;
+      }
+      
+      if(s != CHUNK_COPIED)
+        std::this_thread::yield();
+    }
   }
   
-  static float evalParenthesis(char* start, char* end) {
-    return evalParenthesis(start + 1, end - 1);
+  // Reads the voxels of a chunk, x fastest, then y, then z
+  void readChunk(int chunk, T* out) {
+    for(;;) {
+      int s = CHUNK_LIVE;
+      
+      if(state[chunk].compare_exchange_weak(s, CHUNK_READING)) {
+        readLive(chunk, out);
+        state[chunk] = CHUNK_LIVE;
+        return;
+      }
+      
+      if(s == CHUNK_COPIED) {
+        std::copy(copies[chunk].get(), copies[chunk].get() + chunks.volume(chunk), out);
+        return;
+      }
+      
+      std::this_thread::yield();
+    }
   }
   
-  static float evaluateExpression(char* start, char* end, int x, int y, int z, Grid3D<T> &g) {
-    std::vector<float> stack;
-    std::vector<std::string> tokens;
-    int r = std::min(g.x_size, std::min(g.y_size, g.z_size)) / 2;
+  T get(int x, int y, int z) {
+    int chunk = chunks.chunkOf(x, y, z);
     
-    while(start < end) {
-      while(start < end && *start == ' ')
-        ++start;
+    for(;;) {
+      int s = CHUNK_LIVE;
       
-      if(isdigit(*start)) {
-        std::string token;
-        
-        while(isdigit(*start) || *start == '.') {
-          token += *start;
-          ++start;
-        }
-        
-        tokens.push_back(token);
-      }
-      else if(isOperator(*start)) {
-        int offset = 1;
-        
-        //printf("Start: %c\n", *start);
-        
-        char old_start = *start;
-        
-        if((*start == '<' || *start == '>') && start[1] == '=') {
-          ++offset;
-          
-          if(*start == '<') {
-            *start = '!';
-          }
-          else {
-            *start = '@';
-          }
-        }
-        
-        
-        tokens.push_back(std::string(start, start + 1));
+      if(state[chunk].compare_exchange_weak(s, CHUNK_READING)) {
+        T v = grid->data[grid->index(x, y, z)];
         
-        *start = old_start;
-        
-        start += offset;
+        state[chunk] = CHUNK_LIVE;
+        return v;
       }
-      else if(isalpha(*start) || *start == '(') {
-        std::string token;
-        bool par = false;
-        
-        while(isalpha(*start) || *start == '(') {
-          token += *start;
-          par |= *start == '(';
-          ++start;
-        }
+      
+      if(s == CHUNK_COPIED) {
+        int x1, y1, z1, x2, y2, z2;
         
-        if(par) {
-          while(start < end && *start != ')') {
-            token += *start;
-            ++start;
-          }
-          
-          if(*start != ')') {
-            throw "Unmatched parenthesis in expression";
-          }
-          else {
-            ++start;
-          }
-          
-          token = "~" + token;
-        }
+        chunks.bounds(chunk, x1, y1, z1, x2, y2, z2);
         
-        tokens.push_back(token);
-      }
-      else {
-        throw "Unexpected character: " + std::string(start, start + 1);
+        return copies[chunk][(x - x1) + ((y - y1) + (z - z1) * (y2 - y1)) * (x2 - x1)];
       }
       
+      std::this_thread::yield();
     }
+  }
+  
+  // Bypasses Grid3D::get(), which would copy the chunk
+  void readLive(int chunk, T* out) {
+    int x1, y1, z1, x2, y2, z2;
     
-    for(int i = 0; i < tokens.size(); ++i) {
-      float value;
-      
-      if(isdigit(tokens[i][0])) {
-        stack.push_back(atof(tokens[i].c_str()));
-      }
-      else if(isOperator(tokens[i][0])) {
-        if(stack.size() < 2) {
-          throw "Too few operands for operator '" + tokens[i] + "'";
-        }
-        
-        float val2 = stack[stack.size() - 1];
-        stack.pop_back();
-        
-        float val1 = stack[stack.size() - 1];
-        stack.pop_back();
-        
-        switch(tokens[i][0]) {
-          case '+':
-            value = val1 + val2;
-            break;
-            
-          case '-':
-            value = val1 - val2;
-            break;
-            
-          case '*':
-            value = val1 * val2;
-            break;
-            
-          case '/':
-            value = val1 / val2;
-            break;
-            
-          case '=':
-            value = abs(val1 - val2) < 1;
-            break;
-            
-          case '<':
-            value = val1 < val2;
-            break;
-            
-          case '>':
-            value = val1 > val2;
-            break;
-            
-          case '!':
-            value = val1 <= val2;
-            break;
-            
-          case '@':
-            value = val1 >= val2;
-            break;
-            
-          case '^':
-            value = pow(val1, val2);
-            break;
-            
-          case '&':
-            value = val1 && val2;
-            break;
-            
-          case '|':
-            value = val1 || val2;
-            break;
+    chunks.bounds(chunk, x1, y1, z1, x2, y2, z2);
+    
+    for(int z = z1; z < z2; ++z) {
+      for(int y = y1; y < y2; ++y) {
+        for(int x = x1; x < x2; ++x) {
+          *out++ = grid->data[grid->index(x, y, z)];
         }
-        
-        stack.push_back(value);
       }
-      else if(tokens[i][0] != '~') {
-        std::string t = tokens[i];
-        
-        if(t == "x")
-          value = x;
-        else if(t == "y")
-          value = y;
-        else if(t == "z")
-          value = z;
-        else if(t == "PI")
-          value = 3.1415926;
-        else if(t == "E")
-          value = 2.71828;
-        else if(t == "cx")
-          value = x - r;
-        else if(t == "cy")
-          value = y - r;
-        else if(t == "cz")
-          value = z - r;
-        else if(t == "r") {
-          value = r;
-        }
-        else if(t == "sr") {
-          float xx = x - r;
-          float yy = y - r;
-          float zz = z - r;
-          
-          value = sqrt(xx * xx + yy * yy + zz * zz);
-        }
-        else if(t == "cr") {
-          float xx = x - r;
-          float yy = y - r;
-          float zz = z - r;
-          
-          value = sqrt(xx * xx + zz * zz);
-        }
-        else if(t == "cos") {
-          float v = stack[stack.size() - 1];
-          stack.pop_back();
-          
-          value = cos(v);
-        }
-        else if(t == "sin") {
-          float v = stack[stack.size() - 1];
-          stack.pop_back();
-          
-          value = cos(v);
-        }
-        
-        else if(t == "sqrt") {
-          float v = stack[stack.size() - 1];
-          stack.pop_back();
-          
-          value = sqrt(v);
-        }
-        else if(t == "abs") {
-          float v = stack[stack.size() - 1];
-          stack.pop_back();
-          
-          value = abs(v);
-        }
-        else if(t == "not") {
-          float v = stack[stack.size() - 1];
-          stack.pop_back();
-          
-          value = !v;
-        }
-        
-        else if(t == "sphere") {
-          int r = std::min(g.x_size, std::min(g.y_size, g.z_size)) / 2;
-          
-          float xx = x - r;
-          float yy = y - r;
-          float zz = z - r;
-          
-          value = xx * xx + yy * yy + zz * zz < r * r;
+    }
+  }
+  
+  template<typename L>
+  void toGrid(Grid3D<T, L>& g) {
+    for(int z = 0; z < z_size; ++z) {
+      for(int y = 0; y < y_size; ++y) {
+        for(int x = 0; x < x_size; ++x) {
+          g.get(x, y, z) = get(x, y, z);
         }
-        
-        stack.push_back(value);
-        
       }
     }
+  }
+};
+
+template<typename T, typename Layout = LinearLayout>
+class Grid3D_Helper {
+public:
+  static T generateCircle(int x, int y, int z, Grid3D<T, Layout> &g) {
+    int r = std::min(g.x_size, std::min(g.y_size, g.z_size)) / 2;
+    
+    x = x - g.x_size / 2;
+    y = y - g.y_size / 2;
+    z = z - g.z_size / 2;
+    
+    return x * x + y * y + z * z < r * r;
+  }
+  
+  static T generateCone(int x, int y, int z, Grid3D<T, Layout> &g) {
+    int r = (std::min(g.x_size, g.z_size) / 2) * (float)y / g.y_size;
+    
+    x = x - g.x_size / 2;
+    z = z - g.z_size / 2;
+    
+    return x * x + z * z < r * r;
+  }
+  
+  static float evalParenthesis(char* start, char* end) {
+    return evalParenthesis(start + 1, end - 1);
+  }
+  
+  static float evaluateExpression(char* start, char* end, int x, int y, int z, Grid3D<T, Layout> &g) {
+    int r = std::min(g.x_size, std::min(g.y_size, g.z_size)) / 2;
     
-    return stack[0];
+    return evaluateExpression(start, end, x, y, z, r);
   }
   
-  static T evalulateVoxelExpression(int x, int y, int z, Grid3D<T>& g) {
-    return evaluateExpression(&expression[0], &expression[expression.size()], x, y, z, g);
+  // Evaluates the expression without a grid. r is the radius used by cx, cy,
+  // cz, sr, cr and sphere (half the smallest dimension of the grid). This
+  // compiles the expression every time; use a Formula to evaluate it more
+  // than once.
+  static float evaluateExpression(char* start, char* end, int x, int y, int z, int r) {
+    return Formula(std::string(start, end)).evaluate(x, y, z, r);
   }
   
-  static T evaluateFormula(Grid3D<T>& g, std::string exp) {
-    expression = exp;
-    g.generate(evalulateVoxelExpression);
+  static void evaluateFormula(Grid3D<T, Layout>& g, std::string exp, uint32_t seed = 0) {
+    Formula(exp, seed).generate(g);
   }
   
 };
-
-template<typename T>
-std::string Grid3D_Helper<T>::expression;
\ No newline at end of file
@@ -0,0 +1,198 @@
+#pragma once
+
+#include <vector>
+#include <string>
+#include <fstream>
+#include <cstdio>
+#include <stdint.h>
+#include <sys/stat.h>
+
+#include "gridfile.hpp"
+
+// Cache of grids generated from formulas, so starting again with the same
+// formulas reads the grids and their meshes from disk instead of generating
+// them. An entry is found by the hash of its key (see gridCacheKey()) and is
+// made of two files in the cache directory:
+//
+//   <hash>.vxg    the grid, as written by saveGrid()
+//   <hash>.mesh   GridCacheHeader, the key, the triangles of the mesh, then
+//                 the triangle run of every voxel as { int32 start, end },
+//                 in the order of the layout of the grid
+//
+// The key stored in the mesh file must match exactly and both files are
+// checksummed, so a hash collision or a damaged entry is a miss instead of a
+// wrong grid. GRID_CACHE_VERSION must be bumped whenever generating or
+// meshing a grid, or the layout of the grids cached, changes, so older
+// entries stop matching.
+//
+// The bounding tree of the model (BoundNode in main.cpp) isn't cached. It
+// follows from the voxels alone and a 64^3 map builds it in about 30 ms,
+// while storing it would take about 20 MB per entry (a node per solid voxel
+// plus the nodes above them) and loading still has to allocate every node,
+// which alone takes most of that time.
+
+const char GRID_CACHE_MAGIC[4] = { 'V', 'X', 'G', 'C' };
+const uint32_t GRID_CACHE_VERSION = 3;
+
+struct GridCacheHeader {
+  char magic[4];
+  uint32_t version;
+  uint32_t key_size;
+  uint32_t total_triangles;
+  uint32_t total_runs;
+  uint32_t checksum;      // checksumBytes() of everything after the header
+};
+
+// Everything the voxels and the mesh of a grid generated from formula depend
+// on
+inline std::string gridCacheKey(const Formula& formula, int x_size, int y_size, int z_size, float dx, float dy, float dz) {
+  std::string key = Formula::normalize(formula.source);
+  char settings[256];
+
+  for(int i = 0; i < (int)formula.parameter_names.size(); ++i) {
+    snprintf(settings, sizeof(settings), " %.9g", formula.parameter_values[i]);
+    key += "\n$" + formula.parameter_names[i] + settings;
+  }
+
+  snprintf(settings, sizeof(settings), "\nseed %u size %d %d %d spacing %.9g %.9g %.9g version %u %u %d",
+           formula.seed, x_size, y_size, z_size, dx, dy, dz, GRID_CACHE_VERSION, GRID_FILE_VERSION, GRID_CHUNK_SIZE);
+
+  return key + settings;
+}
+
+// Path of the files of the entry for key, without the extension
+inline std::string gridCachePath(const std::string& dir, const std::string& key) {
+  // 64 bit FNV-1a
+  uint64_t hash = 14695981039346656037ull;
+  char name[17];
+
+  for(int i = 0; i < (int)key.size(); ++i)
+    hash = (hash ^ (uint8_t)key[i]) * 1099511628211ull;
+
+  snprintf(name, sizeof(name), "%016llx", (unsigned long long)hash);
+
+  return dir + "/" + name;
+}
+
+// Reads the grid and the mesh generated for key, and sets the triangle runs
+// of the grid for the mesh. Returns NULL if they aren't in the cache or the
+// entry is damaged.
+template<typename T, typename Layout>
+Grid3D<T, Layout>* loadCachedGrid(const std::string& dir, const std::string& key, std::vector<Triangle>& mesh) {
+  std::string path = gridCachePath(dir, key);
+  std::ifstream file((path + ".mesh").c_str(), std::ios::in | std::ios::binary | std::ios::ate);
+
+  if(!file.is_open())
+    return NULL;
+
+  std::vector<uint8_t> data((size_t)file.tellg());
+  GridCacheHeader header;
+
+  file.seekg(0);
+
+  if(data.size() != 0 && !file.read((char*)&data[0], data.size()))
+    return NULL;
+
+  if(data.size() < sizeof(header))
+    return NULL;
+
+  memcpy(&header, &data[0], sizeof(header));
+
+  size_t size = sizeof(header) + (size_t)header.key_size + (size_t)header.total_triangles * sizeof(Triangle) +
+    (size_t)header.total_runs * 2 * sizeof(int32_t);
+
+  if(memcmp(header.magic, GRID_CACHE_MAGIC, 4) != 0 || header.version != GRID_CACHE_VERSION || data.size() != size ||
+      checksumBytes(&data[sizeof(header)], size - sizeof(header)) != header.checksum ||
+      std::string((const char*)&data[sizeof(header)], header.key_size) != key)
+    return NULL;
+
+  Grid3D<T, Layout>* g;
+
+  try {
+    g = loadGrid<T, Layout>((path + ".vxg").c_str());
+  }
+  catch(std::string s) {
+    return NULL;
+  }
+
+  if(!g)
+    return NULL;
+
+  if((size_t)g->layout.size() != header.total_runs) {
+    delete g;
+    return NULL;
+  }
+
+  const uint8_t* p = &data[sizeof(header) + header.key_size];
+
+  mesh.resize(header.total_triangles);
+
+  if(mesh.size() != 0)
+    memcpy(&mesh[0], p, mesh.size() * sizeof(Triangle));
+
+  p += mesh.size() * sizeof(Triangle);
+
+  for(int i = 0; i < (int)header.total_runs; ++i) {
+    int32_t run[2];
+
+    memcpy(run, p, sizeof(run));
+    p += sizeof(run);
+
+    g->triangle_run[i].start = run[0];
+    g->triangle_run[i].end = run[1];
+  }
+
+  return g;
+}
+
+// Stores a generated grid and its mesh, as returned by g.triangulate(), in
+// the cache. The files are written under temporary names and the mesh file is
+// renamed into place last, so an entry is only found once it's complete.
+// Throws a std::string on failure.
+template<typename T, typename Layout>
+void saveCachedGrid(const std::string& dir, const std::string& key, Grid3D<T, Layout>& g, const std::vector<Triangle>& mesh) {
+  std::string path = gridCachePath(dir, key);
+  GridCacheHeader header;
+  std::vector<uint8_t> data(sizeof(header));
+
+  // Fails if the directory already exists, which is fine
+  mkdir(dir.c_str(), 0755);
+
+  data.insert(data.end(), key.begin(), key.end());
+
+  if(mesh.size() != 0)
+    data.insert(data.end(), (const uint8_t*)&mesh[0], (const uint8_t*)(&mesh[0] + mesh.size()));
+
+  for(int i = 0; i < (int)g.layout.size(); ++i) {
+    int32_t run[2] = { g.triangle_run[i].start, g.triangle_run[i].end };
+
+    data.insert(data.end(), (const uint8_t*)run, (const uint8_t*)(run + 2));
+  }
+
+  memcpy(header.magic, GRID_CACHE_MAGIC, 4);
+  header.version = GRID_CACHE_VERSION;
+  header.key_size = key.size();
+  header.total_triangles = mesh.size();
+  header.total_runs = g.layout.size();
+  header.checksum = checksumBytes(&data[sizeof(header)], data.size() - sizeof(header));
+  memcpy(&data[0], &header, sizeof(header));
+
+  saveGrid(g, (path + ".vxg.tmp").c_str());
+
+  if(rename((path + ".vxg.tmp").c_str(), (path + ".vxg").c_str()) != 0)
+    throw "Failed to rename " + path + ".vxg.tmp";
+
+  std::ofstream file((path + ".mesh.tmp").c_str(), std::ios::out | std::ios::binary | std::ios::trunc);
+
+  if(!file.is_open())
+    throw "Failed to open " + path + ".mesh.tmp for writing";
+
+  file.write((const char*)&data[0], data.size());
+  file.close();
+
+  if(!file)
+    throw "Failed to write " + path + ".mesh.tmp";
+
+  if(rename((path + ".mesh.tmp").c_str(), (path + ".mesh").c_str()) != 0)
+    throw "Failed to rename " + path + ".mesh.tmp";
+}
@@ -0,0 +1,560 @@
+#pragma once
+
+#include <vector>
+#include <string>
+#include <type_traits>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "grid.hpp"
+#include "parallel.hpp"
+
+// On disk format for grids:
+//
+//   GridFileHeader
+//   GridFileChunk[total_chunks]   (chunk index, chunks in ChunkGrid order)
+//   chunk payloads
+//
+// Every chunk is stored on its own so chunks can be encoded, decoded and
+// rewritten independently. Voxels of a chunk are ordered x fastest, then y,
+// then z, and only the voxels inside the grid are stored. Payloads start on
+// GRID_FILE_ALIGN byte boundaries, and raw payloads on GRID_FILE_PAGE_ALIGN
+// boundaries so they can be mapped into a grid (see loadMappedGrid()).
+
+const char GRID_FILE_MAGIC[4] = { 'V', 'X', 'G', 'R' };
+const uint32_t GRID_FILE_VERSION = 1;
+const int GRID_FILE_ALIGN = 16;
+const int GRID_FILE_PAGE_ALIGN = 4096;
+
+enum {
+  CHUNK_UNIFORM,        // Payload is one value shared by the whole chunk
+  CHUNK_RAW,            // Payload is the value of every voxel
+  CHUNK_PALETTE_RLE     // Payload is a palette followed by runs of palette indices
+};
+
+struct GridFileHeader {
+  char magic[4];
+  uint32_t version;
+  uint32_t value_size;
+  int32_t x_size, y_size, z_size;
+  float grid_dx, grid_dy, grid_dz;
+  int32_t chunk_size;
+  int32_t total_chunks;
+};
+
+struct GridFileChunk {
+  uint32_t codec;
+  uint32_t size;
+  uint64_t offset;
+  uint32_t checksum;    // checksumBytes() of the payload
+  uint32_t reserved;
+};
+
+// Offset of the first payload encoded with codec at or after offset
+inline uint64_t alignPayload(uint64_t offset, uint32_t codec) {
+  uint64_t align = codec == CHUNK_RAW ? GRID_FILE_PAGE_ALIGN : GRID_FILE_ALIGN;
+
+  return (offset + align - 1) / align * align;
+}
+
+// FNV-1a hash, used to detect corrupted chunks
+inline uint32_t checksumBytes(const uint8_t* data, size_t size) {
+  uint32_t hash = 2166136261u;
+
+  for(size_t i = 0; i < size; ++i)
+    hash = (hash ^ data[i]) * 16777619u;
+
+  return hash;
+}
+
+// Works on anything with get(x, y, z), such as Grid3D
+template<typename G, typename T>
+void readChunk(G& g, ChunkGrid& chunks, int chunk, T* out) {
+  int x1, y1, z1, x2, y2, z2;
+
+  chunks.bounds(chunk, x1, y1, z1, x2, y2, z2);
+
+  for(int z = z1; z < z2; ++z) {
+    for(int y = y1; y < y2; ++y) {
+      for(int x = x1; x < x2; ++x) {
+        *out++ = g.get(x, y, z);
+      }
+    }
+  }
+}
+
+// A snapshot reads a whole chunk under one state change
+template<typename T, typename Layout>
+void readChunk(GridSnapshot<T, Layout>& g, ChunkGrid& chunks, int chunk, T* out) {
+  g.readChunk(chunk, out);
+}
+
+template<typename T, typename Layout>
+void writeChunk(Grid3D<T, Layout>& g, ChunkGrid& chunks, int chunk, const T* in) {
+  int x1, y1, z1, x2, y2, z2;
+
+  chunks.bounds(chunk, x1, y1, z1, x2, y2, z2);
+
+  for(int z = z1; z < z2; ++z) {
+    for(int y = y1; y < y2; ++y) {
+      for(int x = x1; x < x2; ++x) {
+        g.get(x, y, z) = *in++;
+      }
+    }
+  }
+}
+
+inline void writeVarint(std::vector<uint8_t>& out, uint32_t v) {
+  while(v >= 0x80) {
+    out.push_back((v & 0x7F) | 0x80);
+    v >>= 7;
+  }
+
+  out.push_back(v);
+}
+
+inline uint32_t readVarint(const uint8_t*& in, const uint8_t* end) {
+  uint32_t v = 0;
+
+  for(int shift = 0; shift < 35; shift += 7) {
+    if(in >= end)
+      throw "Truncated chunk data";
+
+    uint8_t b = *in++;
+    v |= (uint32_t)(b & 0x7F) << shift;
+
+    if(!(b & 0x80))
+      return v;
+  }
+
+  throw "Invalid chunk data";
+}
+
+template<typename T>
+void appendValue(std::vector<uint8_t>& out, const T& v) {
+  const uint8_t* p = (const uint8_t*)&v;
+
+  out.insert(out.end(), p, p + sizeof(T));
+}
+
+// Encodes the voxels of a chunk, picking the smallest codec (only
+// CHUNK_UNIFORM and CHUNK_RAW if compress isn't set)
+template<typename T>
+uint32_t encodeChunk(const T* voxels, int volume, bool compress, std::vector<uint8_t>& out) {
+  out.clear();
+
+  bool uniform = true;
+
+  for(int i = 1; i < volume && uniform; ++i)
+    uniform = voxels[i] == voxels[0];
+
+  if(uniform) {
+    appendValue(out, voxels[0]);
+    return CHUNK_UNIFORM;
+  }
+
+  if(compress) {
+    std::vector<T> palette;
+    std::vector<int> index(volume);
+
+    for(int i = 0; i < volume && palette.size() <= 65536; ++i) {
+      int p = (i > 0 && voxels[i] == voxels[i - 1]) ? index[i - 1] : -1;
+
+      for(int j = 0; j < (int)palette.size() && p == -1; ++j) {
+        if(palette[j] == voxels[i])
+          p = j;
+      }
+
+      if(p == -1) {
+        p = palette.size();
+        palette.push_back(voxels[i]);
+      }
+
+      index[i] = p;
+    }
+
+    if(palette.size() <= 65536) {
+      int index_bytes = palette.size() <= 256 ? 1 : 2;
+
+      writeVarint(out, palette.size());
+
+      for(int i = 0; i < (int)palette.size(); ++i)
+        appendValue(out, palette[i]);
+
+      for(int i = 0; i < volume; ) {
+        int start = i;
+
+        while(i < volume && index[i] == index[start])
+          ++i;
+
+        writeVarint(out, i - start);
+        out.push_back(index[start] & 0xFF);
+
+        if(index_bytes == 2)
+          out.push_back(index[start] >> 8);
+      }
+
+      if(out.size() < volume * sizeof(T))
+        return CHUNK_PALETTE_RLE;
+    }
+
+    out.clear();
+  }
+
+  const uint8_t* p = (const uint8_t*)voxels;
+
+  out.assign(p, p + volume * sizeof(T));
+
+  return CHUNK_RAW;
+}
+
+template<typename T>
+void decodeChunk(uint32_t codec, const uint8_t* data, uint32_t size, int volume, T* out) {
+  const uint8_t* end = data + size;
+
+  if(codec == CHUNK_UNIFORM) {
+    if(size != sizeof(T))
+      throw "Invalid uniform chunk";
+
+    T value;
+    memcpy(&value, data, sizeof(T));
+
+    for(int i = 0; i < volume; ++i)
+      out[i] = value;
+  }
+  else if(codec == CHUNK_RAW) {
+    if(size != volume * sizeof(T))
+      throw "Invalid raw chunk";
+
+    memcpy(out, data, size);
+  }
+  else if(codec == CHUNK_PALETTE_RLE) {
+    uint32_t palette_size = readVarint(data, end);
+
+    if(palette_size == 0 || palette_size > 65536 || (uint32_t)(end - data) < palette_size * sizeof(T))
+      throw "Invalid chunk palette";
+
+    std::vector<T> palette(palette_size);
+    int index_bytes = palette_size <= 256 ? 1 : 2;
+
+    memcpy(&palette[0], data, palette_size * sizeof(T));
+    data += palette_size * sizeof(T);
+
+    int pos = 0;
+
+    while(pos < volume) {
+      uint32_t length = readVarint(data, end);
+
+      if(end - data < index_bytes || length > (uint32_t)(volume - pos))
+        throw "Invalid chunk run";
+
+      uint32_t index = data[0];
+
+      if(index_bytes == 2)
+        index |= data[1] << 8;
+
+      data += index_bytes;
+
+      if(index >= palette_size)
+        throw "Invalid chunk palette index";
+
+      for(uint32_t i = 0; i < length; ++i)
+        out[pos++] = palette[index];
+    }
+  }
+  else {
+    throw "Unknown chunk codec";
+  }
+}
+
+// Closes a file descriptor when it goes out of scope, including when an
+// exception is thrown
+class FileDescriptor {
+public:
+  int fd;
+
+  explicit FileDescriptor(int fd) : fd(fd) {}
+
+  ~FileDescriptor() {
+    if(fd != -1)
+      close(fd);
+  }
+
+  FileDescriptor(const FileDescriptor&) = delete;
+  FileDescriptor& operator=(const FileDescriptor&) = delete;
+};
+
+inline bool preadAll(int fd, void* data, size_t size, uint64_t offset) {
+  uint8_t* p = (uint8_t*)data;
+
+  while(size > 0) {
+    ssize_t n = pread(fd, p, size, offset);
+
+    if(n <= 0)
+      return false;
+
+    p += n;
+    size -= n;
+    offset += n;
+  }
+
+  return true;
+}
+
+inline bool pwriteAll(int fd, const void* data, size_t size, uint64_t offset) {
+  const uint8_t* p = (const uint8_t*)data;
+
+  while(size > 0) {
+    ssize_t n = pwrite(fd, p, size, offset);
+
+    if(n <= 0)
+      return false;
+
+    p += n;
+    size -= n;
+    offset += n;
+  }
+
+  return true;
+}
+
+// Writes a grid to filename, encoding the chunks in parallel. Takes a Grid3D
+// or anything else with the same size fields and get(x, y, z), so a
+// GridSnapshot can be saved on another thread while its grid is edited.
+// Throws a std::string on failure.
+template<typename G>
+void saveGrid(G& g, const char* filename, bool compress = true) {
+  typedef typename std::decay<decltype(g.get(0, 0, 0))>::type T;
+
+  ChunkGrid chunks(g.x_size, g.y_size, g.z_size);
+  std::vector<std::vector<uint8_t> > payload(chunks.total());
+  std::vector<GridFileChunk> index(chunks.total());
+
+  parallelFor(chunks.total(), [&](int i) {
+    std::vector<T> voxels(chunks.volume(i));
+
+    readChunk(g, chunks, i, &voxels[0]);
+    index[i].codec = encodeChunk(&voxels[0], voxels.size(), compress, payload[i]);
+  });
+
+  GridFileHeader header;
+
+  memcpy(header.magic, GRID_FILE_MAGIC, 4);
+  header.version = GRID_FILE_VERSION;
+  header.value_size = sizeof(T);
+  header.x_size = g.x_size;
+  header.y_size = g.y_size;
+  header.z_size = g.z_size;
+  header.grid_dx = g.grid_dx;
+  header.grid_dy = g.grid_dy;
+  header.grid_dz = g.grid_dz;
+  header.chunk_size = GRID_CHUNK_SIZE;
+  header.total_chunks = chunks.total();
+
+  uint64_t offset = sizeof(GridFileHeader) + sizeof(GridFileChunk) * chunks.total();
+
+  for(int i = 0; i < chunks.total(); ++i) {
+    offset = alignPayload(offset, index[i].codec);
+
+    index[i].size = payload[i].size();
+    index[i].offset = offset;
+    index[i].checksum = checksumBytes(&payload[i][0], payload[i].size());
+    index[i].reserved = 0;
+    offset += payload[i].size();
+  }
+
+  FileDescriptor file(open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644));
+  int fd = file.fd;
+
+  if(fd == -1)
+    throw "Failed to open " + std::string(filename) + " for writing";
+
+  // The gaps between payloads are left as holes, which read as zeros
+  bool written = pwriteAll(fd, &header, sizeof(header), 0) &&
+    pwriteAll(fd, &index[0], sizeof(GridFileChunk) * index.size(), sizeof(header));
+
+  for(int i = 0; i < chunks.total() && written; ++i)
+    written = pwriteAll(fd, &payload[i][0], payload[i].size(), index[i].offset);
+
+  // Synced so the file is complete before it's renamed over another one
+  if(written && (ftruncate(fd, offset) == -1 || fsync(fd) == -1))
+    written = false;
+
+  if(!written)
+    throw "Failed to write " + std::string(filename);
+}
+
+// Renames from to to, then syncs the directory holding them so the rename
+// itself survives a crash. Throws a std::string on failure.
+inline void replaceFile(const std::string& from, const std::string& to) {
+  if(rename(from.c_str(), to.c_str()) != 0)
+    throw "Failed to replace " + to;
+
+  size_t slash = to.rfind('/');
+  std::string dir = slash == std::string::npos ? "." : slash == 0 ? "/" : to.substr(0, slash);
+  FileDescriptor file(open(dir.c_str(), O_RDONLY));
+
+  if(file.fd == -1)
+    throw "Failed to open " + dir;
+
+  if(fsync(file.fd) != 0)
+    throw "Failed to sync " + dir;
+}
+
+// Checks that a header describes a valid grid of T
+template<typename T>
+void validateGridHeader(GridFileHeader& header, std::string filename) {
+  if(memcmp(header.magic, GRID_FILE_MAGIC, 4) != 0)
+    throw filename + " is not a grid file";
+
+  if(header.version != GRID_FILE_VERSION)
+    throw filename + " has unsupported version";
+
+  if(header.value_size != sizeof(T) || header.chunk_size != GRID_CHUNK_SIZE)
+    throw filename + " has incompatible voxel or chunk size";
+
+  if(header.x_size <= 0 || header.y_size <= 0 || header.z_size <= 0 ||
+      header.total_chunks != ChunkGrid(header.x_size, header.y_size, header.z_size).total())
+    throw filename + " has invalid dimensions";
+}
+
+// Rewrites only the given chunks of a grid file previously saved from g. The
+// new payloads are appended and synced before the index entries pointing at
+// them are updated in place, so after a crash every chunk is either its old or
+// its new version. Returns the number of bytes of the file that are no longer
+// referenced by the index (reclaimed by saving the whole grid again). Throws a
+// std::string on failure.
+template<typename T, typename Layout>
+uint64_t saveGridChunks(Grid3D<T, Layout>& g, const char* filename, const std::vector<int>& dirty, bool compress = true) {
+  FileDescriptor file(open(filename, O_RDWR));
+  int fd = file.fd;
+
+  if(fd == -1)
+    throw "Failed to open " + std::string(filename) + " for writing";
+
+  GridFileHeader header;
+  ChunkGrid chunks(g.x_size, g.y_size, g.z_size);
+  std::vector<GridFileChunk> index(chunks.total());
+  std::vector<std::vector<uint8_t> > payload(dirty.size());
+  uint64_t live = sizeof(GridFileHeader) + sizeof(GridFileChunk) * index.size();
+  uint64_t end;
+
+  if(!preadAll(fd, &header, sizeof(header), 0))
+    throw std::string(filename) + " is truncated";
+
+  validateGridHeader<T>(header, filename);
+
+  if(header.x_size != g.x_size || header.y_size != g.y_size || header.z_size != g.z_size)
+    throw std::string(filename) + " holds a grid of a different size";
+
+  if(!preadAll(fd, &index[0], sizeof(GridFileChunk) * index.size(), sizeof(header)))
+    throw std::string(filename) + " is truncated";
+
+  parallelFor(dirty.size(), [&](int i) {
+    std::vector<T> voxels(chunks.volume(dirty[i]));
+
+    readChunk(g, chunks, dirty[i], &voxels[0]);
+    index[dirty[i]].codec = encodeChunk(&voxels[0], voxels.size(), compress, payload[i]);
+  });
+
+  end = lseek(fd, 0, SEEK_END);
+
+  for(int i = 0; i < (int)dirty.size(); ++i) {
+    GridFileChunk& c = index[dirty[i]];
+
+    end = alignPayload(end, c.codec);
+
+    c.size = payload[i].size();
+    c.offset = end;
+    c.checksum = checksumBytes(&payload[i][0], payload[i].size());
+    c.reserved = 0;
+
+    if(!pwriteAll(fd, &payload[i][0], payload[i].size(), end))
+      throw "Failed to write " + std::string(filename);
+
+    end += payload[i].size();
+  }
+
+  if(fsync(fd) == -1)
+    throw "Failed to write " + std::string(filename);
+
+  for(int i = 0; i < (int)dirty.size(); ++i) {
+    uint64_t offset = sizeof(header) + sizeof(GridFileChunk) * dirty[i];
+
+    if(!pwriteAll(fd, &index[dirty[i]], sizeof(GridFileChunk), offset))
+      throw "Failed to write " + std::string(filename);
+  }
+
+  if(fsync(fd) == -1)
+    throw "Failed to write " + std::string(filename);
+
+  for(int i = 0; i < (int)index.size(); ++i)
+    live += index[i].size;
+
+  return end > live ? end - live : 0;
+}
+
+// Reads a grid written by saveGrid(), decoding the chunks in parallel.
+// Returns NULL if the file can't be opened and throws a std::string if it
+// isn't a valid grid file.
+template<typename T, typename Layout>
+Grid3D<T, Layout>* loadGrid(const char* filename) {
+  FileDescriptor file(open(filename, O_RDONLY));
+  struct stat st;
+
+  if(file.fd == -1)
+    return NULL;
+
+  if(fstat(file.fd, &st) == -1)
+    throw "Failed to read " + std::string(filename);
+
+  // One read of the whole file into a buffer of the right size
+  std::vector<uint8_t> data(st.st_size);
+
+  if(data.size() > 0 && !preadAll(file.fd, &data[0], data.size(), 0))
+    throw "Failed to read " + std::string(filename);
+
+  GridFileHeader header;
+
+  if(data.size() < sizeof(header))
+    throw std::string(filename) + " is truncated";
+
+  memcpy(&header, &data[0], sizeof(header));
+  validateGridHeader<T>(header, filename);
+
+  if(data.size() < sizeof(header) + sizeof(GridFileChunk) * header.total_chunks)
+    throw std::string(filename) + " is truncated";
+
+  std::vector<GridFileChunk> index(header.total_chunks);
+
+  memcpy(&index[0], &data[sizeof(header)], sizeof(GridFileChunk) * index.size());
+
+  for(int i = 0; i < header.total_chunks; ++i) {
+    if(index[i].offset > data.size() || index[i].size > data.size() - index[i].offset)
+      throw std::string(filename) + " is truncated";
+  }
+
+  Grid3D<T, Layout>* g = new Grid3D<T, Layout>(header.x_size, header.y_size, header.z_size,
+                                               header.grid_dx, header.grid_dy, header.grid_dz, T());
+  ChunkGrid chunks(header.x_size, header.y_size, header.z_size);
+
+  try {
+    parallelFor(chunks.total(), [&](int i) {
+      std::vector<T> voxels(chunks.volume(i));
+
+      if(checksumBytes(data.data() + index[i].offset, index[i].size) != index[i].checksum)
+        throw "Chunk checksum mismatch";
+
+      decodeChunk(index[i].codec, data.data() + index[i].offset, index[i].size, voxels.size(), &voxels[0]);
+      writeChunk(*g, chunks, i, &voxels[0]);
+    });
+  }
+  catch(std::string s) {
+    delete g;
+    throw std::string(filename) + ": " + s;
+  }
+
+  return g;
+}
@@ -0,0 +1,263 @@
+#pragma once
+
+#include <vector>
+#include <deque>
+#include <map>
+#include <stdint.h>
+
+#include "gridfile.hpp"
+
+// Undo/redo history of the edits made to a grid. Edits are grouped into
+// actions (one cut, one brush stroke). Before a chunk is first changed by an
+// action its voxels are saved, and when the action ends only the XOR of the
+// old and new voxels is kept, compressed as runs:
+//
+//   { varint skip, varint length, T xor }...
+//
+// where skip is the number of unchanged voxels before the run and the run is
+// length voxels sharing the same XOR value (a cut turning solid voxels into
+// empty ones is a handful of runs per chunk). XORing a chunk with its delta
+// turns the new voxels into the old ones and back, so the same delta is used
+// for both undo and redo.
+template<typename T, typename Layout = LinearLayout>
+class EditHistory {
+public:
+  struct ChunkDelta {
+    int chunk;
+    std::vector<uint8_t> runs;
+  };
+
+  typedef std::vector<ChunkDelta> Action;
+
+  Grid3D<T, Layout>* grid;
+  ChunkGrid chunks;
+
+  std::deque<Action> undo_actions;
+  std::vector<Action> redo_actions;
+  size_t memory_usage;              // Bytes used by the deltas
+  size_t max_memory;                // Oldest actions are dropped past this
+
+  bool recording;
+  std::map<int, std::vector<T> > before;    // Voxels of the chunks changed by the current action
+
+  EditHistory(Grid3D<T, Layout>* g, size_t max_bytes = 16 << 20) {
+    grid = g;
+    chunks.init(g->x_size, g->y_size, g->z_size);
+    memory_usage = 0;
+    max_memory = max_bytes;
+    recording = false;
+  }
+
+  void beginAction() {
+    if(recording)
+      endAction();
+
+    recording = true;
+  }
+
+  // Call before changing voxel (x, y, z). An edit made outside of an action
+  // starts one that lasts until the next endAction(), undo() or redo().
+  void touch(int x, int y, int z) {
+    recording = true;
+
+    int chunk = chunks.chunkOf(x, y, z);
+
+    if(before.count(chunk) == 0) {
+      std::vector<T>& voxels = before[chunk];
+
+      voxels.resize(chunks.volume(chunk));
+      readChunk(*grid, chunks, chunk, &voxels[0]);
+    }
+  }
+
+  // Turns the saved chunks into deltas against their current voxels. Actions
+  // that didn't change anything are dropped. Starting a new action forgets
+  // the actions that were undone.
+  void endAction() {
+    if(!recording)
+      return;
+
+    recording = false;
+
+    Action action;
+    std::vector<T> after;
+
+    for(typename std::map<int, std::vector<T> >::iterator i = before.begin(); i != before.end(); ++i) {
+      ChunkDelta delta;
+
+      after.resize(i->second.size());
+      readChunk(*grid, chunks, i->first, &after[0]);
+
+      delta.chunk = i->first;
+
+      if(encodeDelta(&i->second[0], &after[0], after.size(), delta.runs)) {
+        memory_usage += delta.runs.size();
+        action.push_back(delta);
+      }
+    }
+
+    before.clear();
+
+    if(action.size() == 0)
+      return;
+
+    dropRedo();
+    undo_actions.push_back(action);
+
+    while(memory_usage > max_memory && undo_actions.size() > 1) {
+      memory_usage -= actionSize(undo_actions.front());
+      undo_actions.pop_front();
+    }
+  }
+
+  // Reverts the last action. f(x, y, z, value) is called for every voxel
+  // that changed. Returns the chunks that changed, or nothing if there's
+  // nothing to undo.
+  template<typename F>
+  std::vector<int> undo(F f) {
+    endAction();
+
+    if(undo_actions.size() == 0)
+      return std::vector<int>();
+
+    Action action = undo_actions.back();
+
+    undo_actions.pop_back();
+    redo_actions.push_back(action);
+
+    return apply(action, f);
+  }
+
+  // Repeats the last undone action
+  template<typename F>
+  std::vector<int> redo(F f) {
+    endAction();
+
+    if(redo_actions.size() == 0)
+      return std::vector<int>();
+
+    Action action = redo_actions.back();
+
+    redo_actions.pop_back();
+    undo_actions.push_back(action);
+
+    return apply(action, f);
+  }
+
+  template<typename F>
+  std::vector<int> apply(Action& action, F f) {
+    std::vector<int> changed;
+
+    for(int i = 0; i < (int)action.size(); ++i) {
+      ChunkDelta& delta = action[i];
+      int x1, y1, z1, x2, y2, z2;
+
+      chunks.bounds(delta.chunk, x1, y1, z1, x2, y2, z2);
+
+      int w = x2 - x1;
+      int h = y2 - y1;
+      const uint8_t* p = &delta.runs[0];
+      const uint8_t* end = p + delta.runs.size();
+      int pos = 0;
+
+      while(p < end) {
+        pos += readVarint(p, end);
+
+        int length = readVarint(p, end);
+        T change;
+
+        memcpy(&change, p, sizeof(T));
+        p += sizeof(T);
+
+        for(int j = 0; j < length; ++j, ++pos) {
+          int x = x1 + pos % w;
+          int y = y1 + pos / w % h;
+          int z = z1 + pos / (w * h);
+          T& v = grid->get(x, y, z);
+
+          v = xorValue(v, change);
+          f(x, y, z, v);
+        }
+      }
+
+      changed.push_back(delta.chunk);
+    }
+
+    return changed;
+  }
+
+  static T xorValue(T a, T b) {
+    uint8_t* pa = (uint8_t*)&a;
+    const uint8_t* pb = (const uint8_t*)&b;
+
+    for(int i = 0; i < (int)sizeof(T); ++i)
+      pa[i] ^= pb[i];
+
+    return a;
+  }
+
+  // Returns false if the voxels didn't change
+  static bool encodeDelta(const T* old_voxels, const T* new_voxels, int volume, std::vector<uint8_t>& out) {
+    T zero;
+    int skip = 0;
+
+    memset(&zero, 0, sizeof(T));
+    out.clear();
+
+    for(int i = 0; i < volume; ) {
+      T x = xorValue(old_voxels[i], new_voxels[i]);
+
+      if(memcmp(&x, &zero, sizeof(T)) == 0) {
+        ++skip;
+        ++i;
+        continue;
+      }
+
+      int length = 1;
+
+      while(i + length < volume) {
+        T next = xorValue(old_voxels[i + length], new_voxels[i + length]);
+
+        if(memcmp(&next, &x, sizeof(T)) != 0)
+          break;
+
+        ++length;
+      }
+
+      writeVarint(out, skip);
+      writeVarint(out, length);
+      appendValue(out, x);
+
+      skip = 0;
+      i += length;
+    }
+
+    return out.size() != 0;
+  }
+
+  static size_t actionSize(Action& action) {
+    size_t total = 0;
+
+    for(int i = 0; i < (int)action.size(); ++i)
+      total += action[i].runs.size();
+
+    return total;
+  }
+
+  // Forgets the actions that were undone, for when the grid changed in a way
+  // the history didn't record
+  void dropRedo() {
+    for(int i = 0; i < (int)redo_actions.size(); ++i)
+      memory_usage -= actionSize(redo_actions[i]);
+
+    redo_actions.clear();
+  }
+
+  bool canUndo() {
+    return undo_actions.size() != 0 || before.size() != 0;
+  }
+
+  bool canRedo() {
+    return redo_actions.size() != 0;
+  }
+};
@@ -0,0 +1,291 @@
+#pragma once
+
+#include <vector>
+#include <cstring>
+#include <stdint.h>
+
+#if defined(__x86_64__) && (defined(__linux__) || defined(__APPLE__))
+#define JIT_X86_64 1
+#include <sys/mman.h>
+#endif
+
+// Machine code copied into memory that can be executed. The memory is
+// writable only while the code is copied in.
+class ExecutableCode {
+public:
+  void* memory;
+  size_t size;
+
+  ExecutableCode() {
+    memory = NULL;
+    size = 0;
+  }
+
+  ~ExecutableCode() {
+#ifdef JIT_X86_64
+    if(memory)
+      munmap(memory, size);
+#endif
+  }
+
+  ExecutableCode(const ExecutableCode&) = delete;
+  ExecutableCode& operator=(const ExecutableCode&) = delete;
+
+  // Returns false if executable memory isn't available
+  bool load(const std::vector<uint8_t>& code) {
+#ifdef JIT_X86_64
+    size = code.size();
+
+    void* p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+    if(p == MAP_FAILED)
+      return false;
+
+    memcpy(p, &code[0], size);
+
+    if(mprotect(p, size, PROT_READ | PROT_EXEC) != 0) {
+      munmap(p, size);
+      return false;
+    }
+
+    memory = p;
+
+    return true;
+#else
+    return false;
+#endif
+  }
+
+  void* address(size_t offset) {
+    return (uint8_t*)memory + offset;
+  }
+};
+
+// True if the CPU and OS can run the AVX code from X86Emitter
+inline bool jitSupported() {
+#ifdef JIT_X86_64
+  static bool supported = __builtin_cpu_supports("avx");
+
+  return supported;
+#else
+  return false;
+#endif
+}
+
+// Emits the x86-64 instructions the formula JIT needs: a few integer
+// instructions for the loop and calls, and 256 bit AVX instructions on
+// packed floats. Memory operands are always [base + disp32].
+class X86Emitter {
+public:
+  enum {
+    RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI,
+    R8, R9, R10, R11, R12, R13, R14, R15
+  };
+
+  // Opcodes of VEX.256.0F instructions on packed floats
+  enum {
+    VSQRTPS = 0x51,
+    VANDPS = 0x54,
+    VANDNPS = 0x55,
+    VORPS = 0x56,
+    VXORPS = 0x57,
+    VADDPS = 0x58,
+    VMULPS = 0x59,
+    VSUBPS = 0x5C,
+    VDIVPS = 0x5E,
+    VCMPPS = 0xC2
+  };
+
+  // Predicates of vcmpps
+  enum {
+    CMP_EQ_OQ = 0x00,
+    CMP_LT_OS = 0x01,
+    CMP_LE_OS = 0x02,
+    CMP_NEQ_UQ = 0x04,
+    CMP_GE_OS = 0x0D,
+    CMP_GT_OS = 0x0E
+  };
+
+  std::vector<uint8_t> code;
+
+  size_t offset() {
+    return code.size();
+  }
+
+  void byte(uint8_t b) {
+    code.push_back(b);
+  }
+
+  void int32(uint32_t v) {
+    for(int i = 0; i < 4; ++i)
+      byte(v >> (i * 8));
+  }
+
+  void int64(uint64_t v) {
+    for(int i = 0; i < 8; ++i)
+      byte(v >> (i * 8));
+  }
+
+  void push(int r) {
+    if(r >= 8)
+      byte(0x41);
+
+    byte(0x50 + (r & 7));
+  }
+
+  void pop(int r) {
+    if(r >= 8)
+      byte(0x41);
+
+    byte(0x58 + (r & 7));
+  }
+
+  // mov dst, src (64 bit)
+  void mov(int dst, int src) {
+    rex(true, src, dst);
+    byte(0x89);
+    byte(0xC0 | ((src & 7) << 3) | (dst & 7));
+  }
+
+  void movImm64(int dst, uint64_t value) {
+    rex(true, 0, dst);
+    byte(0xB8 + (dst & 7));
+    int64(value);
+  }
+
+  void movImm32(int dst, uint32_t value) {
+    if(dst >= 8)
+      byte(0x41);
+
+    byte(0xB8 + (dst & 7));
+    int32(value);
+  }
+
+  // lea dst, [base + disp]
+  void lea(int dst, int base, int32_t disp) {
+    rex(true, dst, base);
+    byte(0x8D);
+    memOperand(dst, base, disp);
+  }
+
+  // lea dst, [rip + disp] pointing at an offset in the code
+  void leaRip(int dst, size_t target) {
+    rex(true, dst, 0);
+    byte(0x8D);
+    byte(0x05 | ((dst & 7) << 3));
+    int32(target - (offset() + 4));
+  }
+
+  void addImm8(int dst, int8_t value) {
+    rex(true, 0, dst);
+    byte(0x83);
+    byte(0xC0 | (dst & 7));
+    byte(value);
+  }
+
+  void dec(int dst) {
+    rex(true, 0, dst);
+    byte(0xFF);
+    byte(0xC8 | (dst & 7));
+  }
+
+  // jnz to an offset already emitted
+  void jnz(size_t target) {
+    byte(0x0F);
+    byte(0x85);
+    int32(target - (offset() + 4));
+  }
+
+  void call(int r) {
+    if(r >= 8)
+      byte(0x41);
+
+    byte(0xFF);
+    byte(0xD0 | (r & 7));
+  }
+
+  void ret() {
+    byte(0xC3);
+  }
+
+  void vzeroupper() {
+    byte(0xC5);
+    byte(0xF8);
+    byte(0x77);
+  }
+
+  // vmovups ymm, [base + disp]
+  void vload(int ymm, int base, int32_t disp) {
+    vex(1, 0, ymm, 0, base);
+    byte(0x10);
+    memOperand(ymm, base, disp);
+  }
+
+  // vmovups [base + disp], ymm
+  void vstore(int base, int32_t disp, int ymm) {
+    vex(1, 0, ymm, 0, base);
+    byte(0x11);
+    memOperand(ymm, base, disp);
+  }
+
+  // vbroadcastss ymm, [base + disp]
+  void vbroadcast(int ymm, int base, int32_t disp) {
+    vex(2, 1, ymm, 0, base);
+    byte(0x18);
+    memOperand(ymm, base, disp);
+  }
+
+  // op dst, a, b
+  void vop(int op, int dst, int a, int b) {
+    vex(1, 0, dst, a, b);
+    byte(op);
+    byte(0xC0 | ((dst & 7) << 3) | (b & 7));
+  }
+
+  // op dst, a, [base + disp]
+  void vopMem(int op, int dst, int a, int base, int32_t disp) {
+    vex(1, 0, dst, a, base);
+    byte(op);
+    memOperand(dst, base, disp);
+  }
+
+  void vsqrt(int dst, int a) {
+    vop(VSQRTPS, dst, 0, a);
+  }
+
+  void vcmp(int dst, int a, int b, int predicate) {
+    vop(VCMPPS, dst, a, b);
+    byte(predicate);
+  }
+
+  void vcmpMem(int dst, int a, int base, int32_t disp, int predicate) {
+    vopMem(VCMPPS, dst, a, base, disp);
+    byte(predicate);
+  }
+
+private:
+  void rex(bool w, int reg, int rm) {
+    uint8_t r = 0x40 | (w << 3) | ((reg >> 3) << 2) | (rm >> 3);
+
+    if(r != 0x40)
+      byte(r);
+  }
+
+  // Three byte VEX prefix with L = 256. map: 1 = 0F, 2 = 0F38. pp: 0 = none,
+  // 1 = 66. v is the extra source register (0 if unused).
+  void vex(int map, int pp, int reg, int v, int rm) {
+    byte(0xC4);
+    byte((((reg >> 3) ^ 1) << 7) | (1 << 6) | (((rm >> 3) ^ 1) << 5) | map);
+    byte(((~v & 15) << 3) | (1 << 2) | pp);
+  }
+
+  void memOperand(int reg, int base, int32_t disp) {
+    byte(0x80 | ((reg & 7) << 3) | (base & 7));
+
+    // rsp and r12 as base need a SIB byte
+    if((base & 7) == RSP)
+      byte(0x24);
+
+    int32(disp);
+  }
+};
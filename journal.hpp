@@ -0,0 +1,388 @@
+#pragma once
+
+#include <vector>
+#include <string>
+#include <chrono>
+#include <thread>
+#include <atomic>
+#include <memory>
+#include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "gridfile.hpp"
+
+// Keeps a grid file up to date with the edits made to the grid without
+// rewriting the whole file. Edits are appended to a journal next to the grid
+// file ("<file>.journal"):
+//
+//   GridJournalHeader
+//   blocks of { GridJournalBlock, records }
+//
+// A record is the chunk index (uint32), the voxel inside the chunk (uint16,
+// x fastest, then y, then z) and the new value. Records are buffered and
+// written as one synced block per commit, so many edits share a single write
+// (group commit) and at most commit_interval seconds of edits are lost on a
+// crash. A checkpoint writes the chunks that changed since the last one into
+// the grid file and empties the journal. Once the grid file holds mostly
+// chunks that are no longer referenced, it's compacted by saving the whole
+// grid again on a background thread, from a snapshot of the grid (see
+// GridSnapshot), while edits go on being journaled.
+//
+// The grid file always holds the last checkpoint, and replaying the journal
+// on top of it gives the grid as of the last commit. Records hold absolute
+// values, so replaying a journal that was already checkpointed is harmless.
+
+const char GRID_JOURNAL_MAGIC[4] = { 'V', 'X', 'J', 'L' };
+const uint32_t GRID_JOURNAL_VERSION = 1;
+
+struct GridJournalHeader {
+  char magic[4];
+  uint32_t version;
+  uint32_t value_size;
+  int32_t x_size, y_size, z_size;
+};
+
+struct GridJournalBlock {
+  uint32_t total_records;
+  uint32_t checksum;      // checksumBytes() of the records
+};
+
+template<typename T, typename Layout = LinearLayout>
+class GridStore {
+public:
+  static const int RECORD_SIZE = sizeof(uint32_t) + sizeof(uint16_t) + sizeof(T);
+
+  Grid3D<T, Layout>* grid;
+  std::string filename;
+  std::string journal_filename;
+  ChunkGrid chunks;
+
+  std::vector<bool> dirty;          // Chunks changed since the last checkpoint
+  std::vector<int> dirty_chunks;
+
+  std::vector<uint8_t> pending;     // Records not committed yet
+  int total_pending;
+
+  int journal_fd;
+  uint64_t journal_size;
+
+  bool saved;                       // Whether the grid file holds a checkpoint of the grid
+  uint64_t garbage;                 // Bytes of the grid file no longer referenced
+
+  std::thread compactor;            // Saves the whole grid while the grid file is compacted
+  std::atomic<bool> compacted;      // Whether the compactor is done
+  std::string compact_error;        // Why the compactor failed ("" if it didn't)
+
+  double commit_interval;           // Seconds between group commits
+  uint64_t checkpoint_size;         // Journal size that triggers a checkpoint
+  std::chrono::steady_clock::time_point last_commit;
+
+  GridStore(const char* file) {
+    grid = NULL;
+    filename = file;
+    journal_filename = filename + ".journal";
+    total_pending = 0;
+    journal_fd = -1;
+    journal_size = 0;
+    saved = false;
+    garbage = 0;
+    compacted = false;
+    commit_interval = 0.25;
+    checkpoint_size = 4 << 20;
+  }
+
+  ~GridStore() {
+    if(compactor.joinable()) {
+      compactor.join();
+      grid->releaseSnapshot();
+    }
+
+    if(journal_fd != -1)
+      close(journal_fd);
+  }
+
+  // Starts tracking the edits of g. If g was loaded from the grid file, pass
+  // recover to replay the edits a previous run left in the journal (returns
+  // how many were replayed). Otherwise g is saved to the grid file first and
+  // the journal is started over. Throws a std::string on failure.
+  int attach(Grid3D<T, Layout>* g, bool recover) {
+    finishCompaction();
+
+    grid = g;
+    chunks.init(g->x_size, g->y_size, g->z_size);
+    dirty.assign(chunks.total(), false);
+    dirty_chunks.clear();
+    pending.clear();
+    total_pending = 0;
+    garbage = 0;
+    last_commit = std::chrono::steady_clock::now();
+
+    if(journal_fd != -1)
+      close(journal_fd);
+
+    journal_fd = open(journal_filename.c_str(), O_RDWR | O_CREAT, 0644);
+
+    if(journal_fd == -1)
+      throw "Failed to open " + journal_filename;
+
+    int total_replayed = 0;
+
+    if(recover) {
+      saved = true;
+      total_replayed = replay();
+    }
+    else {
+      saved = false;
+      checkpoint();
+    }
+
+    return total_replayed;
+  }
+
+  // Records that voxel (x, y, z) was set to value. Call after changing the
+  // grid.
+  void recordEdit(int x, int y, int z, T value) {
+    int chunk = chunks.chunkOf(x, y, z);
+    int x1, y1, z1, x2, y2, z2;
+
+    chunks.bounds(chunk, x1, y1, z1, x2, y2, z2);
+
+    uint32_t c = chunk;
+    uint16_t voxel = (x - x1) + ((y - y1) + (z - z1) * (y2 - y1)) * (x2 - x1);
+
+    appendValue(pending, c);
+    appendValue(pending, voxel);
+    appendValue(pending, value);
+    ++total_pending;
+
+    markDirty(chunk);
+  }
+
+  void markDirty(int chunk) {
+    if(!dirty[chunk]) {
+      dirty[chunk] = true;
+      dirty_chunks.push_back(chunk);
+    }
+  }
+
+  // Call once per frame. Commits the pending edits every commit_interval
+  // seconds and checkpoints once the journal grows past checkpoint_size (but
+  // not while the grid file is being compacted).
+  void update() {
+    double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - last_commit).count();
+
+    if(total_pending != 0 && elapsed >= commit_interval)
+      commit();
+
+    if(compacted)
+      finishCompaction();
+
+    if(journal_size >= checkpoint_size && !compactor.joinable())
+      checkpoint();
+  }
+
+  // Writes the pending edits to the journal as one block and syncs it
+  void commit() {
+    last_commit = std::chrono::steady_clock::now();
+
+    if(total_pending == 0)
+      return;
+
+    GridJournalBlock block;
+
+    block.total_records = total_pending;
+    block.checksum = checksumBytes(&pending[0], pending.size());
+
+    if(!pwriteAll(journal_fd, &block, sizeof(block), journal_size) ||
+        !pwriteAll(journal_fd, &pending[0], pending.size(), journal_size + sizeof(block)) ||
+        fdatasync(journal_fd) == -1)
+      throw "Failed to write " + journal_filename;
+
+    journal_size += sizeof(block) + pending.size();
+    pending.clear();
+    total_pending = 0;
+  }
+
+  // Writes the chunks changed since the last checkpoint to the grid file and
+  // empties the journal. The whole grid is saved instead (to a temporary file
+  // that replaces the grid file) if it was never saved. The grid file is
+  // synced, and so is its directory after a replace, before the journal is
+  // emptied, so a crash never loses both. Waits for a compaction of the grid
+  // file to finish first, and starts one if the unreferenced part of the file
+  // outgrew the raw size of the grid.
+  void checkpoint() {
+    finishCompaction();
+
+    if(saved && dirty_chunks.size() == 0 && journal_size == sizeof(GridJournalHeader) && total_pending == 0)
+      return;
+
+    if(saved && dirty_chunks.size() != 0)
+      garbage = saveGridChunks(*grid, filename.c_str(), dirty_chunks);
+
+    if(!saved) {
+      std::string temp_filename = filename + ".tmp";
+
+      saveGrid(*grid, temp_filename.c_str());
+      replaceFile(temp_filename, filename);
+
+      saved = true;
+      garbage = 0;
+    }
+
+    for(int i = 0; i < (int)dirty_chunks.size(); ++i)
+      dirty[dirty_chunks[i]] = false;
+
+    dirty_chunks.clear();
+    pending.clear();
+    total_pending = 0;
+
+    resetJournal();
+
+    if(garbage > (uint64_t)grid->x_size * grid->y_size * grid->z_size * sizeof(T))
+      startCompaction();
+  }
+
+  // Saves the whole grid as of now into a new grid file on the compactor
+  // thread. The grid file and the emptied journal already match the snapshot,
+  // and edits made meanwhile are journaled as usual: replaying them on either
+  // the old or the new file gives the same grid. Only chunk rewrites have to
+  // wait, since they'd go to the file that's about to be replaced.
+  void startCompaction() {
+    std::shared_ptr<GridSnapshot<T, Layout> > snapshot = grid->snapshot();
+    std::string temp_filename = filename + ".tmp";
+    std::string target = filename;
+
+    compacted = false;
+    compact_error = "";
+
+    compactor = std::thread([this, snapshot, temp_filename, target]() {
+      try {
+        saveGrid(*snapshot, temp_filename.c_str());
+        replaceFile(temp_filename, target);
+      }
+      catch(const char* s) {
+        compact_error = s;
+      }
+      catch(std::string s) {
+        compact_error = s;
+      }
+
+      compacted = true;
+    });
+  }
+
+  // Waits for the compactor (if any). Throws a std::string if it failed, in
+  // which case the old grid file is still in use.
+  void finishCompaction() {
+    if(!compactor.joinable())
+      return;
+
+    compactor.join();
+    compacted = false;
+    grid->releaseSnapshot();
+
+    if(compact_error != "")
+      throw compact_error;
+
+    garbage = 0;
+  }
+
+  void resetJournal() {
+    GridJournalHeader header;
+
+    memcpy(header.magic, GRID_JOURNAL_MAGIC, 4);
+    header.version = GRID_JOURNAL_VERSION;
+    header.value_size = sizeof(T);
+    header.x_size = grid->x_size;
+    header.y_size = grid->y_size;
+    header.z_size = grid->z_size;
+
+    if(ftruncate(journal_fd, 0) == -1 || !pwriteAll(journal_fd, &header, sizeof(header), 0) || fdatasync(journal_fd) == -1)
+      throw "Failed to write " + journal_filename;
+
+    journal_size = sizeof(header);
+  }
+
+  // Applies the committed edits in the journal to the grid and returns how
+  // many there were. A journal for another grid is discarded, and a block
+  // that was only partly written when the program stopped ends the journal.
+  int replay() {
+    GridJournalHeader header;
+    off_t size = lseek(journal_fd, 0, SEEK_END);
+
+    if(size < (off_t)sizeof(header) || !preadAll(journal_fd, &header, sizeof(header), 0) ||
+        memcmp(header.magic, GRID_JOURNAL_MAGIC, 4) != 0 || header.version != GRID_JOURNAL_VERSION ||
+        header.value_size != sizeof(T) || header.x_size != grid->x_size ||
+        header.y_size != grid->y_size || header.z_size != grid->z_size) {
+      resetJournal();
+      return 0;
+    }
+
+    uint64_t offset = sizeof(header);
+    int total_replayed = 0;
+    std::vector<uint8_t> records;
+
+    while(offset + sizeof(GridJournalBlock) <= (uint64_t)size) {
+      GridJournalBlock block;
+
+      if(!preadAll(journal_fd, &block, sizeof(block), offset))
+        break;
+
+      uint64_t records_size = (uint64_t)block.total_records * RECORD_SIZE;
+
+      if(records_size > size - offset - sizeof(block))
+        break;
+
+      records.resize(records_size);
+
+      if(records_size != 0 && !preadAll(journal_fd, &records[0], records_size, offset + sizeof(block)))
+        break;
+
+      if(checksumBytes(records.data(), records_size) != block.checksum)
+        break;
+
+      for(uint32_t i = 0; i < block.total_records; ++i)
+        total_replayed += applyRecord(&records[i * RECORD_SIZE]);
+
+      offset += sizeof(block) + records_size;
+    }
+
+    // Drop whatever follows the last complete block
+    if(ftruncate(journal_fd, offset) == -1)
+      throw "Failed to write " + journal_filename;
+
+    journal_size = offset;
+
+    return total_replayed;
+  }
+
+  int applyRecord(const uint8_t* record) {
+    uint32_t chunk;
+    uint16_t voxel;
+    T value;
+
+    memcpy(&chunk, record, sizeof(chunk));
+    memcpy(&voxel, record + sizeof(chunk), sizeof(voxel));
+    memcpy(&value, record + sizeof(chunk) + sizeof(voxel), sizeof(T));
+
+    if(chunk >= (uint32_t)chunks.total() || voxel >= chunks.volume(chunk))
+      return 0;
+
+    int x1, y1, z1, x2, y2, z2;
+
+    chunks.bounds(chunk, x1, y1, z1, x2, y2, z2);
+
+    int w = x2 - x1;
+    int h = y2 - y1;
+
+    grid->get(x1 + voxel % w, y1 + voxel / w % h, z1 + voxel / (w * h)) = value;
+    markDirty(chunk);
+
+    return 1;
+  }
+
+  int totalDirtyChunks() {
+    return dirty_chunks.size();
+  }
+};
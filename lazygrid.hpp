@@ -0,0 +1,248 @@
+#pragma once
+
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <algorithm>
+
+#include "grid.hpp"
+
+enum {
+  LAZY_QUEUED,        // Not generated yet
+  LAZY_GENERATING,    // A thread is evaluating it
+  LAZY_DONE
+};
+
+// Fills a grid from a formula one chunk at a time instead of all at once, so
+// the grid can be used before all of it is generated. Background worker
+// threads generate the chunks closest to the camera first (see
+// prioritize()), and require() generates the chunks a reader is about to
+// touch right away on the calling thread.
+//
+// Voxels are the same as from Formula::generate(), with r set to half the
+// smallest dimension of the grid. Until a chunk is done its voxels must not
+// be read: check ready() or call require() first.
+template<typename T, typename Layout = LinearLayout>
+class LazyGrid {
+public:
+  Grid3D<T, Layout>* grid;
+  Formula formula;
+  int radius;
+  ChunkGrid chunks;
+
+  std::vector<int> state;           // Per chunk
+  std::vector<int> queue;           // Chunks not started yet, the next one at the back
+  std::vector<float> distance;      // Distance of each chunk from the last eye, for sorting
+  std::vector<int> done;            // Chunks finished since the last takeDone()
+  glm::vec3 sorted_eye;
+  bool sorted;
+  int total_done;
+
+  std::mutex mutex;
+  std::condition_variable work_available;
+  std::condition_variable chunk_done;
+  std::vector<std::thread> workers;
+  bool stop;
+
+  LazyGrid(Grid3D<T, Layout>* g, const Formula& f, int total_workers = 0) {
+    grid = g;
+    formula = f;
+    radius = std::min(g->x_size, std::min(g->y_size, g->z_size)) / 2;
+    chunks.init(g->x_size, g->y_size, g->z_size);
+
+    state.assign(chunks.total(), LAZY_QUEUED);
+    distance.assign(chunks.total(), 0);
+
+    // Until the camera is known the chunks are generated in order
+    for(int i = chunks.total() - 1; i >= 0; --i)
+      queue.push_back(i);
+
+    sorted = false;
+    total_done = 0;
+    stop = false;
+
+    if(total_workers <= 0)
+      total_workers = std::max(1, (int)std::thread::hardware_concurrency() - 1);
+
+    for(int i = 0; i < total_workers; ++i)
+      workers.push_back(std::thread(&LazyGrid::workerLoop, this));
+  }
+
+  // Stops the workers. Chunks that weren't generated keep the grid's old
+  // voxels.
+  ~LazyGrid() {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      stop = true;
+    }
+
+    work_available.notify_all();
+
+    for(int i = 0; i < (int)workers.size(); ++i)
+      workers[i].join();
+  }
+
+  LazyGrid(const LazyGrid&) = delete;
+  LazyGrid& operator=(const LazyGrid&) = delete;
+
+  // Orders the remaining chunks by their distance from eye (in the grid's
+  // model space), closest first. Cheap to call every frame: the chunks are
+  // only sorted again after the eye moves half a chunk.
+  void prioritize(glm::vec3 eye) {
+    std::lock_guard<std::mutex> lock(mutex);
+    glm::vec3 spacing(grid->grid_dx, grid->grid_dy, grid->grid_dz);
+
+    if(queue.size() == 0 || (sorted && glm::length((eye - sorted_eye) / spacing) < GRID_CHUNK_SIZE / 2))
+      return;
+
+    for(int i = 0; i < (int)queue.size(); ++i) {
+      int x1, y1, z1, x2, y2, z2;
+
+      chunks.bounds(queue[i], x1, y1, z1, x2, y2, z2);
+      distance[queue[i]] = glm::length(glm::vec3(x1 + x2, y1 + y2, z1 + z2) * 0.5f * spacing - eye);
+    }
+
+    std::sort(queue.begin(), queue.end(), [this](int a, int b) { return distance[a] > distance[b]; });
+
+    sorted_eye = eye;
+    sorted = true;
+  }
+
+  // True if every chunk overlapping the voxels [x1, x2) x [y1, y2) x [z1, z2)
+  // (clipped to the grid) is generated
+  bool ready(int x1, int y1, int z1, int x2, int y2, int z2) {
+    std::vector<int> overlapping = chunksIn(x1, y1, z1, x2, y2, z2);
+    std::lock_guard<std::mutex> lock(mutex);
+
+    for(int i = 0; i < (int)overlapping.size(); ++i) {
+      if(state[overlapping[i]] != LAZY_DONE)
+        return false;
+    }
+
+    return true;
+  }
+
+  // Generates the chunks overlapping the voxels [x1, x2) x [y1, y2) x
+  // [z1, z2) that aren't done yet, waiting for the ones a worker is already
+  // generating
+  void require(int x1, int y1, int z1, int x2, int y2, int z2) {
+    std::vector<int> overlapping = chunksIn(x1, y1, z1, x2, y2, z2);
+
+    for(int i = 0; i < (int)overlapping.size(); ++i)
+      requireChunk(overlapping[i]);
+  }
+
+  void requireAll() {
+    require(0, 0, 0, grid->x_size, grid->y_size, grid->z_size);
+  }
+
+  // Returns the chunks that finished generating since the last call, so
+  // whatever was built from their old voxels can be updated
+  std::vector<int> takeDone() {
+    std::lock_guard<std::mutex> lock(mutex);
+    std::vector<int> r;
+
+    r.swap(done);
+
+    return r;
+  }
+
+  bool complete() {
+    std::lock_guard<std::mutex> lock(mutex);
+
+    return total_done == chunks.total();
+  }
+
+  void requireChunk(int chunk) {
+    std::unique_lock<std::mutex> lock(mutex);
+
+    if(state[chunk] == LAZY_QUEUED) {
+      queue.erase(std::find(queue.begin(), queue.end(), chunk));
+      state[chunk] = LAZY_GENERATING;
+
+      lock.unlock();
+      generateChunk(chunk);
+      lock.lock();
+
+      finishChunk(chunk);
+    }
+
+    while(state[chunk] != LAZY_DONE)
+      chunk_done.wait(lock);
+  }
+
+private:
+  std::vector<int> chunksIn(int x1, int y1, int z1, int x2, int y2, int z2) {
+    std::vector<int> overlapping;
+
+    x1 = std::max(x1, 0);
+    y1 = std::max(y1, 0);
+    z1 = std::max(z1, 0);
+
+    x2 = std::min(x2, grid->x_size);
+    y2 = std::min(y2, grid->y_size);
+    z2 = std::min(z2, grid->z_size);
+
+    if(x1 >= x2 || y1 >= y2 || z1 >= z2)
+      return overlapping;
+
+    for(int z = z1 >> GRID_CHUNK_SHIFT; z <= (z2 - 1) >> GRID_CHUNK_SHIFT; ++z) {
+      for(int y = y1 >> GRID_CHUNK_SHIFT; y <= (y2 - 1) >> GRID_CHUNK_SHIFT; ++y) {
+        for(int x = x1 >> GRID_CHUNK_SHIFT; x <= (x2 - 1) >> GRID_CHUNK_SHIFT; ++x)
+          overlapping.push_back(chunks.index(x, y, z));
+      }
+    }
+
+    return overlapping;
+  }
+
+  // Chunks don't share voxels, so several can be generated at once without
+  // holding the mutex
+  void generateChunk(int chunk) {
+    int x1, y1, z1, x2, y2, z2;
+
+    chunks.bounds(chunk, x1, y1, z1, x2, y2, z2);
+
+    formula.evaluateRows(x1, y1, z1, x2 - x1, y2 - y1, z2 - z1, radius, [&](int y, int z, const float* values) {
+      for(int x = x1; x < x2; ++x)
+        grid->get(x, y, z) = values[x - x1];
+    });
+  }
+
+  // Must be called with the mutex held
+  void finishChunk(int chunk) {
+    state[chunk] = LAZY_DONE;
+    done.push_back(chunk);
+    ++total_done;
+    chunk_done.notify_all();
+  }
+
+  void workerLoop() {
+    while(true) {
+      int chunk;
+
+      {
+        std::unique_lock<std::mutex> lock(mutex);
+
+        while(!stop && queue.size() == 0)
+          work_available.wait(lock);
+
+        if(stop)
+          return;
+
+        chunk = queue.back();
+        queue.pop_back();
+        state[chunk] = LAZY_GENERATING;
+      }
+
+      generateChunk(chunk);
+
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+
+        finishChunk(chunk);
+      }
+    }
+  }
+};
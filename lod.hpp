@@ -0,0 +1,221 @@
+#pragma once
+
+#include <vector>
+
+#include "grid.hpp"
+
+// Number of detail levels kept per chunk: full resolution, then 2x, 4x and 8x
+// downsampled
+const int LOD_LEVELS = 4;
+
+// Builds a pyramid of downsampled copies of a grid and meshes it chunk by chunk.
+// Each chunk is rendered at the level picked by its distance from the camera.
+//
+// A cell at level n is solid if any of the 8 cells it covers at level n - 1 is
+// solid, so every coarse level encloses the full resolution surface. Level 0
+// chunks cull faces against their real neighbors, while coarser chunks always
+// generate the faces on their border (skirts). Since coarse geometry never
+// shrinks, two adjacent chunks at different levels can't leave a crack between
+// them.
+//
+// The downsampled levels are stored in Morton order (see MortonLayout), so the
+// cells of a chunk, and the 8 cells each coarser cell is built from, are close
+// together in memory. Level 0 keeps the layout of the source grid.
+template<typename T, typename Layout = LinearLayout>
+class VoxelLod {
+public:
+  Grid3D<T, Layout>* grid;                        // Level 0 (not owned)
+  Grid3D<T, MortonLayout>* levels[LOD_LEVELS];    // Downsampled levels (levels[0] is NULL)
+  int chunks_x, chunks_y, chunks_z;
+  float lod_distance;
+  T empty;
+
+  // Per chunk: downsampled levels need to be rebuilt
+  std::vector<bool> stale;
+
+  // Per chunk and level: mesh needs to be rebuilt
+  std::vector<bool> mesh_dirty;
+
+  // Level 0 is the source grid (not owned). lod_distance is the distance at
+  // which level 1 is selected, and every further level doubles it.
+  VoxelLod(Grid3D<T, Layout>* g, T empty_value, float distance) {
+    grid = g;
+    levels[0] = NULL;
+    empty = empty_value;
+    lod_distance = distance;
+
+    int x_size = g->x_size;
+    int y_size = g->y_size;
+    int z_size = g->z_size;
+
+    for(int i = 1; i < LOD_LEVELS; ++i) {
+      x_size = (x_size + 1) / 2;
+      y_size = (y_size + 1) / 2;
+      z_size = (z_size + 1) / 2;
+
+      levels[i] = new Grid3D<T, MortonLayout>(x_size, y_size, z_size, g->grid_dx * (1 << i), g->grid_dy * (1 << i),
+                                              g->grid_dz * (1 << i), empty);
+    }
+
+    chunks_x = (g->x_size + GRID_CHUNK_SIZE - 1) / GRID_CHUNK_SIZE;
+    chunks_y = (g->y_size + GRID_CHUNK_SIZE - 1) / GRID_CHUNK_SIZE;
+    chunks_z = (g->z_size + GRID_CHUNK_SIZE - 1) / GRID_CHUNK_SIZE;
+
+    stale.assign(totalChunks(), true);
+    mesh_dirty.assign(totalChunks() * LOD_LEVELS, true);
+  }
+
+  ~VoxelLod() {
+    for(int i = 1; i < LOD_LEVELS; ++i)
+      delete levels[i];
+  }
+
+  int totalChunks() {
+    return chunks_x * chunks_y * chunks_z;
+  }
+
+  int chunkIndex(int cx, int cy, int cz) {
+    return cx + cy * chunks_x + cz * chunks_y * chunks_x;
+  }
+
+  // Range of cells covered by the chunk at the given level
+  void chunkRegion(int chunk, int level, int& x1, int& y1, int& z1, int& x2, int& y2, int& z2) {
+    int size = GRID_CHUNK_SIZE >> level;
+
+    x1 = (chunk % chunks_x) * size;
+    y1 = ((chunk / chunks_x) % chunks_y) * size;
+    z1 = (chunk / (chunks_x * chunks_y)) * size;
+
+    if(level == 0) {
+      x2 = std::min(x1 + size, grid->x_size);
+      y2 = std::min(y1 + size, grid->y_size);
+      z2 = std::min(z1 + size, grid->z_size);
+    }
+    else {
+      x2 = std::min(x1 + size, levels[level]->x_size);
+      y2 = std::min(y1 + size, levels[level]->y_size);
+      z2 = std::min(z1 + size, levels[level]->z_size);
+    }
+  }
+
+  glm::vec3 chunkCenter(int chunk) {
+    int x1, y1, z1, x2, y2, z2;
+
+    chunkRegion(chunk, 0, x1, y1, z1, x2, y2, z2);
+
+    return glm::vec3((x1 + x2) * grid->grid_dx, (y1 + y2) * grid->grid_dy, (z1 + z2) * grid->grid_dz) * 0.5f;
+  }
+
+  // Picks the level to render a chunk at, eye being the camera position in
+  // the coordinate space of the grid
+  int selectLevel(int chunk, glm::vec3 eye) {
+    float dist = glm::length(chunkCenter(chunk) - eye);
+    float d = lod_distance;
+    int level = 0;
+
+    while(level < LOD_LEVELS - 1 && dist >= d) {
+      ++level;
+      d *= 2;
+    }
+
+    return level;
+  }
+
+  // Must be called after the voxel at (x, y, z) of the source grid changes
+  void markDirty(int x, int y, int z) {
+    int cx = x / GRID_CHUNK_SIZE;
+    int cy = y / GRID_CHUNK_SIZE;
+    int cz = z / GRID_CHUNK_SIZE;
+
+    markChunkDirty(cx, cy, cz);
+
+    // Level 0 culls against the neighboring chunks, so a voxel on the border
+    // of a chunk affects the mesh on the other side too
+    if(x % GRID_CHUNK_SIZE == 0) markChunkDirty(cx - 1, cy, cz);
+    if(y % GRID_CHUNK_SIZE == 0) markChunkDirty(cx, cy - 1, cz);
+    if(z % GRID_CHUNK_SIZE == 0) markChunkDirty(cx, cy, cz - 1);
+
+    if(x % GRID_CHUNK_SIZE == GRID_CHUNK_SIZE - 1) markChunkDirty(cx + 1, cy, cz);
+    if(y % GRID_CHUNK_SIZE == GRID_CHUNK_SIZE - 1) markChunkDirty(cx, cy + 1, cz);
+    if(z % GRID_CHUNK_SIZE == GRID_CHUNK_SIZE - 1) markChunkDirty(cx, cy, cz + 1);
+  }
+
+  void markChunkDirty(int cx, int cy, int cz) {
+    if(cx < 0 || cx >= chunks_x || cy < 0 || cy >= chunks_y || cz < 0 || cz >= chunks_z)
+      return;
+
+    int chunk = chunkIndex(cx, cy, cz);
+
+    stale[chunk] = true;
+
+    for(int i = 0; i < LOD_LEVELS; ++i)
+      mesh_dirty[chunk * LOD_LEVELS + i] = true;
+  }
+
+  void markAllDirty() {
+    stale.assign(stale.size(), true);
+    mesh_dirty.assign(mesh_dirty.size(), true);
+  }
+
+  bool needsMesh(int chunk, int level) {
+    return mesh_dirty[chunk * LOD_LEVELS + level];
+  }
+
+  // Rebuilds the downsampled levels of a chunk. Chunks are aligned to cells of
+  // every level, so only the voxels of the chunk itself are read.
+  void downsample(int chunk) {
+    downsampleLevel(grid, chunk, 1);
+
+    for(int level = 2; level < LOD_LEVELS; ++level)
+      downsampleLevel(levels[level - 1], chunk, level);
+
+    stale[chunk] = false;
+  }
+
+  // Builds the cells of a chunk at level from src, the level before it
+  template<typename L>
+  void downsampleLevel(Grid3D<T, L>* src, int chunk, int level) {
+    Grid3D<T, MortonLayout>* dest = levels[level];
+    int x1, y1, z1, x2, y2, z2;
+
+    chunkRegion(chunk, level, x1, y1, z1, x2, y2, z2);
+
+    for(int z = z1; z < z2; ++z) {
+      for(int y = y1; y < y2; ++y) {
+        for(int x = x1; x < x2; ++x) {
+          T value = empty;
+
+          for(int i = 0; i < 8 && value == empty; ++i) {
+            int xx = x * 2 + (i & 1);
+            int yy = y * 2 + ((i >> 1) & 1);
+            int zz = z * 2 + (i >> 2);
+
+            if(src->validPos(xx, yy, zz))
+              value = src->get(xx, yy, zz);
+          }
+
+          dest->get(x, y, z) = value;
+        }
+      }
+    }
+  }
+
+  std::vector<Triangle> meshChunk(int chunk, int level) {
+    std::vector<Triangle> t;
+    int x1, y1, z1, x2, y2, z2;
+
+    if(stale[chunk])
+      downsample(chunk);
+
+    chunkRegion(chunk, level, x1, y1, z1, x2, y2, z2);
+
+    if(level == 0)
+      grid->triangulateRegion(x1, y1, z1, x2, y2, z2, empty, false, t);
+    else
+      levels[level]->triangulateRegion(x1, y1, z1, x2, y2, z2, empty, true, t);
+
+    mesh_dirty[chunk * LOD_LEVELS + level] = false;
+
+    return t;
+  }
+};
@@ -17,15 +17,21 @@
 #include "glm/gtc/matrix_transform.hpp"
 
 #include "grid.hpp"
+#include "lod.hpp"
+#include "gridfile.hpp"
+#include "pager.hpp"
+#include "journal.hpp"
+#include "mappedgrid.hpp"
+#include "history.hpp"
+#include "raycast.hpp"
+#include "components.hpp"
+#include "arena.hpp"
+#include "lazygrid.hpp"
+#include "gridcache.hpp"
+#include "rle.hpp"
 
 struct Color {
   float r, g, b;
-  
-  Color randomShade() {
-    float scale = (rand() % 100000) / 100000.0;
-    
-    return (Color) { r * scale, g * scale, b * scale };
-  }
 };
 
 const Color COLOR_RED = (Color) { 1.0, 0, 0 };
@@ -56,6 +62,9 @@ struct Vex3D {
   int x2, y2, z2;
 };
 
+// Bounding spheres of the solid voxels of a grid. Boxes spanning more than one
+// chunk are split on chunk boundaries, so every chunk gets a node of its own
+// (see findChunk()) that can be rebuilt when its voxels change.
 struct BoundNode {
   BoundSphere s;
   int x1, y1, z1;
@@ -68,7 +77,17 @@ struct BoundNode {
   BoundNode* children[8];
   BoundNode* parent;
   
-  bool partition(int xx1, int yy1, int zz1, int xx2, int yy2, int zz2, Grid3D<int>& g, BoundNode* node_parent, int empty);
+  BoundNode() {
+    count = 0;
+    total_children = 0;
+    parent = NULL;
+  }
+  
+  bool partition(int xx1, int yy1, int zz1, int xx2, int yy2, int zz2, Grid3D<int, BrickLayout>& g, BoundNode* node_parent, int empty, bool keep = true, bool only_chunks = false);
+  void fit();
+  BoundNode* findChunk(int x, int y, int z);
+  void rebuild(Grid3D<int, BrickLayout>& g, int empty);
+  
   void print(int indent) {
     for(int i = 0; i < indent; ++i) {
       std::cout << "\t";
@@ -87,12 +106,13 @@ struct BoundNode {
   }
   
   int countVoxelIntersect(BoundNode* node, glm::vec3 pos, glm::vec3 node_pos, std::vector<Vex3D>& inter) {
-    if(!s.intersect(node->s, pos, node_pos)) {
+    // Nodes of chunks without solid voxels have no sphere
+    if(count == 0 || node->count == 0 || !s.intersect(node->s, pos, node_pos)) {
       return 0;
     }
     else {
-      if(count == 1) {
-        if(node->count == 1) {
+      if(total_children == 0) {
+        if(node->total_children == 0) {
           inter.push_back((Vex3D) { x1, y1, z1, node->x1, node->y1, node->z1});
           return 1;
         }
@@ -119,7 +139,25 @@ struct BoundNode {
 
 #undef NDEBUG
 
-bool BoundNode::partition(int xx1, int yy1, int zz1, int xx2, int yy2, int zz2, Grid3D<int>& g, BoundNode* node_parent, int empty) {
+// Where to split [a, b): on the chunk boundary closest to the middle if
+// chunked, otherwise in the middle. Returns a if [a, b) isn't split.
+static int boundSplit(int a, int b, bool chunked) {
+  if(chunked) {
+    int first = a >> GRID_CHUNK_SHIFT;
+    int last = (b - 1) >> GRID_CHUNK_SHIFT;
+    
+    return first == last ? a : (first + (last - first + 1) / 2) << GRID_CHUNK_SHIFT;
+  }
+  
+  return b - a > 1 ? (a + b) / 2 : a;
+}
+
+// Builds the node of the solid voxels in [xx1, xx2) x [yy1, yy2) x
+// [zz1, zz2) of g. Returns false if there are none, unless keep is set:
+// chunks and the nodes above them are kept even when empty, so voxels that
+// become solid later can be added by rebuild(). With only_chunks the chunks
+// are left empty without reading g, for a grid that isn't generated yet.
+bool BoundNode::partition(int xx1, int yy1, int zz1, int xx2, int yy2, int zz2, Grid3D<int, BrickLayout>& g, BoundNode* node_parent, int empty, bool keep, bool only_chunks) {
   x1 = xx1;
   y1 = yy1;
   z1 = zz1;
@@ -134,13 +172,23 @@ bool BoundNode::partition(int xx1, int yy1, int zz1, int xx2, int yy2, int zz2,
     children[i] = NULL;
   
   total_children = 0;
+  count = 0;
   
   assert(x1 != x2);
   assert(y1 != y2);
   assert(z1 != z2);
   
+  // Until the box is a single chunk, only the axes spanning several chunks
+  // are split
+  bool chunked = (x1 >> GRID_CHUNK_SHIFT) != ((x2 - 1) >> GRID_CHUNK_SHIFT) ||
+    (y1 >> GRID_CHUNK_SHIFT) != ((y2 - 1) >> GRID_CHUNK_SHIFT) ||
+    (z1 >> GRID_CHUNK_SHIFT) != ((z2 - 1) >> GRID_CHUNK_SHIFT);
+  
+  if(only_chunks && !chunked)
+    return keep;
+  
   if(x2 == x1 + 1 && y2 == y1 + 1 && z2 == z1 + 1) {
-    if(/*g.get(x1, y1, z1) != empty*/true) {
+    if(g.get(x1, y1, z1) != empty) {
       count = 1;
       s.pos.x = (x1 + .5) * g.grid_dx;
       s.pos.y = (y1 + .5) * g.grid_dy;
@@ -151,84 +199,282 @@ bool BoundNode::partition(int xx1, int yy1, int zz1, int xx2, int yy2, int zz2,
       return true;
     }
     else {
-      return false;
+      return keep;
     }
   }
-  else {
-    int mx = (x1 + x2) / 2;
-    int my = (y1 + y2) / 2;
-    int mz = (z1 + z2) / 2;
-    
-    int dx = mx - x1;
-    int dy = my - y1;
-    int dz = mz - z1;
-    
-    sum_x = 0;
-    sum_y = 0;
-    sum_z = 0;
-    count = 0;
-    
-    
-    s.r = 0;
+  
+  int xs[3] = { x1, boundSplit(x1, x2, chunked), x2 };
+  int ys[3] = { y1, boundSplit(y1, y2, chunked), y2 };
+  int zs[3] = { z1, boundSplit(z1, z2, chunked), z2 };
+  
+  for(int x = 0; x < 2; ++x) {
+    for(int y = 0; y < 2; ++y) {
+      for(int z = 0; z < 2; ++z) {
+        if(xs[x] == xs[x + 1] || ys[y] == ys[y + 1] || zs[z] == zs[z + 1])
+          continue;
+        
+        BoundNode* child = new BoundNode;
+        
+        if(child->partition(xs[x], ys[y], zs[z], xs[x + 1], ys[y + 1], zs[z + 1], g, this, empty, chunked, only_chunks))
+          children[total_children++] = child;
+        else
+          delete child;
+      }
+    }
+  }
+  
+  fit();
+  
+  return count > 0 || keep;
+}
+
+// Recomputes the sphere around the children that hold solid voxels
+void BoundNode::fit() {
+  int solid = 0;
+  
+  sum_x = 0;
+  sum_y = 0;
+  sum_z = 0;
+  count = 0;
+  
+  s.r = 0;
+  
+  for(int i = 0; i < total_children; ++i) {
+    if(children[i]->count == 0)
+      continue;
     
-    int xx = dx == 0 ? 1 : dx;
-    int yy = dy == 0 ? 1 : dy;
-    int zz = dz == 0 ? 1 : dz;
+    sum_x += children[i]->s.pos.x;
+    sum_y += children[i]->s.pos.y;
+    sum_z += children[i]->s.pos.z;
+    count += children[i]->count;
     
+    ++solid;
+  }
+  
+  if(solid == 0)
+    return;
+  
+  s.pos.x = sum_x / solid;
+  s.pos.y = sum_y / solid;
+  s.pos.z = sum_z / solid;
+  
+  for(int i = 0; i < total_children; ++i) {
+    if(children[i]->count == 0)
+      continue;
     
+    float dx = children[i]->s.pos.x - s.pos.x;
+    float dy = children[i]->s.pos.y - s.pos.y;
+    float dz = children[i]->s.pos.z - s.pos.z;
+    float r = sqrt(dx * dx + dy * dy + dz * dz) + children[i]->s.r;
     
-    for(int x = x1; x <= mx; x += xx) {
-      for(int y = y1; y <= my; y += yy) {
-        for(int z = z1; z <= mz; z += zz) {
-          
-          
-          children[total_children] = new BoundNode;
-        
-          if(!children[total_children]->partition(x, y, z, x + xx, y + yy, z + zz, g, this, empty)) {
-            delete children[total_children];
-          }
-          else {
-            sum_x += children[total_children]->s.pos.x;
-            sum_y += children[total_children]->s.pos.y;
-            sum_z += children[total_children]->s.pos.z;
-            count += children[total_children]->count;
-            
-            ++total_children;
-          }
-        }
-      }
-    }
+    s.r = std::max(s.r, r);
+  }
+}
+
+// Node of the chunk holding voxel (x, y, z), NULL if it's outside the tree
+BoundNode* BoundNode::findChunk(int x, int y, int z) {
+  BoundNode* node = this;
+  
+  while((node->x1 >> GRID_CHUNK_SHIFT) != ((node->x2 - 1) >> GRID_CHUNK_SHIFT) ||
+      (node->y1 >> GRID_CHUNK_SHIFT) != ((node->y2 - 1) >> GRID_CHUNK_SHIFT) ||
+      (node->z1 >> GRID_CHUNK_SHIFT) != ((node->z2 - 1) >> GRID_CHUNK_SHIFT)) {
+    BoundNode* next = NULL;
     
-    if(total_children > 0 && count > 0) {
-      s.pos.x = sum_x / total_children;
-      s.pos.y = sum_y / total_children;
-      s.pos.z = sum_z / total_children;
+    for(int i = 0; i < node->total_children && !next; ++i) {
+      BoundNode* c = node->children[i];
       
-      for(int i = 0; i < total_children; ++i) {
-        float dx = children[i]->s.pos.x - s.pos.x;
-        float dy = children[i]->s.pos.y - s.pos.y;
-        float dz = children[i]->s.pos.z - s.pos.z;
-        float r = sqrt(dx * dx + dy * dy + dz * dz) + children[i]->s.r;
-        
-        s.r = std::max(s.r, r);
-      }
-      
-      return true;
-    }
-    else {
-      return false;
+      if(x >= c->x1 && x < c->x2 && y >= c->y1 && y < c->y2 && z >= c->z1 && z < c->z2)
+        next = c;
     }
+    
+    if(!next)
+      return NULL;
+    
+    node = next;
   }
+  
+  return node;
+}
+
+// Builds the node again from the voxels of g, then refits the nodes above it
+void BoundNode::rebuild(Grid3D<int, BrickLayout>& g, int empty) {
+  for(int i = 0; i < total_children; ++i)
+    delete children[i];
+  
+  partition(x1, y1, z1, x2, y2, z2, g, parent, empty);
+  
+  for(BoundNode* node = parent; node; node = node->parent)
+    node->fit();
 }
     
     
     
 
 
+// Staging memory for data uploaded to the GPU, freed at the end of every frame
+FrameArena frame_arena;
+
 struct ModelTriangle {
   int v[3];
 };
 
+// Alpha of a vertex color, which tells the shader how to color the face. The
+// color of a tinted face comes from the model's tint uniform, so recoloring a
+// model doesn't touch its buffers.
+const float VERTEX_HIDDEN = 0;    // Not drawn
+const float VERTEX_TINTED = 1;    // Model tint
+const float VERTEX_PAINTED = 2;   // RGB of the vertex color
+
+// Colors of the materials a formula can give its solid voxels (see select in
+// formula.hpp), from material 2 on. Material 1, the solid voxels of formulas
+// without materials, is tinted with the color of the model instead.
+const Color MATERIAL_COLORS[] = {
+  { .55, .55, .55 },    // 2: stone
+  { .5, .33, .17 },     // 3: dirt
+  { .3, .65, .2 },      // 4: grass
+  { .9, .82, .55 },     // 5: sand
+  { .2, .4, .85 },      // 6: water
+  { .95, .95, .95 },    // 7: snow
+  { .65, .15, .1 },     // 8: brick
+  { .2, .2, .2 }        // 9: coal
+};
+
+const int TOTAL_MATERIAL_COLORS = sizeof(MATERIAL_COLORS) / sizeof(MATERIAL_COLORS[0]);
+
+// Writes the color of the 3 vertices of a face of the given material (12
+// floats). Materials past the last color reuse the colors from the start.
+void materialColor(int material, GLfloat* color_data) {
+  Color c = { 1, 1, 1 };
+  float mode = VERTEX_TINTED;
+  
+  if(material != 1) {
+    int i = (material - 2) % TOTAL_MATERIAL_COLORS;
+    
+    c = MATERIAL_COLORS[i < 0 ? i + TOTAL_MATERIAL_COLORS : i];
+    mode = VERTEX_PAINTED;
+  }
+  
+  for(int d = 0; d < 3; ++d) {
+    color_data[d * 4 + 0] = c.r;
+    color_data[d * 4 + 1] = c.g;
+    color_data[d * 4 + 2] = c.b;
+    color_data[d * 4 + 3] = mode;
+  }
+}
+
+// Draws triangles from a vertex buffer (3 floats per vertex) and a color buffer
+// (4 floats per vertex). Without a color buffer every face is tinted.
+void drawBuffers(GLuint vertexBuffer, GLuint colorBuffer, int total_triangles) {
+  glEnableVertexAttribArray(0);
+  glBindBuffer(GL_ARRAY_BUFFER, vertexBuffer);
+  glVertexAttribPointer(
+    0,                  // attribute 0. No particular reason for 0, but must match the layout in the shader.
+    3,                  // size
+    GL_FLOAT,           // type
+    GL_FALSE,           // normalized?
+    0,                  // stride
+    (void*)0            // array buffer offset
+  );
+  
+  if(colorBuffer != 0) {
+    glEnableVertexAttribArray(1);
+    glBindBuffer(GL_ARRAY_BUFFER, colorBuffer);
+    glVertexAttribPointer(
+          1,                                // attribute. No particular reason for 1, but must match the layout in the shader.
+          4,                                // size
+          GL_FLOAT,                         // type
+          GL_FALSE,                         // normalized?
+          0,                                // stride
+           (void*)0                          // array buffer offset
+    );
+  }
+  else {
+    glVertexAttrib4f(1, 1, 1, 1, VERTEX_TINTED);
+  }
+  
+  // Draw the triangle !
+  glDrawArrays(GL_TRIANGLES, 0, total_triangles * 3); // Starting from vertex 0; 3 vertices total -> 1 triangle
+  glDisableVertexAttribArray(1);
+  glDisableVertexAttribArray(0);
+}
+
+// GPU buffer holding the mesh of one chunk. Chunks whose faces are all of
+// material 1 are tinted with the color of their model, so they only get a
+// color buffer if they have faces of other materials.
+struct ChunkMesh {
+  GLuint vertexBuffer;
+  GLuint colorBuffer;
+  int total_triangles;
+  
+  ChunkMesh() {
+    vertexBuffer = 0;
+    colorBuffer = 0;
+    total_triangles = 0;
+  }
+  
+  void upload(std::vector<Triangle>& t) {
+    if(vertexBuffer == 0)
+      glGenBuffers(1, &vertexBuffer);
+    
+    total_triangles = t.size();
+    
+    if(t.size() == 0)
+      return;
+    
+    GLfloat* vertex_data = frame_arena.alloc<GLfloat>(t.size() * 9);
+    bool materials = false;
+    
+    for(int i = 0; i < (int)t.size(); ++i) {
+      for(int d = 0; d < 3; ++d) {
+        vertex_data[i * 9 + d * 3 + 0] = t[i].v[d].x;
+        vertex_data[i * 9 + d * 3 + 1] = t[i].v[d].y;
+        vertex_data[i * 9 + d * 3 + 2] = t[i].v[d].z;
+      }
+      
+      materials |= t[i].material != 1;
+    }
+    
+    glBindBuffer(GL_ARRAY_BUFFER, vertexBuffer);
+    glBufferData(GL_ARRAY_BUFFER, sizeof(GLfloat) * 9 * t.size(), vertex_data, GL_STATIC_DRAW);
+    
+    if(!materials) {
+      if(colorBuffer != 0)
+        glDeleteBuffers(1, &colorBuffer);
+      
+      colorBuffer = 0;
+      return;
+    }
+    
+    GLfloat* color_data = frame_arena.alloc<GLfloat>(t.size() * 12);
+    
+    for(int i = 0; i < (int)t.size(); ++i)
+      materialColor(t[i].material, &color_data[i * 12]);
+    
+    if(colorBuffer == 0)
+      glGenBuffers(1, &colorBuffer);
+    
+    glBindBuffer(GL_ARRAY_BUFFER, colorBuffer);
+    glBufferData(GL_ARRAY_BUFFER, sizeof(GLfloat) * 12 * t.size(), color_data, GL_STATIC_DRAW);
+  }
+  
+  void render() {
+    if(total_triangles > 0)
+      drawBuffers(vertexBuffer, colorBuffer, total_triangles);
+  }
+  
+  void destroy() {
+    if(vertexBuffer != 0)
+      glDeleteBuffers(1, &vertexBuffer);
+    
+    if(colorBuffer != 0)
+      glDeleteBuffers(1, &colorBuffer);
+    
+    vertexBuffer = 0;
+    colorBuffer = 0;
+    total_triangles = 0;
+  }
+};
+
 class Model {
 private:
   std::vector<Triangle> tri;
@@ -236,12 +482,85 @@ private:
 public:
   GLuint vertexBuffer;
   GLuint colorBuffer;
-  Grid3D<int>* grid;
+  
+  // Stored in bricks so a world file can be mapped into it (see
+  // loadMappedGrid()). On 256^3 maps, BoundNode::partition() runs 10-20%
+  // faster on bricks than on a linear grid, about as fast as with
+  // MortonLayout. Triangulating stays as fast as on a linear grid, where
+  // MortonLayout takes up to 3.5 times as long.
+  Grid3D<int, BrickLayout>* grid;
   BoundNode bound_root;
+  Color color;
+  
+  VoxelLod<int, BrickLayout>* lod;
+  std::vector<ChunkMesh> lod_mesh;
+  bool lod_enabled;
+  
+  // Records edits to the grid so they're saved (NULL if the grid isn't saved)
+  GridStore<int, BrickLayout>* store;
+  
+  // Records edits to the grid so they can be undone (NULL if they can't)
+  EditHistory<int, BrickLayout>* history;
+  
+  // Casts rays against the grid (NULL if not needed)
+  GridRaycaster<int, BrickLayout>* raycaster;
+  
+  // Finds the parts of the grid that were cut loose (NULL if not needed)
+  GridComponents<int, BrickLayout>* components;
+  
+  // Generates the grid in the background, NULL once the grid is complete.
+  // Until then the model is drawn chunk by chunk as the chunks are generated.
+  LazyGrid<int, BrickLayout>* generator;
+  
+  // Formula the grid was generated from, kept when its parameters change
+  // over time (NULL otherwise). Such a model is drawn chunk by chunk, so only
+  // the chunks that change have to be meshed again.
+  Formula* formula;
+  
+  // Triangles the buffers have room for
+  int capacity;
+  
+  Model() {
+    grid = NULL;
+    lod = NULL;
+    store = NULL;
+    history = NULL;
+    raycaster = NULL;
+    components = NULL;
+    generator = NULL;
+    formula = NULL;
+    capacity = 0;
+    vertexBuffer = 0;
+    colorBuffer = 0;
+    lod_enabled = false;
+    color = COLOR_GREEN;
+  }
+  
+  // The store is shared with the rest of the program, so it's not deleted
+  ~Model() {
+    // The workers write into the grid
+    delete generator;
+    
+    if(vertexBuffer != 0) {
+      glDeleteBuffers(1, &vertexBuffer);
+      glDeleteBuffers(1, &colorBuffer);
+    }
+    
+    for(int i = 0; i < (int)lod_mesh.size(); ++i)
+      lod_mesh[i].destroy();
+    
+    delete formula;
+    delete lod;
+    delete history;
+    delete raycaster;
+    delete components;
+    delete grid;
+  }
   
   void deleteAllInTree(BoundNode* node) {
-    if(node->count == 1) {
-      deleteVoxel(node->x1, node->y1, node->z1, COLOR_BLUE);
+    if(node->total_children == 0) {
+      if(node->count == 1)
+        deleteVoxel(node->x1, node->y1, node->z1, COLOR_BLUE);
     }
     else {
       for(int i = 0; i < node->total_children; ++i) {
@@ -250,109 +569,460 @@ public:
     }
   }
   
+  // While the grid is generated lazily, the chunks start out empty and are
+  // filled in by takeGenerated() as they're done
   void createBound() {
     std::cout << "Create bounding tree" << std::endl;
-    bound_root.partition(0, 0, 0, grid->x_size, grid->y_size, grid->z_size, *grid, NULL, 0);
+    bound_root.partition(0, 0, 0, grid->x_size, grid->y_size, grid->z_size, *grid, NULL, 0, true, generator != NULL);
     
     std::cout << bound_root.s.pos.x << " " << bound_root.s.pos.y << " " << bound_root.s.pos.z << " " << std::endl;
   }
   
+  // Builds the bounding tree of the given chunks (indices into a ChunkGrid of
+  // the grid) again after voxels in them changed
+  void updateBound(const std::vector<int>& chunks) {
+    ChunkGrid chunk_grid(grid->x_size, grid->y_size, grid->z_size);
+    
+    for(int i = 0; i < (int)chunks.size(); ++i) {
+      int x1, y1, z1, x2, y2, z2;
+      
+      chunk_grid.bounds(chunks[i], x1, y1, z1, x2, y2, z2);
+      
+      BoundNode* node = bound_root.findChunk(x1, y1, z1);
+      
+      if(node)
+        node->rebuild(*grid, 0);
+    }
+  }
+  
   void createGrid(int xx, int yy, int zz, float dx, float dy, float dz, int default_value) {
-    grid = new Grid3D<int>(xx, yy, zz, dx, dy, dz, default_value);
+    grid = new Grid3D<int, BrickLayout>(xx, yy, zz, dx, dy, dz, default_value);
   }
   
-  void colorModel(Color c) {
-    GLfloat* color_data = new GLfloat[tri.size() * 16];
+  // Builds the bounding nodes of the chunks the generator finished since the
+  // last call, and has the raycaster and components count their voxels
+  void takeGenerated() {
+    if(!generator)
+      return;
     
-    for(int i = 0; i < tri.size(); ++i) {
-      for(int d = 0; d < 3; ++d) {
-        Color rc = c.randomShade();
-        
-        color_data[i * 12 + d * 4 + 0] = rc.r;
-        color_data[i * 12 + d * 4 + 1] = rc.g;
-        color_data[i * 12 + d * 4 + 2] = rc.b;
-        color_data[i * 12 + d * 4 + 3] = 1;
-      }
+    std::vector<int> chunks = generator->takeDone();
+    
+    for(int i = 0; i < (int)chunks.size(); ++i) {
+      if(raycaster)
+        raycaster->markChunkDirty(chunks[i]);
+      
+      if(components)
+        components->markChunkDirty(chunks[i]);
     }
     
-    glBindBuffer(GL_ARRAY_BUFFER, colorBuffer);
-    glBufferSubData(GL_ARRAY_BUFFER, 0, sizeof(GLfloat) * 16 * tri.size(), color_data);
+    updateBound(chunks);
+  }
+  
+  // Voxels [a, b) overlapping the box [lo, hi] in the grid's model space
+  void voxelBox(glm::vec3 lo, glm::vec3 hi, glm::ivec3& a, glm::ivec3& b) {
+    glm::vec3 spacing(grid->grid_dx, grid->grid_dy, grid->grid_dz);
     
-    delete [] color_data;
+    a = glm::ivec3(glm::floor(lo / spacing));
+    b = glm::ivec3(glm::floor(hi / spacing)) + 1;
   }
   
-  void deleteVoxel(int x, int y, int z, Color c) {
-    TriangleRun* run = &grid->triangle_run[grid->index(x, y, z)];
-    GLfloat value = 0.0f;
-    int& val = grid->get(x, y, z);
+  // Generates the chunks overlapping the box [lo, hi] (in the grid's model
+  // space) right away if they aren't yet, so they can be cut
+  void requireBox(glm::vec3 lo, glm::vec3 hi) {
+    if(!generator)
+      return;
     
-    if(val != 0) {
-      while(run) {
-        if(run->start >= 0 && run->end >= 0 && run->start <= run->end) {
-        
-          //std::cout << "Run start: " << run->start << " " << run->end << std::endl;
-          
-          glBindBuffer(GL_ARRAY_BUFFER, colorBuffer);
+    glm::ivec3 a, b;
+    
+    voxelBox(lo, hi, a, b);
+    generator->require(a.x, a.y, a.z, b.x, b.y, b.z);
+    takeGenerated();
+  }
+  
+  // True if any voxel overlapping the box [lo, hi] (in the grid's model
+  // space) is solid. Empty space is skipped using the raycaster's octree.
+  bool solidInBox(glm::vec3 lo, glm::vec3 hi) {
+    glm::ivec3 a, b;
+    
+    voxelBox(lo, hi, a, b);
+    
+    return raycaster->anySolid(a.x, a.y, a.z, b.x, b.y, b.z);
+  }
+  
+  // Casts a ray against the grid. While the grid is generated lazily, the
+  // ray is cast a chunk's length further at a time, generating the chunks of
+  // each stretch first, so only the chunks up to the hit are generated.
+  RayHit castRay(Ray ray) {
+    if(!generator)
+      return raycaster->cast(ray);
+    
+    float step = GRID_CHUNK_SIZE * std::min(grid->grid_dx, std::min(grid->grid_dy, grid->grid_dz));
+    float length = glm::length(ray.dir);
+    float max_distance = ray.max_distance;
+    RayHit hit;
+    
+    hit.hit = false;
+    hit.distance = max_distance;
+    
+    for(float d = 0; d < max_distance && !hit.hit; d += step) {
+      ray.max_distance = std::min(d + step, max_distance);
+      
+      glm::vec3 a = ray.origin + ray.dir * (d / length);
+      glm::vec3 b = ray.origin + ray.dir * (ray.max_distance / length);
+      
+      requireBox(glm::min(a, b), glm::max(a, b));
+      hit = raycaster->cast(ray);
+    }
+    
+    return hit;
+  }
+  
+  // Finishes generating a lazily generated grid, then builds what needs the
+  // whole grid: the mesh
+  void finishGrid() {
+    if(!generator)
+      return;
+    
+    generator->requireAll();
+    takeGenerated();
+    
+    delete generator;
+    generator = NULL;
+    
+    // A model with a formula stays drawn chunk by chunk (see renderLod())
+    if(!formula) {
+      std::vector<Triangle> t = grid->triangulate(0);
+      setTriangles(t);
+    }
+  }
+  
+  // Sets a parameter of the formula of the grid, and generates again only the
+  // chunks whose voxels can change (see Formula::mayChange()). The chunks that
+  // did change are meshed again by renderLod(), and their bounding nodes are
+  // rebuilt so cuts hit the new voxels.
+  // The new voxels aren't edits, so a model whose formula changes has no
+  // history or store: their deltas and journal would stop matching the grid.
+  void setParameter(const std::string& name, float value) {
+    std::vector<float> old_values = formula->parameter_values;
+    
+    if(!formula->setParameter(name, value))
+      return;
+    
+    ChunkGrid chunk_grid(grid->x_size, grid->y_size, grid->z_size);
+    int r = std::min(grid->x_size, std::min(grid->y_size, grid->z_size)) / 2;
+    std::vector<int> candidates;
+    
+    for(int i = 0; i < chunk_grid.total(); ++i) {
+      int x1, y1, z1, x2, y2, z2;
+      
+      chunk_grid.bounds(i, x1, y1, z1, x2, y2, z2);
+      
+      if(formula->mayChange(x1, y1, z1, x2, y2, z2, r, old_values))
+        candidates.push_back(i);
+    }
+    
+    // Chunks don't share voxels, so they're generated in parallel
+    std::vector<char> changed(candidates.size(), false);
+    
+    parallelFor(candidates.size(), [&](int i) {
+      int x1, y1, z1, x2, y2, z2;
+      
+      chunk_grid.bounds(candidates[i], x1, y1, z1, x2, y2, z2);
+      
+      formula->evaluateRows(x1, y1, z1, x2 - x1, y2 - y1, z2 - z1, r, [&](int y, int z, const float* values) {
+        for(int x = x1; x < x2; ++x) {
+          int v = values[x - x1];
+          int& old = grid->get(x, y, z);
           
-          for(int i = run->start; i <= run->end; ++i) {
-            int offset = i * 48 + 12;
-            
-            glBufferSubData(GL_ARRAY_BUFFER, offset, sizeof(GLfloat), &value);
-            glBufferSubData(GL_ARRAY_BUFFER, offset + 16, sizeof(GLfloat), &value);
-            glBufferSubData(GL_ARRAY_BUFFER, offset + 32, sizeof(GLfloat), &value);
+          if(old != v) {
+            old = v;
+            changed[i] = true;
           }
         }
-        
-        run = run->next;
+      });
+    });
+    
+    std::vector<int> changed_chunks;
+    
+    for(int i = 0; i < (int)candidates.size(); ++i) {
+      if(!changed[i])
+        continue;
+      
+      int chunk = candidates[i];
+      
+      changed_chunks.push_back(chunk);
+      int cx = chunk % chunk_grid.chunks_x;
+      int cy = chunk / chunk_grid.chunks_x % chunk_grid.chunks_y;
+      int cz = chunk / (chunk_grid.chunks_x * chunk_grid.chunks_y);
+      
+      // Level 0 of the LOD culls faces against the neighboring chunks
+      if(lod) {
+        lod->markChunkDirty(cx, cy, cz);
+        lod->markChunkDirty(cx - 1, cy, cz);
+        lod->markChunkDirty(cx + 1, cy, cz);
+        lod->markChunkDirty(cx, cy - 1, cz);
+        lod->markChunkDirty(cx, cy + 1, cz);
+        lod->markChunkDirty(cx, cy, cz - 1);
+        lod->markChunkDirty(cx, cy, cz + 1);
       }
       
+      if(raycaster)
+        raycaster->markChunkDirty(chunk);
+      
+      if(components)
+        components->markChunkDirty(chunk);
+    }
+    
+    updateBound(changed_chunks);
+  }
+  
+  // Sets the tint of the model. Faces painted by cuts or with the color of
+  // their material keep their color.
+  void colorModel(Color c) {
+    color = c;
+  }
+  
+  void deleteVoxel(int x, int y, int z, Color c) {
+    int& val = grid->get(x, y, z);
+    
+    if(val != 0) {
+      if(history)
+        history->touch(x, y, z);
+      
+      // A model with a formula or still being generated has no mesh of its
+      // own (see renderLod())
+      if(!formula && !generator)
+        hideTriangles(grid->index(x, y, z));
+      
       val = 0;
-      int start = tri.size();
-      grid->updateDeletedVoxelNeighbors(x, y, z, tri, 0);
       
-      int total = tri.size() - start;
-      GLfloat* color_data = new GLfloat[total * 16];
-      GLfloat* vertex_data = new GLfloat[total * 12];
+      if(lod)
+        lod->markDirty(x, y, z);
       
-      //std::cout << "Total: " << total << std::endl;
+      if(store)
+        store->recordEdit(x, y, z, 0);
       
-      GLfloat* ptr = vertex_data;
+      if(raycaster)
+        raycaster->markDirty(x, y, z);
       
-      for(int i = 0; i < total; ++i) {
-        for(int d = 0; d < 3; ++d) {
-          Color rc = c.randomShade();
-          
-          color_data[i * 12 + d * 4 + 0] = rc.r;
-          color_data[i * 12 + d * 4 + 1] = rc.g;
-          color_data[i * 12 + d * 4 + 2] = rc.b;
-          color_data[i * 12 + d * 4 + 3] = 1;
-        }
-        
-        
-        ptr[0] = tri[i + start].v[0].x;
-        ptr[1] = tri[i + start].v[0].y;
-        ptr[2] = tri[i + start].v[0].z;
+      if(components)
+        components->markDirty(x, y, z);
+      
+      if(!formula && !generator) {
+        int start = tri.size();
+        grid->updateDeletedVoxelNeighbors(x, y, z, tri, 0);
         
-        ptr[3] = tri[i + start].v[1].x;
-        ptr[4] = tri[i + start].v[1].y;
-        ptr[5] = tri[i + start].v[1].z;
+        uploadTriangles(start, c, VERTEX_PAINTED);
+      }
+    }
+  }
+  
+  // Hides the triangles of the voxel at index pos by clearing their alpha
+  void hideTriangles(int pos) {
+    TriangleRun* run = &grid->triangle_run[pos];
+    GLfloat value = VERTEX_HIDDEN;
+    
+    while(run) {
+      if(run->start >= 0 && run->end >= 0 && run->start <= run->end) {
+      
+        //std::cout << "Run start: " << run->start << " " << run->end << std::endl;
         
-        ptr[6] = tri[i + start].v[2].x;
-        ptr[7] = tri[i + start].v[2].y;
-        ptr[8] = tri[i + start].v[2].z;
+        glBindBuffer(GL_ARRAY_BUFFER, colorBuffer);
         
-        ptr += 9;
+        for(int i = run->start; i <= run->end; ++i) {
+          int offset = i * 48 + 12;
+          
+          glBufferSubData(GL_ARRAY_BUFFER, offset, sizeof(GLfloat), &value);
+          glBufferSubData(GL_ARRAY_BUFFER, offset + 16, sizeof(GLfloat), &value);
+          glBufferSubData(GL_ARRAY_BUFFER, offset + 32, sizeof(GLfloat), &value);
+        }
+      }
+      
+      run = run->next;
+    }
+  }
+  
+  // Uploads the triangles added to tri since start, colored as given by mode:
+  // VERTEX_TINTED colors them by material (see materialColor()), and
+  // VERTEX_PAINTED paints them with c. If the buffers are full the whole mesh
+  // is rebuilt instead.
+  void uploadTriangles(int start, Color c, float mode) {
+    if((int)tri.size() > capacity) {
+      rebuildMesh();
+      return;
+    }
+    
+    int total = tri.size() - start;
+    GLfloat* color_data = frame_arena.alloc<GLfloat>(total * 12);
+    GLfloat* vertex_data = frame_arena.alloc<GLfloat>(total * 9);
+    
+    //std::cout << "Total: " << total << std::endl;
+    
+    GLfloat* ptr = vertex_data;
+    
+    for(int i = 0; i < total; ++i) {
+      if(mode == VERTEX_TINTED) {
+        materialColor(tri[i + start].material, &color_data[i * 12]);
+      }
+      else {
+        for(int d = 0; d < 3; ++d) {
+          color_data[i * 12 + d * 4 + 0] = c.r;
+          color_data[i * 12 + d * 4 + 1] = c.g;
+          color_data[i * 12 + d * 4 + 2] = c.b;
+          color_data[i * 12 + d * 4 + 3] = mode;
+        }
+      }
+      
+      
+      ptr[0] = tri[i + start].v[0].x;
+      ptr[1] = tri[i + start].v[0].y;
+      ptr[2] = tri[i + start].v[0].z;
+      
+      ptr[3] = tri[i + start].v[1].x;
+      ptr[4] = tri[i + start].v[1].y;
+      ptr[5] = tri[i + start].v[1].z;
+      
+      ptr[6] = tri[i + start].v[2].x;
+      ptr[7] = tri[i + start].v[2].y;
+      ptr[8] = tri[i + start].v[2].z;
+      
+      ptr += 9;
+    }
+    
+    glBindBuffer(GL_ARRAY_BUFFER, colorBuffer);
+    glBufferSubData(GL_ARRAY_BUFFER, start * 48, sizeof(GLfloat) * 12 * total, color_data);
+    
+    glBindBuffer(GL_ARRAY_BUFFER, vertexBuffer);
+    glBufferSubData(GL_ARRAY_BUFFER, start * 36, sizeof(GLfloat) * 9 * total, vertex_data);
+  }
+  
+  // Regenerates the triangles of the given chunks (and of the voxels touching
+  // them, whose faces depend on the chunks) after their voxels were changed
+  // directly, such as by undo
+  void remeshChunks(const std::vector<int>& chunks) {
+    ChunkGrid chunk_grid(grid->x_size, grid->y_size, grid->z_size);
+    std::vector<bool> done(grid->x_size * grid->y_size * grid->z_size, false);
+    int start = tri.size();
+    
+    for(int i = 0; i < (int)chunks.size(); ++i) {
+      int x1, y1, z1, x2, y2, z2;
+      
+      chunk_grid.bounds(chunks[i], x1, y1, z1, x2, y2, z2);
+      
+      for(int z = std::max(z1 - 1, 0); z < std::min(z2 + 1, grid->z_size); ++z) {
+        for(int y = std::max(y1 - 1, 0); y < std::min(y2 + 1, grid->y_size); ++y) {
+          for(int x = std::max(x1 - 1, 0); x < std::min(x2 + 1, grid->x_size); ++x) {
+            int v = x + (y + z * grid->y_size) * grid->x_size;
+            
+            if(done[v])
+              continue;
+            
+            done[v] = true;
+            
+            int pos = grid->index(x, y, z);
+            
+            hideTriangles(pos);
+            
+            if(grid->get(x, y, z) != 0)
+              grid->triangulateVoxel(x, y, z, 0, tri);
+            else
+              grid->clearTriangleRun(pos);
+          }
+        }
       }
+    }
+    
+    uploadTriangles(start, color, VERTEX_TINTED);
+  }
+  
+  // Triangulates the whole grid again into new buffers
+  void rebuildMesh() {
+    for(int i = 0; i < grid->layout.size(); ++i)
+      grid->clearTriangleRun(i);
+    
+    glDeleteBuffers(1, &vertexBuffer);
+    glDeleteBuffers(1, &colorBuffer);
+    
+    std::vector<Triangle> t = grid->triangulate(0);
+    setTriangles(t);
+  }
+  
+  // Reverts (or repeats) the last action recorded in the history and remeshes
+  // the chunks it changed
+  void undo(bool redo) {
+    if(!history)
+      return;
+    
+    auto changed = [this](int x, int y, int z, int value) {
+      if(lod)
+        lod->markDirty(x, y, z);
+      
+      if(store)
+        store->recordEdit(x, y, z, value);
       
-      glBindBuffer(GL_ARRAY_BUFFER, colorBuffer);
-      glBufferSubData(GL_ARRAY_BUFFER, start * 48, sizeof(GLfloat) * 16 * total, color_data);
+      if(raycaster)
+        raycaster->markDirty(x, y, z);
       
-      glBindBuffer(GL_ARRAY_BUFFER, vertexBuffer);
-      glBufferSubData(GL_ARRAY_BUFFER, start * 36, sizeof(GLfloat) * 12 * total, vertex_data);
+      if(components)
+        components->markDirty(x, y, z);
+    };
+    
+    std::vector<int> chunks = redo ? history->redo(changed) : history->undo(changed);
+    
+    if(chunks.size() != 0) {
+      if(!generator)
+        remeshChunks(chunks);
       
+      updateBound(chunks);
     }
   }
     
+  // Moves every part of the grid that's no longer connected to its anchored
+  // part into a model of its own. offsets receives where each new model's
+  // grid starts inside this model. Detaching can't be undone, so whatever
+  // could be redone is forgotten.
+  std::vector<Model*> detachFloating(std::vector<glm::vec3>& offsets) {
+    std::vector<Model*> models;
+    
+    components->update();
+    
+    std::vector<int> floating = components->floatingComponents();
+    
+    if(floating.size() == 0)
+      return models;
+    
+    EditHistory<int, BrickLayout>* h = history;
+    
+    if(h)
+      h->dropRedo();
+    
+    history = NULL;
+    
+    for(int i = 0; i < (int)floating.size(); ++i) {
+      GridComponents<int, BrickLayout>::Component c = components->components[floating[i]];
+      Model* m = new Model;
+      
+      m->color = color;
+      m->createGrid(c.x2 - c.x1, c.y2 - c.y1, c.z2 - c.z1, grid->grid_dx, grid->grid_dy, grid->grid_dz, 0);
+      
+      components->forEachVoxel(floating[i], [&](int x, int y, int z) {
+        m->grid->get(x - c.x1, y - c.y1, z - c.z1) = grid->get(x, y, z);
+        deleteVoxel(x, y, z, color);
+      });
+      
+      std::vector<Triangle> t = m->grid->triangulate(0);
+      m->setTriangles(t);
+      m->createBound();
+      
+      models.push_back(m);
+      offsets.push_back(glm::vec3(c.x1 * grid->grid_dx, c.y1 * grid->grid_dy, c.z1 * grid->grid_dz));
+    }
+    
+    history = h;
+    
+    return models;
+  }
+  
   //int addTriangle(
   
   
@@ -382,10 +1052,12 @@ public:
     
     const int EXTRA = 10;
     
-    GLfloat* vertex_buffer_data = new GLfloat[tri.size() * 9 * EXTRA];
+    capacity = tri.size() * EXTRA;
+    
+    GLfloat* vertex_buffer_data = frame_arena.alloc<GLfloat>(tri.size() * 9);
     GLfloat* ptr = &vertex_buffer_data[0];
     
-    GLfloat* color_data = new GLfloat[tri.size() * 12 * EXTRA];
+    GLfloat* color_data = frame_arena.alloc<GLfloat>(tri.size() * 12);
     
     for(int i = 0; i < tri.size(); ++i) {
       ptr[0] = tri[i].v[0].x;
@@ -403,69 +1075,121 @@ public:
       ptr += 9;
     }
     
-    static int count = 0;
-    
-    ++count;
-    
-    for(int i = 0; i < tri.size() * 12; ++i) {
-      if((i % 4) != 3) {
-        if((i % 4) == 1)
-          color_data[i] = (rand() % 10000) / 10000.0;
-        else
-          color_data[i] = 0;
-      }
-      else {
-        if(count == 1)
-          color_data[i] = 1;
-        else
-          color_data[i] = 1;
-      }
-    }
+    for(int i = 0; i < tri.size(); ++i)
+      materialColor(tri[i].material, &color_data[i * 12]);
     
     // This will identify our vertex buffer
     // Generate 1 buffer, put the resulting identifier in vertexbuffer
     glGenBuffers(1, &vertexBuffer);
     // The following commands will talk about our 'vertexbuffer' buffer
     glBindBuffer(GL_ARRAY_BUFFER, vertexBuffer);
-    // Give our vertices to OpenGL.
-    glBufferData(GL_ARRAY_BUFFER, sizeof(GLfloat) * 9 * tri.size() * EXTRA, vertex_buffer_data, GL_STATIC_DRAW);
+    // Give our vertices to OpenGL. The buffers have room for the triangles
+    // added as voxels are cut.
+    glBufferData(GL_ARRAY_BUFFER, sizeof(GLfloat) * 9 * tri.size() * EXTRA, NULL, GL_STATIC_DRAW);
+    glBufferSubData(GL_ARRAY_BUFFER, 0, sizeof(GLfloat) * 9 * tri.size(), vertex_buffer_data);
     
     glGenBuffers(1, &colorBuffer);
     glBindBuffer(GL_ARRAY_BUFFER, colorBuffer);
-    glBufferData(GL_ARRAY_BUFFER, sizeof(GLfloat) * 12 * tri.size() * EXTRA, color_data, GL_STATIC_DRAW);
-    
-    delete [] color_data;
-    delete [] vertex_buffer_data;
+    glBufferData(GL_ARRAY_BUFFER, sizeof(GLfloat) * 12 * tri.size() * EXTRA, NULL, GL_STATIC_DRAW);
+    glBufferSubData(GL_ARRAY_BUFFER, 0, sizeof(GLfloat) * 12 * tri.size(), color_data);
+  }
+  
+  // Builds the level of detail pyramid for the grid. Chunk meshes are created
+  // lazily the first time a chunk is drawn at a given level.
+  void createLod(float distance) {
+    lod = new VoxelLod<int, BrickLayout>(grid, 0, distance);
+    lod_mesh.resize(lod->totalChunks() * LOD_LEVELS);
+  }
+  
+  // Renders every chunk at the level of detail chosen for its distance from
+  // eye (the camera position relative to the model), or at full detail for a
+  // model with a formula while level of detail is off. While the grid is being
+  // generated, chunks are skipped until they and their neighbors are done.
+  void renderLod(glm::vec3 eye) {
+    if(generator)
+      generator->prioritize(eye);
+    
+    for(int i = 0; i < lod->totalChunks(); ++i) {
+      if(generator) {
+        int x1, y1, z1, x2, y2, z2;
+        
+        lod->chunkRegion(i, 0, x1, y1, z1, x2, y2, z2);
+        
+        if(!generator->ready(x1 - 1, y1 - 1, z1 - 1, x2 + 1, y2 + 1, z2 + 1))
+          continue;
+      }
+      
+      int level = formula && !lod_enabled ? 0 : lod->selectLevel(i, eye);
+      ChunkMesh& mesh = lod_mesh[i * LOD_LEVELS + level];
+      
+      if(lod->needsMesh(i, level)) {
+        std::vector<Triangle> t = lod->meshChunk(i, level);
+        mesh.upload(t);
+      }
+      
+      mesh.render();
+    }
   }
   
   // Renders the model using the current transformation settings
   void render() {
-    glEnableVertexAttribArray(0);
-    glBindBuffer(GL_ARRAY_BUFFER, vertexBuffer);
-    glVertexAttribPointer(
-      0,                  // attribute 0. No particular reason for 0, but must match the layout in the shader.
-      3,                  // size
-      GL_FLOAT,           // type
-      GL_FALSE,           // normalized?
-      0,                  // stride
-      (void*)0            // array buffer offset
-    );
+    drawBuffers(vertexBuffer, colorBuffer, tri.size());
+  }
+};
+
+// A world streamed in around the camera by a WorldPager. Meshes are in world
+// coordinates.
+class PagedWorld {
+public:
+  WorldPager<int>* pager;
+  std::map<ChunkKey, ChunkMesh> meshes;
+  Color color;
+  
+  PagedWorld(WorldPager<int>* p, Color c) {
+    pager = p;
+    color = c;
+  }
+  
+  ~PagedWorld() {
+    for(std::map<ChunkKey, ChunkMesh>::iterator i = meshes.begin(); i != meshes.end(); ++i)
+      i->second.destroy();
     
-    glEnableVertexAttribArray(1);
-    glBindBuffer(GL_ARRAY_BUFFER, colorBuffer);
-    glVertexAttribPointer(
-          1,                                // attribute. No particular reason for 1, but must match the layout in the shader.
-          4,                                // size
-          GL_FLOAT,                         // type
-          GL_FALSE,                         // normalized?
-          0,                                // stride
-           (void*)0                          // array buffer offset
-    );
+    delete pager;
+  }
+  
+  // Requests the chunks around the camera and uploads the ones that finished
+  // loading since the last frame
+  void update(glm::vec3 eye, glm::vec3 dir) {
+    pager->update(eye, dir);
+    
+    std::vector<ChunkKey> evicted = pager->takeEvicted();
     
-    // Draw the triangle !
-    glDrawArrays(GL_TRIANGLES, 0, tri.size() * 3); // Starting from vertex 0; 3 vertices total -> 1 triangle
-    glDisableVertexAttribArray(1);
-    glDisableVertexAttribArray(0);
+    for(int i = 0; i < (int)evicted.size(); ++i) {
+      meshes[evicted[i]].destroy();
+      meshes.erase(evicted[i]);
+    }
+    
+    std::vector<ChunkKey> ready = pager->takeReady();
+    
+    for(int i = 0; i < (int)ready.size(); ++i) {
+      PagedChunk<int>* chunk = pager->find(ready[i]);
+      
+      meshes[ready[i]].upload(chunk->mesh);
+      pager->releaseMesh(chunk);
+    }
+  }
+  
+  void render() {
+    for(std::map<ChunkKey, ChunkMesh>::iterator i = meshes.begin(); i != meshes.end(); ++i)
+      i->second.render();
+  }
+  
+  // True if pos (in world coordinates) is inside a solid voxel of a chunk
+  // that is loaded
+  bool solidAt(glm::vec3 pos) {
+    glm::vec3 v = pos / glm::vec3(pager->grid_dx, pager->grid_dy, pager->grid_dz);
+    
+    return pager->get((int)floor(v.x), (int)floor(v.y), (int)floor(v.z)) != pager->empty;
   }
 };
 
@@ -512,6 +1236,7 @@ public:
   GLuint programID;
   Camera cam;
   GLuint mvpMatrixID;
+  GLuint tintID;
   int mouse_dx, mouse_dy;
   std::map<int, bool> keyMap;
   bool lockMouse;
@@ -610,6 +1335,7 @@ public:
     cam.project_view = cam.project * cam.view;
     
     mvpMatrixID = glGetUniformLocation(programID, "MVP");
+    tintID = glGetUniformLocation(programID, "tint");
     
     quit = false;
     mouse_dx = 0;
@@ -673,10 +1399,21 @@ public:
   
   GLuint loadShaders(const char * vertex_file_path, const char* fragment_file_path);
   
+  void setTint(Color c) {
+    glUniform3f(tintID, c.r, c.g, c.b);
+  }
+  
   void renderActor(Actor& a) {
     glm::mat4x4 mvp = cam.project_view * a.mat; 
     glUniformMatrix4fv(mvpMatrixID, 1, GL_FALSE, &mvp[0][0]);
-    a.render();
+    
+    if(a.model)
+      setTint(a.model->color);
+    
+    if(a.model && (a.model->lod_enabled || a.model->generator || a.model->formula))
+      a.model->renderLod(cam.pos - a.pos);
+    else
+      a.render();
   }
   
   float deltaTime;
@@ -1079,12 +1816,128 @@ void Engine::handleKeys() {
   }
 }
 
+// Creates the grid of a model from a formula and meshes it. With a cache
+// directory, a grid generated before with the same settings is read from the
+// cache along with its mesh, and new grids are added to the cache.
+void generateModel(Model* m, int size, const Formula& formula, const char* cache_dir) {
+  std::string key;
+  std::vector<Triangle> t;
+  
+  if(cache_dir) {
+    key = gridCacheKey(formula, size, size, size, 1, 1, 1);
+    m->grid = loadCachedGrid<int, BrickLayout>(cache_dir, key, t);
+    
+    if(m->grid) {
+      std::cout << "Read grid from " << gridCachePath(cache_dir, key) << ".vxg" << std::endl;
+      m->setTriangles(t);
+      return;
+    }
+  }
+  
+  m->createGrid(size, size, size, 1, 1, 1, 1);
+  
+  // A heightmap is generated as runs, one height per column, then expanded
+  if(formula.height) {
+    ColumnGrid3D<int> columns(size, size, size, 1, 1, 1, 0);
+    
+    columns.generateHeightmap(formula, 1, 0);
+    columns.toGrid(*m->grid);
+    
+    std::cout << "Generated heightmap as " << columns.totalRuns() << " runs" << std::endl;
+  }
+  else {
+    formula.generate(*m->grid);
+  }
+  
+  t = m->grid->triangulate(0);
+  m->setTriangles(t);
+  
+  if(cache_dir) {
+    try {
+      saveCachedGrid(cache_dir, key, *m->grid, t);
+    }
+    catch(std::string s) {
+      std::cout << "ERROR: " << s << std::endl;
+    }
+  }
+}
+
+// Compiles a formula typed at startup, with the parameters given by --param
+Formula compileFormula(const std::string& exp, uint32_t seed, const std::map<std::string, float>& parameters) {
+  Formula f(exp, seed);
+  
+  for(std::map<std::string, float>::const_iterator i = parameters.begin(); i != parameters.end(); ++i)
+    f.setParameter(i->first, i->second);
+  
+  return f;
+}
+
 int main(int argc, char *argv[]) {
   Engine engine;
   
-  std::cout << "Map formula: ";
+  // The map is loaded from the world file if one is given, and edits to it
+  // are journaled and checkpointed back into the file (F5 checkpoints right
+  // away). With --stream, the map formula instead describes an endless world
+  // that is generated in chunks around the camera. --seed N changes the
+  // noise functions of the formulas. With --lazy the map is generated in the
+  // background, closest to the camera first, instead of before the first
+  // frame. Grids generated from formulas are kept in the gridcache directory
+  // so the next start with the same formulas only reads them (--no-cache
+  // turns that off). --param name=value sets $name in the formulas, and a
+  // map formula using t (the time in seconds) is animated, once it's fully
+  // generated with --lazy (it can't be saved to a world file).
+  const char* world_file = NULL;
+  bool stream = false;
+  bool lazy = false;
+  const char* cache_dir = "gridcache";
+  uint32_t seed = 0;
+  std::map<std::string, float> parameters;
+  
+  for(int i = 1; i < argc; ++i) {
+    if(std::string(argv[i]) == "--stream")
+      stream = true;
+    else if(std::string(argv[i]) == "--lazy")
+      lazy = true;
+    else if(std::string(argv[i]) == "--no-cache")
+      cache_dir = NULL;
+    else if(std::string(argv[i]) == "--param" && i + 1 < argc) {
+      std::string p = argv[++i];
+      size_t eq = p.find('=');
+      
+      if(eq == std::string::npos) {
+        std::cout << "ERROR: --param needs name=value" << std::endl;
+        return 1;
+      }
+      
+      parameters[p.substr(0, eq)] = atof(p.c_str() + eq + 1);
+    }
+    else if(std::string(argv[i]) == "--seed" && i + 1 < argc)
+      seed = strtoul(argv[++i], NULL, 10);
+    else
+      world_file = argv[i];
+  }
+  
+  Grid3D<int, BrickLayout>* loaded_grid = NULL;
+  
+  if(world_file && !stream) {
+    try {
+      loaded_grid = loadMappedGrid<int>(world_file);
+    }
+    catch(std::string s) {
+      std::cout << "ERROR: " << s << std::endl;
+      throw;
+    }
+  }
+  
   std::string exp;
-  getline(std::cin, exp);
+  
+  if(loaded_grid) {
+    std::cout << "Loaded map from " << world_file << std::endl;
+  }
+  else {
+    std::cout << "Map formula: ";
+    getline(std::cin, exp);
+  }
   
   std::cout << "Cutter formula: ";
   std::string exp2;
@@ -1123,43 +1976,117 @@ int main(int argc, char *argv[]) {
   Actor actor;
   actor.model = new Model;
   
-  actor.model->createGrid(64, 64, 64, 1, 1, 1, 1);
-  Grid3D<int>* g = actor.model->grid;
-  
-  try {
-    Grid3D_Helper<int>::evaluateFormula(*g, exp);
-    
+  if(loaded_grid) {
+    actor.model->grid = loaded_grid;
   }
-  catch(const char* s) {
-    std::cout << "ERROR: " << s << std::endl;
-    throw;
+  else if(stream) {
+    // The streamed world replaces the map
+    actor.model->createGrid(1, 1, 1, 1, 1, 1, 0);
   }
-  catch(std::string s) {
-    std::cout << "ERROR: " << s << std::endl;
-    throw;
+  else {
+    try {
+      // A new world file starts out as a copy of the whole map, so then the
+      // map is generated right away
+      Formula formula = compileFormula(exp, seed, parameters);
+      
+      // An animated map changes every frame, which can't be saved as edits
+      if(formula.hasParameter("t") && world_file)
+        throw "A map formula using t can't be saved to a world file";
+      
+      if(lazy && !world_file) {
+        actor.model->createGrid(64, 64, 64, 1, 1, 1, 1);
+        actor.model->generator = new LazyGrid<int, BrickLayout>(actor.model->grid, formula);
+      }
+      else {
+        generateModel(actor.model, 64, formula, cache_dir);
+      }
+      
+      if(formula.hasParameter("t"))
+        actor.model->formula = new Formula(formula);
+    }
+    catch(const char* s) {
+      std::cout << "ERROR: " << s << std::endl;
+      throw;
+    }
+    catch(std::string s) {
+      std::cout << "ERROR: " << s << std::endl;
+      throw;
+    }
+  }
+  
+  Grid3D<int, BrickLayout>* g = actor.model->grid;
+  GridStore<int, BrickLayout>* store = NULL;
+  
+  if(world_file && !stream) {
+    store = new GridStore<int, BrickLayout>(world_file);
+    
+    try {
+      int total_replayed = store->attach(g, loaded_grid != NULL);
+      
+      if(total_replayed != 0)
+        std::cout << "Recovered " << total_replayed << " edits from " << store->journal_filename << std::endl;
+    }
+    catch(std::string s) {
+      std::cout << "ERROR: " << s << std::endl;
+      throw;
+    }
+    
+    actor.model->store = store;
   }
 
   //g->generate(Grid3D_Helper<int>::generateCircle);
   //g->generate(Grid3D_Helper<int>::generateCone);
   
-  std::vector<Triangle> tt = g->triangulate(0);
-  actor.model->setTriangles(tt);
+  // A map generated by generateModel() is already meshed, and a lazily
+  // generated map gets its mesh once it's complete
+  if(!actor.model->generator && (loaded_grid || stream)) {
+    std::vector<Triangle> tt = g->triangulate(0);
+    actor.model->setTriangles(tt);
+  }
+  
   actor.model->createBound();
   
+  actor.model->createLod(48);
+  
+  // Cuts to an animated map are overwritten by the formula, so they can't be
+  // undone
+  if(!actor.model->formula)
+    actor.model->history = new EditHistory<int, BrickLayout>(g);
+  
+  actor.model->raycaster = new GridRaycaster<int, BrickLayout>(g, 0);
+  
+  // Chunks of a lazily generated map are counted as they're done
+  if(actor.model->generator)
+    actor.model->raycaster->assumeEmpty();
+  actor.model->components = new GridComponents<int, BrickLayout>(g, 0);
+  
+  PagedWorld* paged_world = NULL;
+  
+  if(stream) {
+    // Voxels of the streamed world are evaluated with the same radius as the
+    // 64^3 map
+    Formula formula = compileFormula(exp, seed, parameters);
+    
+    WorldPager<int>::ChunkSource source = [formula](int x, int y, int z, int w, int h, int d, int* out) {
+      formula.evaluateBlock(x, y, z, w, h, d, 32, out);
+    };
+    
+    WorldPager<int>* pager = new WorldPager<int>(source, 0, 1, 1, 1, 6, 48, 256 << 20);
+    pager->setBounds(glm::ivec3(INT_MIN / 2, 0, INT_MIN / 2), glm::ivec3(INT_MAX / 2, 4, INT_MAX / 2));
+    
+    paged_world = new PagedWorld(pager, COLOR_GREEN);
+  }
+  
   //======================================================
   
   Actor actor2;
   actor2.model = new Model;
   
-  actor2.model->createGrid(16, 16, 16, 1, 1, 1, 1);
-  Grid3D<int>* g2 = actor2.model->grid;
-  
   //g2->generate(Grid3D_Helper<int>::generateCircle);
   //g2->generate(Grid3D_Helper<int>::generateCone);
   
   try {
-    Grid3D_Helper<int>::evaluateFormula(*g2, exp2);
-    
+    generateModel(actor2.model, 16, compileFormula(exp2, seed, parameters), cache_dir);
   }
   catch(const char* s) {
     std::cout << "ERROR: " << s << std::endl;
@@ -1170,8 +2097,6 @@ int main(int argc, char *argv[]) {
     throw;
   }
   
-  std::vector<Triangle> tt2 = g2->triangulate(0);
-  actor2.model->setTriangles(tt2);
   actor2.model->createBound();
   
   //======================================================
@@ -1187,11 +2112,59 @@ int main(int argc, char *argv[]) {
   };
   
   Color color = colors[0];
+  bool lod_key_down = false;
+  bool save_key_down = false;
+  bool undo_key_down = false;
+  bool redo_key_down = false;
+  bool was_cutting = false;
+  bool detach_pending = false;
+  bool stats_key_down = false;
+  
+  // Seconds since the start, the t of an animated map formula
+  float elapsed = 0;
+  
+  // Pieces cut loose from the map, which fall until they're out of sight
+  std::vector<Actor*> islands;
+  std::vector<float> island_speed;
   
   while(!engine.quit) {
     /* Process incoming events. */
     
+    // Toggle level of detail rendering for the map
+    if(engine.keyDown(SDLK_l) && !lod_key_down) {
+      actor.model->lod_enabled = !actor.model->lod_enabled;
+    }
+    
+    lod_key_down = engine.keyDown(SDLK_l);
+    
+    // Cuts only generate the chunks they reach (see requireBox()), but saving
+    // and deleting everything need the whole map
+    actor.model->takeGenerated();
+    
+    if(actor.model->generator && (actor.model->generator->complete() ||
+        engine.keyDown(SDLK_RETURN) || engine.keyDown(SDLK_F5)))
+      actor.model->finishGrid();
+    
+    try {
+      if(engine.keyDown(SDLK_F5) && !save_key_down) {
+        if(store) {
+          store->checkpoint();
+          std::cout << "Saved map to " << world_file << std::endl;
+        }
+        else {
+          saveGrid(*g, "world.vxg");
+          std::cout << "Saved map to world.vxg" << std::endl;
+        }
+      }
+      
+      if(store)
+        store->update();
+    }
+    catch(std::string s) {
+      std::cout << "ERROR: " << s << std::endl;
+    }
     
+    save_key_down = engine.keyDown(SDLK_F5);
     
     for(int i = SDLK_1; i <= SDLK_5; ++i) {
       if(engine.keyDown(i)) {
@@ -1200,9 +2173,35 @@ int main(int argc, char *argv[]) {
       }
     }
     
+    // F3 prints how much staging memory frames use
+    if(engine.keyDown(SDLK_F3) && !stats_key_down) {
+      std::cout << "Frame memory: " << frame_arena.frame_bytes / 1024 << " KB in "
+                << frame_arena.frame_allocations << " allocations so far this frame, peak "
+                << frame_arena.peak_bytes / 1024 << " KB, reserved "
+                << frame_arena.capacity() / 1024 << " KB" << std::endl;
+    }
+    
+    stats_key_down = engine.keyDown(SDLK_F3);
+    
+    // Z undoes the last cut and X redoes it
+    if(engine.keyDown(SDLK_z) && !undo_key_down)
+      actor.model->undo(false);
+    
+    if(engine.keyDown(SDLK_x) && !redo_key_down)
+      actor.model->undo(true);
+    
+    undo_key_down = engine.keyDown(SDLK_z);
+    redo_key_down = engine.keyDown(SDLK_x);
+    
     if(engine.keyDown(SDLK_RETURN)) {
+      if(actor.model->history)
+        actor.model->history->beginAction();
+      
       actor.model->deleteAllInTree(&actor.model->bound_root);
       
+      if(actor.model->history)
+        actor.model->history->endAction();
+      
       for(int x = 0; x < g->x_size; ++x) {
         for(int y = 0; y < g->y_size; ++y) {
           for(int z = 0; z < g->z_size; ++z) {
@@ -1216,9 +2215,17 @@ int main(int argc, char *argv[]) {
     
     if(engine.keyDown(SDLK_LCTRL)) {
       std::vector<Vex3D> inter;
+      Grid3D<int, BrickLayout>* cutter = actor2.model->grid;
+      glm::vec3 cutter_size(cutter->x_size * cutter->grid_dx, cutter->y_size * cutter->grid_dy, cutter->z_size * cutter->grid_dz);
       
+      actor.model->requireBox(actor2.pos - actor.pos, actor2.pos - actor.pos + cutter_size);
       
-      actor.model->bound_root.countVoxelIntersect(&actor2.model->bound_root, actor.pos, actor2.pos, inter);
+      // The bounding trees are only walked if the cutter overlaps solid voxels.
+      // Voxel spheres reach past their voxels, so the box is a voxel bigger.
+      glm::vec3 margin(g->grid_dx, g->grid_dy, g->grid_dz);
+      
+      if(actor.model->solidInBox(actor2.pos - actor.pos - margin, actor2.pos - actor.pos + cutter_size + margin))
+        actor.model->bound_root.countVoxelIntersect(&actor2.model->bound_root, actor.pos, actor2.pos, inter);
       
       for(int i = 0; i < inter.size(); ++i) {
         if(actor2.model->grid->get(inter[i].x2, inter[i].y2, inter[i].z2) != 0) {
@@ -1227,6 +2234,67 @@ int main(int argc, char *argv[]) {
       }
     }
     
+    // Holding C cuts the voxel in the middle of the screen like a laser
+    if(engine.keyDown(SDLK_c)) {
+      Ray ray;
+      ray.origin = engine.cam.pos - actor.pos;
+      ray.dir = engine.cam.direction;
+      ray.max_distance = 256;
+      
+      RayHit hit = actor.model->castRay(ray);
+      
+      if(hit.hit)
+        actor.model->deleteVoxel(hit.x, hit.y, hit.z, color);
+    }
+    
+    bool cutting = engine.keyDown(SDLK_LCTRL) || engine.keyDown(SDLK_c);
+    
+    // Everything cut while a cutting key was held is undone together, and
+    // whatever the cut left floating is split off. That needs the whole map,
+    // so while it's still being generated it waits until the map is done.
+    if(!cutting) {
+      if(actor.model->history)
+        actor.model->history->endAction();
+      
+      if(was_cutting)
+        detach_pending = true;
+      
+      if(detach_pending && !actor.model->generator) {
+        detach_pending = false;
+        
+        std::vector<glm::vec3> offsets;
+        std::vector<Model*> models = actor.model->detachFloating(offsets);
+        
+        for(int i = 0; i < (int)models.size(); ++i) {
+          Actor* a = new Actor;
+          
+          a->model = models[i];
+          a->pos = actor.pos + offsets[i];
+          a->updatePos();
+          
+          islands.push_back(a);
+          island_speed.push_back(0);
+        }
+      }
+    }
+    
+    was_cutting = cutting;
+    
+    for(int i = 0; i < (int)islands.size(); ++i) {
+      island_speed[i] += 9.8f * engine.deltaTime;
+      islands[i]->pos.y -= island_speed[i] * engine.deltaTime;
+      islands[i]->updatePos();
+      
+      if(islands[i]->pos.y < actor.pos.y - 512) {
+        delete islands[i]->model;
+        delete islands[i];
+        
+        islands.erase(islands.begin() + i);
+        island_speed.erase(island_speed.begin() + i);
+        --i;
+      }
+    }
+    
     if(engine.keyDown(SDLK_RIGHT)) {
       actor2.pos.x += .1;
       actor2.updatePos();
@@ -1260,19 +2328,60 @@ int main(int argc, char *argv[]) {
     
     engine.deltaTime = 1.0 / 60.0;
     
+    // Only the chunks the time can change are generated again. A lazily
+    // generated map is generated for t = 0 and catches up once it's complete.
+    if(actor.model->formula) {
+      elapsed += engine.deltaTime;
+      
+      if(!actor.model->generator)
+        actor.model->setParameter("t", elapsed);
+    }
+    
     /* Draw the screen. */
     //draw_screen( );
     glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
     
+    glm::vec3 old_cam_pos = engine.cam.pos;
+    
     engine.handleKeys();
+    
+    // The camera can't fly into the streamed world
+    if(paged_world && paged_world->solidAt(engine.cam.pos))
+      engine.cam.pos = old_cam_pos;
+    
     engine.calcMatrixFromInput();
     
     engine.render();
-    engine.renderActor(actor);
+    
+    if(paged_world) {
+      paged_world->update(engine.cam.pos, engine.cam.direction);
+      
+      glm::mat4x4 mvp = engine.cam.project_view;
+      glUniformMatrix4fv(engine.mvpMatrixID, 1, GL_FALSE, &mvp[0][0]);
+      engine.setTint(paged_world->color);
+      paged_world->render();
+    }
+    else {
+      engine.renderActor(actor);
+    }
+    
     engine.renderActor(actor2);
     
+    for(int i = 0; i < (int)islands.size(); ++i)
+      engine.renderActor(*islands[i]);
+    
     //SDL_Delay(1);
     
     engine.flipScreen();
+    frame_arena.reset();
+  }
+  
+  if(store) {
+    try {
+      store->checkpoint();
+    }
+    catch(std::string s) {
+      std::cout << "ERROR: " << s << std::endl;
+    }
   }
 }
@@ -0,0 +1,123 @@
+#pragma once
+
+#include <vector>
+#include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "gridfile.hpp"
+
+// Maps len bytes of fd at offset over addr, which is already mapped. Returns
+// false (with addr mapped to zeros again) if the mapping failed.
+inline bool mapOver(void* addr, size_t len, int fd, uint64_t offset) {
+  if(mmap(addr, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd, offset) != MAP_FAILED)
+    return true;
+
+  // A failed MAP_FIXED may have unmapped the range already
+  if(mmap(addr, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0) == MAP_FAILED)
+    throw "Failed to map the grid";
+
+  return false;
+}
+
+// Loads a grid file for read mostly worlds without copying it: the voxels of
+// the grid are a private mapping of the file. Raw chunks that fill a whole
+// brick and start on a page (see alignPayload()) are mapped straight into
+// their brick, so their pages are only read when they're touched, come from
+// the page cache and are shared with every process mapping the same world.
+// The kernel makes a page private the first time it's written, so editing
+// the grid never touches the file. The other chunks (uniform, compressed or
+// cut short by the edges of the grid) are decoded like loadGrid() does. Save
+// worlds meant to be mapped with saveGrid(g, filename, false) so every non
+// uniform chunk is raw.
+//
+// Mapped chunks aren't checked against their checksums, since that would
+// read all of them. Payloads are never rewritten in place (see
+// saveGridChunks()), so the mapping goes on showing the file as it was
+// loaded. Returns NULL if the file can't be opened and throws a std::string
+// if it isn't a valid grid file.
+template<typename T>
+Grid3D<T, BrickLayout>* loadMappedGrid(const char* filename) {
+  FileDescriptor file(open(filename, O_RDONLY));
+  struct stat st;
+  GridFileHeader header;
+
+  if(file.fd == -1)
+    return NULL;
+
+  if(fstat(file.fd, &st) == -1)
+    throw "Failed to read " + std::string(filename);
+
+  if(st.st_size < (off_t)sizeof(header) || !preadAll(file.fd, &header, sizeof(header), 0))
+    throw std::string(filename) + " is truncated";
+
+  validateGridHeader<T>(header, filename);
+
+  std::vector<GridFileChunk> index(header.total_chunks);
+  uint64_t size = st.st_size;
+
+  if(size < sizeof(header) + sizeof(GridFileChunk) * index.size() ||
+      !preadAll(file.fd, &index[0], sizeof(GridFileChunk) * index.size(), sizeof(header)))
+    throw std::string(filename) + " is truncated";
+
+  for(int i = 0; i < header.total_chunks; ++i) {
+    if(index[i].offset > size || index[i].size > size - index[i].offset)
+      throw std::string(filename) + " is truncated";
+  }
+
+  BrickLayout layout;
+  size_t page = sysconf(_SC_PAGESIZE);
+  size_t brick_size = sizeof(T) * GRID_CHUNK_SIZE * GRID_CHUNK_SIZE * GRID_CHUNK_SIZE;
+
+  layout.init(header.x_size, header.y_size, header.z_size);
+
+  size_t map_size = ((size_t)layout.size() * sizeof(T) + page - 1) / page * page;
+  void* voxels = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+  if(voxels == MAP_FAILED)
+    throw "Failed to map " + std::string(filename);
+
+  Grid3D<T, BrickLayout>* g = new Grid3D<T, BrickLayout>(header.x_size, header.y_size, header.z_size,
+                                                         header.grid_dx, header.grid_dy, header.grid_dz,
+                                                         (T*)voxels, [map_size](T* v) { munmap(v, map_size); });
+  ChunkGrid chunks(header.x_size, header.y_size, header.z_size);
+  std::vector<int> decoded;
+
+  try {
+    // Chunk i of the file is brick i of the grid
+    for(int i = 0; i < chunks.total(); ++i) {
+      bool mappable = index[i].codec == CHUNK_RAW && index[i].size == brick_size &&
+        brick_size % page == 0 && index[i].offset % page == 0;
+
+      if(!mappable || !mapOver((uint8_t*)voxels + brick_size * i, brick_size, file.fd, index[i].offset))
+        decoded.push_back(i);
+    }
+
+    parallelFor(decoded.size(), [&](int i) {
+      int chunk = decoded[i];
+      std::vector<uint8_t> payload(index[chunk].size);
+      std::vector<T> values(chunks.volume(chunk));
+
+      if(payload.size() != 0 && !preadAll(file.fd, &payload[0], payload.size(), index[chunk].offset))
+        throw "Failed to read the chunk";
+
+      if(checksumBytes(payload.data(), payload.size()) != index[chunk].checksum)
+        throw "Chunk checksum mismatch";
+
+      decodeChunk(index[chunk].codec, payload.data(), payload.size(), values.size(), &values[0]);
+      writeChunk(*g, chunks, chunk, &values[0]);
+    });
+  }
+  catch(const char* s) {
+    delete g;
+    throw std::string(filename) + ": " + s;
+  }
+  catch(std::string s) {
+    delete g;
+    throw std::string(filename) + ": " + s;
+  }
+
+  return g;
+}
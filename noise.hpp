@@ -0,0 +1,433 @@
+#pragma once
+
+#include <cstring>
+#include <stdint.h>
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#define NOISE_AVX2 1
+#endif
+
+// Seeded 3D noise functions: Perlin (gradient) noise, simplex noise, value
+// noise and fBm (5 octaves of Perlin noise). Lattice points are hashed from
+// their coordinates and the seed instead of looked up in a permutation
+// table, so there is no table to build and any seed works.
+//
+// Every function is written once as a template and used both with float
+// and with NoiseFloat8 (8 floats using GCC's vector extensions). The lanes
+// go through exactly the same operations, so evaluating 8 voxels at once
+// gives bit for bit the same values as evaluating them one by one. Nothing
+// here may use std::floor or other library calls that could round
+// differently from the vector code.
+//
+// Lattice coordinates are clamped to +-NOISE_MAX_COORD (see noiseFloor()),
+// so any float including infinities and NaN is safe to pass in, but noise
+// far outside that range is meaningless.
+
+// Vectors never go in or out of a function by value, since GCC warns that
+// passing and returning 32 byte vectors changed ABI (even for functions
+// that are always inlined). Results are written to out instead.
+
+// A compiler allowed to fuse a * b + c into a multiply-add could do it in
+// one version and not the other, which rounds differently, so contraction
+// is turned off for the noise code (the build also passes
+// -ffp-contract=off).
+#pragma GCC push_options
+#pragma GCC optimize("fp-contract=off")
+
+typedef float NoiseFloat8 __attribute__((vector_size(32)));
+typedef int32_t NoiseInt8 __attribute__((vector_size(32)));
+typedef uint32_t NoiseUint8 __attribute__((vector_size(32)));
+
+// Always inlined so the AVX2 version of noise8() gets AVX2 code for all of it
+#define NOISE_INLINE inline __attribute__((always_inline))
+
+enum NoiseType {
+  NOISE_PERLIN,
+  NOISE_SIMPLEX,
+  NOISE_VALUE,
+  NOISE_FBM
+};
+
+template<typename F> struct NoiseLanes;
+
+template<> struct NoiseLanes<float> {
+  typedef int32_t I;
+  typedef uint32_t U;
+};
+
+template<> struct NoiseLanes<NoiseFloat8> {
+  typedef NoiseInt8 I;
+  typedef NoiseUint8 U;
+};
+
+NOISE_INLINE void noiseToInt(const float& f, int32_t& out) { out = (int32_t)f; }
+NOISE_INLINE void noiseToInt(const NoiseFloat8& f, NoiseInt8& out) { out = __builtin_convertvector(f, NoiseInt8); }
+NOISE_INLINE void noiseToFloat(const int32_t& i, float& out) { out = (float)i; }
+NOISE_INLINE void noiseToFloat(const NoiseInt8& i, NoiseFloat8& out) { out = __builtin_convertvector(i, NoiseFloat8); }
+
+// Reinterprets signed lanes as unsigned or the other way around
+template<typename A, typename B>
+NOISE_INLINE void noiseCast(const A& a, B& out) {
+  out = (B)a;
+}
+
+// Beyond this every float is a whole number anyway
+const float NOISE_MAX_COORD = 16777216.0f;
+
+// Converting a float outside the range of an int is undefined for scalars
+// but gives INT_MIN for vectors, so x is clamped first to keep the lanes
+// the same. NaN fails the first comparison and becomes NOISE_MAX_COORD.
+template<typename F>
+NOISE_INLINE void noiseFloor(const F& x, F& out) {
+  typename NoiseLanes<F>::I i;
+  F low = F() - NOISE_MAX_COORD;
+  F high = F() + NOISE_MAX_COORD;
+  F c = x <= high ? x : high;
+  F t;
+
+  c = c >= low ? c : low;
+  noiseToInt(c, i);
+  noiseToFloat(i, t);
+  out = t > c ? t - 1.0f : t;
+}
+
+template<typename F>
+NOISE_INLINE void noiseFade(const F& t, F& out) {
+  out = t * t * t * (t * (t * 6.0f - 15.0f) + 10.0f);
+}
+
+template<typename F>
+NOISE_INLINE void noiseLerp(const F& t, const F& a, const F& b, F& out) {
+  out = a + t * (b - a);
+}
+
+// Multipliers of the lattice coordinates in noiseHash()
+const uint32_t NOISE_HASH_X = 0x8da6b343u;
+const uint32_t NOISE_HASH_Y = 0xd8163841u;
+const uint32_t NOISE_HASH_Z = 0xcb1ab31fu;
+
+template<typename U>
+NOISE_INLINE void noiseMix(U& h) {
+  h ^= h >> 16;
+  h *= 0x7feb352du;
+  h ^= h >> 15;
+  h *= 0x846ca68bu;
+  h ^= h >> 16;
+}
+
+template<typename I, typename U>
+NOISE_INLINE void noiseHash(const I& x, const I& y, const I& z, uint32_t seed, U& out) {
+  U ux, uy, uz;
+
+  noiseCast(x, ux);
+  noiseCast(y, uy);
+  noiseCast(z, uz);
+
+  out = (ux * NOISE_HASH_X) ^ (uy * NOISE_HASH_Y) ^ (uz * NOISE_HASH_Z) ^ (seed * 0x9e3779b9u);
+  noiseMix(out);
+}
+
+// Hashes of the 8 corners of the lattice cell at (x, y, z), indexed by
+// x + 2 * y + 4 * z. (x + 1) * m is x * m + m, so the coordinates are only
+// multiplied once.
+template<typename I, typename U>
+NOISE_INLINE void noiseCellHashes(const I& x, const I& y, const I& z, uint32_t seed, U* h) {
+  U hx, hy, hz;
+
+  noiseCast(x, hx);
+  noiseCast(y, hy);
+  noiseCast(z, hz);
+
+  hx *= NOISE_HASH_X;
+  hy *= NOISE_HASH_Y;
+  hz *= NOISE_HASH_Z;
+
+  uint32_t hs = seed * 0x9e3779b9u;
+
+  U hx1 = hx + NOISE_HASH_X;
+  U hy1 = hy + NOISE_HASH_Y;
+  U hz0 = hz ^ hs;
+  U hz1 = (hz + NOISE_HASH_Z) ^ hs;
+
+  h[0] = hx ^ hy ^ hz0;
+  h[1] = hx1 ^ hy ^ hz0;
+  h[2] = hx ^ hy1 ^ hz0;
+  h[3] = hx1 ^ hy1 ^ hz0;
+  h[4] = hx ^ hy ^ hz1;
+  h[5] = hx1 ^ hy ^ hz1;
+  h[6] = hx ^ hy1 ^ hz1;
+  h[7] = hx1 ^ hy1 ^ hz1;
+
+  for(int i = 0; i < 8; ++i)
+    noiseMix(h[i]);
+}
+
+// Dot product with one of the 12 edge gradients of a cube (as in Perlin's
+// improved noise)
+template<typename F, typename U>
+NOISE_INLINE void noiseGrad(const U& h, const F& x, const F& y, const F& z, F& out) {
+  U g = h & 15u;
+  F u = g < 8u ? x : y;
+  F v = g < 4u ? y : ((g == 12u) | (g == 14u)) ? x : z;
+
+  out = ((g & 1u) != 0u ? -u : u) + ((g & 2u) != 0u ? -v : v);
+}
+
+// Trilinear interpolation of the values at the 8 corners of a cell, indexed
+// like the hashes of noiseCellHashes()
+template<typename F>
+NOISE_INLINE void noiseTrilerp(const F& u, const F& v, const F& w, const F* c, F& out) {
+  F x00, x10, x01, x11, y0, y1;
+
+  noiseLerp(u, c[0], c[1], x00);
+  noiseLerp(u, c[2], c[3], x10);
+  noiseLerp(u, c[4], c[5], x01);
+  noiseLerp(u, c[6], c[7], x11);
+  noiseLerp(v, x00, x10, y0);
+  noiseLerp(v, x01, x11, y1);
+  noiseLerp(w, y0, y1, out);
+}
+
+template<typename F>
+NOISE_INLINE void perlinNoise(const F& px, const F& py, const F& pz, uint32_t seed, F& out) {
+  typedef typename NoiseLanes<F>::I I;
+
+  F fx, fy, fz;
+  I ix, iy, iz;
+
+  noiseFloor(px, fx);
+  noiseFloor(py, fy);
+  noiseFloor(pz, fz);
+  noiseToInt(fx, ix);
+  noiseToInt(fy, iy);
+  noiseToInt(fz, iz);
+
+  F x = px - fx;
+  F y = py - fy;
+  F z = pz - fz;
+  F u, v, w;
+
+  noiseFade(x, u);
+  noiseFade(y, v);
+  noiseFade(z, w);
+
+  typename NoiseLanes<F>::U h[8];
+  F g[8];
+
+  noiseCellHashes(ix, iy, iz, seed, h);
+
+  noiseGrad(h[0], x, y, z, g[0]);
+  noiseGrad(h[1], x - 1.0f, y, z, g[1]);
+  noiseGrad(h[2], x, y - 1.0f, z, g[2]);
+  noiseGrad(h[3], x - 1.0f, y - 1.0f, z, g[3]);
+  noiseGrad(h[4], x, y, z - 1.0f, g[4]);
+  noiseGrad(h[5], x - 1.0f, y, z - 1.0f, g[5]);
+  noiseGrad(h[6], x, y - 1.0f, z - 1.0f, g[6]);
+  noiseGrad(h[7], x - 1.0f, y - 1.0f, z - 1.0f, g[7]);
+
+  noiseTrilerp(u, v, w, g, out);
+}
+
+// Random value in [-1, 1] for a lattice point
+template<typename U, typename F>
+NOISE_INLINE void noiseLatticeValue(const U& h, F& out) {
+  typename NoiseLanes<F>::I i;
+
+  noiseCast(h >> 8, i);
+  noiseToFloat(i, out);
+  out = out * (2.0f / 16777215.0f) - 1.0f;
+}
+
+template<typename F>
+NOISE_INLINE void valueNoise(const F& x, const F& y, const F& z, uint32_t seed, F& out) {
+  typedef typename NoiseLanes<F>::I I;
+
+  F fx, fy, fz;
+  I ix, iy, iz;
+
+  noiseFloor(x, fx);
+  noiseFloor(y, fy);
+  noiseFloor(z, fz);
+  noiseToInt(fx, ix);
+  noiseToInt(fy, iy);
+  noiseToInt(fz, iz);
+
+  F u, v, w;
+
+  noiseFade(x - fx, u);
+  noiseFade(y - fy, v);
+  noiseFade(z - fz, w);
+
+  typename NoiseLanes<F>::U h[8];
+  F values[8];
+
+  noiseCellHashes(ix, iy, iz, seed, h);
+
+  for(int i = 0; i < 8; ++i)
+    noiseLatticeValue(h[i], values[i]);
+
+  noiseTrilerp(u, v, w, values, out);
+}
+
+template<typename F, typename U>
+NOISE_INLINE void simplexCorner(const U& h, const F& x, const F& y, const F& z, F& out) {
+  F t = 0.6f - x * x - y * y - z * z;
+  F t2 = t * t;
+  F g;
+
+  noiseGrad(h, x, y, z, g);
+  out = t < 0.0f ? F() : t2 * t2 * g;
+}
+
+template<typename F>
+NOISE_INLINE void simplexNoise(const F& x, const F& y, const F& z, uint32_t seed, F& out) {
+  typedef typename NoiseLanes<F>::I I;
+  typedef typename NoiseLanes<F>::U U;
+
+  const float F3 = 1.0f / 3.0f;
+  const float G3 = 1.0f / 6.0f;
+
+  // Skew to find the simplex cell, then unskew its origin
+  F s = (x + y + z) * F3;
+  F fi, fj, fk;
+
+  noiseFloor(x + s, fi);
+  noiseFloor(y + s, fj);
+  noiseFloor(z + s, fk);
+
+  F t = (fi + fj + fk) * G3;
+  F x0 = x - (fi - t);
+  F y0 = y - (fj - t);
+  F z0 = z - (fk - t);
+  I i, j, k;
+
+  noiseToInt(fi, i);
+  noiseToInt(fj, j);
+  noiseToInt(fk, k);
+
+  // Offsets of the second and third corners, from the order of x0, y0 and
+  // z0. Masks are 1 or -1 for true, so & 1 turns them into 0 or 1.
+  auto xy = x0 >= y0;
+  auto yz = y0 >= z0;
+  auto xz = x0 >= z0;
+  auto yx = x0 < y0;
+  auto zy = y0 < z0;
+  auto zx = x0 < z0;
+
+  I i1 = (xy & xz) & 1;
+  I j1 = (yx & yz) & 1;
+  I k1 = (zx & zy) & 1;
+  I i2 = (xy | xz) & 1;
+  I j2 = (yx | yz) & 1;
+  I k2 = (zx | zy) & 1;
+  F fi1, fj1, fk1, fi2, fj2, fk2;
+
+  noiseToFloat(i1, fi1);
+  noiseToFloat(j1, fj1);
+  noiseToFloat(k1, fk1);
+  noiseToFloat(i2, fi2);
+  noiseToFloat(j2, fj2);
+  noiseToFloat(k2, fk2);
+
+  F x1 = x0 - fi1 + G3;
+  F y1 = y0 - fj1 + G3;
+  F z1 = z0 - fk1 + G3;
+  F x2 = x0 - fi2 + 2.0f * G3;
+  F y2 = y0 - fj2 + 2.0f * G3;
+  F z2 = z0 - fk2 + 2.0f * G3;
+  F x3 = x0 - 1.0f + 3.0f * G3;
+  F y3 = y0 - 1.0f + 3.0f * G3;
+  F z3 = z0 - 1.0f + 3.0f * G3;
+
+  U h[4];
+  F n[4];
+
+  noiseHash(i, j, k, seed, h[0]);
+  noiseHash(i + i1, j + j1, k + k1, seed, h[1]);
+  noiseHash(i + i2, j + j2, k + k2, seed, h[2]);
+  noiseHash(i + 1, j + 1, k + 1, seed, h[3]);
+
+  simplexCorner(h[0], x0, y0, z0, n[0]);
+  simplexCorner(h[1], x1, y1, z1, n[1]);
+  simplexCorner(h[2], x2, y2, z2, n[2]);
+  simplexCorner(h[3], x3, y3, z3, n[3]);
+
+  out = 32.0f * (n[0] + n[1] + n[2] + n[3]);
+}
+
+template<typename F>
+NOISE_INLINE void fbmNoise(const F& px, const F& py, const F& pz, uint32_t seed, F& out) {
+  F x = px;
+  F y = py;
+  F z = pz;
+  float amplitude = 0.5f;
+
+  out = F();
+
+  for(int octave = 0; octave < 5; ++octave) {
+    F octave_noise;
+
+    perlinNoise(x, y, z, seed + octave, octave_noise);
+    out = out + amplitude * octave_noise;
+    x = x * 2.0f;
+    y = y * 2.0f;
+    z = z * 2.0f;
+    amplitude *= 0.5f;
+  }
+}
+
+template<typename F>
+NOISE_INLINE void noise(int type, const F& x, const F& y, const F& z, uint32_t seed, F& out) {
+  switch(type) {
+    case NOISE_PERLIN: perlinNoise(x, y, z, seed, out); return;
+    case NOISE_SIMPLEX: simplexNoise(x, y, z, seed, out); return;
+    case NOISE_VALUE: valueNoise(x, y, z, seed, out); return;
+  }
+
+  fbmNoise(x, y, z, seed, out);
+}
+
+// Noise of one point
+inline float noise(int type, float x, float y, float z, uint32_t seed) {
+  float out;
+
+  noise(type, x, y, z, seed, out);
+
+  return out;
+}
+
+// Evaluates noise for 8 lanes: out[i] = noise(x[i], y[i], z[i])
+typedef void (*Noise8Function)(int type, const float* x, const float* y, const float* z, float* out, uint32_t seed);
+
+inline void noise8Generic(int type, const float* x, const float* y, const float* z, float* out, uint32_t seed) {
+  for(int i = 0; i < 8; ++i)
+    noise(type, x[i], y[i], z[i], seed, out[i]);
+}
+
+#ifdef NOISE_AVX2
+__attribute__((target("avx2")))
+inline void noise8Avx2(int type, const float* x, const float* y, const float* z, float* out, uint32_t seed) {
+  NoiseFloat8 vx, vy, vz, v;
+
+  memcpy(&vx, x, sizeof(vx));
+  memcpy(&vy, y, sizeof(vy));
+  memcpy(&vz, z, sizeof(vz));
+
+  noise(type, vx, vy, vz, seed, v);
+
+  memcpy(out, &v, sizeof(v));
+}
+#endif
+
+#pragma GCC pop_options
+
+// The fastest version of noise8 the CPU supports
+inline Noise8Function noise8Function() {
+#ifdef NOISE_AVX2
+  static Noise8Function f = __builtin_cpu_supports("avx2") ? noise8Avx2 : noise8Generic;
+
+  return f;
+#else
+  return noise8Generic;
+#endif
+}
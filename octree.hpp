@@ -0,0 +1,230 @@
+#pragma once
+
+#include <vector>
+#include <algorithm>
+
+#include "grid.hpp"
+
+// Sparse voxel octree over a power of two cube that contains the grid. A node
+// is either a leaf holding one value for its whole cube, or has 8 children
+// stored next to each other in the node pool. Subtrees whose voxels all have
+// the same value are always collapsed into a single leaf, so mostly empty (or
+// mostly solid) grids only pay for the detail near their surfaces.
+//
+// Child i of a node covers the octant with x offset (i & 1), y offset
+// ((i >> 1) & 1) and z offset (i >> 2).
+template<typename T>
+class SparseVoxelOctree {
+public:
+  struct Node {
+    int children;   // Index of the first child, or -1 for a leaf
+    T value;
+  };
+
+  std::vector<Node> nodes;
+  std::vector<int> free_blocks;
+  int x_size, y_size, z_size;
+  int size;
+  int depth;
+  T default_value;
+
+  // Voxels outside of the grid (but inside the root cube) hold default_value
+  SparseVoxelOctree(int xx, int yy, int zz, T default_val) {
+    x_size = xx;
+    y_size = yy;
+    z_size = zz;
+    default_value = default_val;
+
+    size = 1;
+    depth = 0;
+
+    while(size < std::max(xx, std::max(yy, zz))) {
+      size *= 2;
+      ++depth;
+    }
+
+    clear();
+  }
+
+  void clear() {
+    Node root = { -1, default_value };
+
+    nodes.clear();
+    free_blocks.clear();
+    nodes.push_back(root);
+  }
+
+  bool validPos(int x, int y, int z) const {
+    return x >= 0 && x < x_size && y >= 0 && y < y_size && z >= 0 && z < z_size;
+  }
+
+  static int childIndex(int x, int y, int z, int half) {
+    return ((x & half) != 0) | (((y & half) != 0) << 1) | (((z & half) != 0) << 2);
+  }
+
+  T get(int x, int y, int z) const {
+    int cx, cy, cz, s;
+
+    return leaf(x, y, z, cx, cy, cz, s);
+  }
+
+  // Returns the value of the leaf holding voxel (x, y, z), and sets (cx, cy,
+  // cz) to the corner of its cube and s to its edge
+  T leaf(int x, int y, int z, int& cx, int& cy, int& cz, int& s) const {
+    int node = 0;
+
+    cx = cy = cz = 0;
+    s = size;
+
+    while(nodes[node].children != -1) {
+      s >>= 1;
+
+      int i = childIndex(x, y, z, s);
+
+      node = nodes[node].children + i;
+      cx += (i & 1) * s;
+      cy += ((i >> 1) & 1) * s;
+      cz += (i >> 2) * s;
+    }
+
+    return nodes[node].value;
+  }
+
+  // Makes a leaf node have 8 leaf children with its value
+  void split(int node) {
+    int block;
+
+    if(free_blocks.size() != 0) {
+      block = free_blocks.back();
+      free_blocks.pop_back();
+    }
+    else {
+      block = nodes.size();
+      nodes.resize(nodes.size() + 8);
+    }
+
+    for(int i = 0; i < 8; ++i) {
+      nodes[block + i].children = -1;
+      nodes[block + i].value = nodes[node].value;
+    }
+
+    nodes[node].children = block;
+  }
+
+  // Turns node into a leaf if its children are leaves with the same value
+  bool tryCollapse(int node) {
+    int block = nodes[node].children;
+
+    for(int i = 0; i < 8; ++i) {
+      if(nodes[block + i].children != -1 || !(nodes[block + i].value == nodes[block].value))
+        return false;
+    }
+
+    nodes[node].children = -1;
+    nodes[node].value = nodes[block].value;
+    free_blocks.push_back(block);
+
+    return true;
+  }
+
+  // Returns the blocks below node to the pool, leaving node a leaf
+  void release(int node) {
+    int block = nodes[node].children;
+
+    if(block == -1)
+      return;
+
+    for(int i = 0; i < 8; ++i)
+      release(block + i);
+
+    free_blocks.push_back(block);
+    nodes[node].children = -1;
+  }
+
+  // Builds the tree from eval(x, y, z), which is called once per voxel of the
+  // grid. Subtrees are collapsed as soon as they are complete, so memory use
+  // never exceeds that of the final tree by more than one path of siblings.
+  template<typename F>
+  void generate(F eval) {
+    clear();
+    buildNode(0, 0, 0, 0, size, eval);
+  }
+
+  // Builds the cube of edge s (a power of two, at most size) at (x, y, z),
+  // which must be a multiple of s, again from eval(x, y, z), leaving the rest
+  // of the tree as it is
+  template<typename F>
+  void generateRegion(int x, int y, int z, int s, F eval) {
+    int path[32];
+    int d = 0;
+    int node = 0;
+
+    for(int cs = size; cs > s; cs >>= 1) {
+      if(nodes[node].children == -1)
+        split(node);
+
+      path[d++] = node;
+      node = nodes[node].children + childIndex(x, y, z, cs >> 1);
+    }
+
+    release(node);
+    buildNode(node, x, y, z, s, eval);
+
+    // Collapse the parents that became uniform
+    while(d > 0 && tryCollapse(path[d - 1]))
+      --d;
+  }
+
+  template<typename F>
+  void buildNode(int node, int x, int y, int z, int s, F& eval) {
+    if(s == 1) {
+      nodes[node].value = validPos(x, y, z) ? eval(x, y, z) : default_value;
+      return;
+    }
+
+    // Cubes entirely outside the grid are uniform
+    if(x >= x_size || y >= y_size || z >= z_size) {
+      nodes[node].value = default_value;
+      return;
+    }
+
+    split(node);
+
+    int half = s / 2;
+
+    for(int i = 0; i < 8; ++i) {
+      int block = nodes[node].children;
+
+      buildNode(block + i, x + (i & 1) * half, y + ((i >> 1) & 1) * half, z + (i >> 2) * half, half, eval);
+    }
+
+    tryCollapse(node);
+  }
+
+  // Returns whether any voxel in [x1, x2) x [y1, y2) x [z1, z2) isn't empty.
+  // Empty subtrees are skipped, which makes this suitable for collision tests.
+  bool anySolid(int x1, int y1, int z1, int x2, int y2, int z2, T empty) const {
+    return anySolid(0, 0, 0, 0, size, x1, y1, z1, x2, y2, z2, empty);
+  }
+
+  bool anySolid(int node, int x, int y, int z, int s, int x1, int y1, int z1, int x2, int y2, int z2, const T& empty) const {
+    if(x >= x2 || y >= y2 || z >= z2 || x + s <= x1 || y + s <= y1 || z + s <= z1)
+      return false;
+
+    if(nodes[node].children == -1)
+      return !(nodes[node].value == empty);
+
+    int half = s / 2;
+
+    for(int i = 0; i < 8; ++i) {
+      if(anySolid(nodes[node].children + i, x + (i & 1) * half, y + ((i >> 1) & 1) * half, z + (i >> 2) * half, half, x1, y1, z1, x2, y2, z2, empty))
+        return true;
+    }
+
+    return false;
+  }
+
+  size_t memoryUsage() const {
+    return sizeof(*this) + nodes.capacity() * sizeof(Node) + free_blocks.capacity() * sizeof(int);
+  }
+};
@@ -0,0 +1,407 @@
+#pragma once
+
+#include <vector>
+#include <map>
+#include <climits>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <algorithm>
+
+#include "grid.hpp"
+#include "palette.hpp"
+
+struct ChunkKey {
+  int x, y, z;
+
+  bool operator<(const ChunkKey& k) const {
+    if(x != k.x) return x < k.x;
+    if(y != k.y) return y < k.y;
+
+    return z < k.z;
+  }
+
+  bool operator==(const ChunkKey& k) const {
+    return x == k.x && y == k.y && z == k.z;
+  }
+};
+
+enum {
+  PAGE_QUEUED,      // Waiting for a worker
+  PAGE_LOADING,     // A worker is filling it in
+  PAGE_READY,       // Voxels and mesh are done, waiting to be picked up
+  PAGE_RESIDENT     // Picked up by the renderer
+};
+
+template<typename T>
+struct PagedChunk {
+  ChunkKey key;
+  PaletteChunk<T> voxels;       // GRID_CHUNK_SIZE^3 voxels, x fastest, read by get()
+  std::vector<Triangle> mesh;   // In world coordinates, freed by releaseMesh()
+  int state;
+  int gpu_triangles;            // Triangles kept by the renderer
+  float priority;
+
+  size_t memoryUsage() {
+    return sizeof(*this) - sizeof(voxels) + voxels.memoryUsage() + mesh.capacity() * sizeof(Triangle) +
+      gpu_triangles * 3 * 7 * sizeof(float);
+  }
+};
+
+// Keeps the chunks of an unbounded (or bounded, see setBounds()) world that
+// are near the camera in memory. Every frame, update() requests the chunks
+// within radius chunks of the camera, plus the chunks around a point ahead of
+// the camera (so chunks are ready before they come into view). Requested
+// chunks are filled in and meshed by background worker threads, closest
+// first. Chunks outside the radius are evicted, farthest first, whenever the
+// memory used goes over the budget.
+//
+// Chunks are filled in by calling source(x, y, z, w, h, d, out), which must
+// write the values of the w * h * d voxels starting at world voxel (x, y, z)
+// into out (x fastest), and may be called from several threads at once. The
+// box includes a one voxel border around the chunk so faces can be culled
+// against neighboring chunks without waiting for them to load.
+template<typename T>
+class WorldPager {
+public:
+  typedef std::function<void(int x, int y, int z, int w, int h, int d, T* out)> ChunkSource;
+
+  ChunkSource source;
+  T empty;
+  float grid_dx, grid_dy, grid_dz;
+  int radius;
+  float prefetch_distance;
+  size_t memory_budget;
+
+  glm::ivec3 bounds_min, bounds_max;
+
+  std::map<ChunkKey, PagedChunk<T>*> chunks;
+  std::vector<PagedChunk<T>*> queue;    // Sorted so the next job is at the back
+  std::vector<ChunkKey> ready;
+  std::vector<ChunkKey> evicted;
+
+  std::mutex mutex;
+  std::condition_variable work_available;
+  std::vector<std::thread> workers;
+  bool stop;
+
+  WorldPager(ChunkSource src, T empty_value, float dx, float dy, float dz, int radius_chunks, float prefetch, size_t budget, int total_workers = 0) {
+    source = src;
+    empty = empty_value;
+
+    grid_dx = dx;
+    grid_dy = dy;
+    grid_dz = dz;
+
+    radius = radius_chunks;
+    prefetch_distance = prefetch;
+    memory_budget = budget;
+
+    bounds_min = glm::ivec3(INT_MIN / 2);
+    bounds_max = glm::ivec3(INT_MAX / 2);
+
+    stop = false;
+
+    if(total_workers <= 0)
+      total_workers = std::max(1, (int)std::thread::hardware_concurrency() - 1);
+
+    for(int i = 0; i < total_workers; ++i)
+      workers.push_back(std::thread(&WorldPager::workerLoop, this));
+  }
+
+  ~WorldPager() {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      stop = true;
+    }
+
+    work_available.notify_all();
+
+    for(int i = 0; i < (int)workers.size(); ++i)
+      workers[i].join();
+
+    for(typename std::map<ChunkKey, PagedChunk<T>*>::iterator i = chunks.begin(); i != chunks.end(); ++i)
+      delete i->second;
+  }
+
+  // Limits the world to chunks [lo, hi) (in chunk coordinates)
+  void setBounds(glm::ivec3 lo, glm::ivec3 hi) {
+    bounds_min = lo;
+    bounds_max = hi;
+  }
+
+  glm::vec3 chunkSize() {
+    return glm::vec3(grid_dx, grid_dy, grid_dz) * (float)GRID_CHUNK_SIZE;
+  }
+
+  ChunkKey keyAt(glm::vec3 pos) {
+    glm::vec3 c = pos / chunkSize();
+    ChunkKey k = { (int)floor(c.x), (int)floor(c.y), (int)floor(c.z) };
+
+    return k;
+  }
+
+  glm::vec3 chunkCenter(ChunkKey k) {
+    return (glm::vec3(k.x, k.y, k.z) + glm::vec3(.5f)) * chunkSize();
+  }
+
+  bool inBounds(ChunkKey k) {
+    return k.x >= bounds_min.x && k.y >= bounds_min.y && k.z >= bounds_min.z &&
+      k.x < bounds_max.x && k.y < bounds_max.y && k.z < bounds_max.z;
+  }
+
+  // Called once per frame from the main thread with the camera position and
+  // direction in world coordinates
+  void update(glm::vec3 eye, glm::vec3 dir) {
+    std::lock_guard<std::mutex> lock(mutex);
+    std::map<ChunkKey, float> wanted;
+    glm::vec3 ahead = eye + dir * prefetch_distance;
+
+    request(eye, eye, 0, wanted);
+
+    // Prefetched chunks go after the ones around the camera
+    request(ahead, eye, radius * glm::length(chunkSize()), wanted);
+
+    // Queued chunks that are no longer wanted are dropped
+    for(int i = 0; i < (int)queue.size(); ++i) {
+      if(!wanted.count(queue[i]->key)) {
+        chunks.erase(queue[i]->key);
+        delete queue[i];
+        queue[i] = NULL;
+      }
+    }
+
+    queue.erase(std::remove(queue.begin(), queue.end(), (PagedChunk<T>*)NULL), queue.end());
+
+    for(typename std::map<ChunkKey, float>::iterator i = wanted.begin(); i != wanted.end(); ++i) {
+      typename std::map<ChunkKey, PagedChunk<T>*>::iterator c = chunks.find(i->first);
+
+      if(c == chunks.end()) {
+        PagedChunk<T>* chunk = new PagedChunk<T>;
+
+        chunk->key = i->first;
+        chunk->state = PAGE_QUEUED;
+        chunk->gpu_triangles = 0;
+        chunk->priority = i->second;
+
+        chunks[i->first] = chunk;
+        queue.push_back(chunk);
+      }
+      else if(c->second->state == PAGE_QUEUED) {
+        c->second->priority = i->second;
+      }
+    }
+
+    std::sort(queue.begin(), queue.end(), comparePriority);
+
+    evict(eye);
+
+    if(queue.size() != 0)
+      work_available.notify_all();
+  }
+
+  // Adds the chunks within radius of center to wanted, prioritized by their
+  // distance from eye plus penalty
+  void request(glm::vec3 center, glm::vec3 eye, float penalty, std::map<ChunkKey, float>& wanted) {
+    ChunkKey c = keyAt(center);
+
+    for(int z = -radius; z <= radius; ++z) {
+      for(int y = -radius; y <= radius; ++y) {
+        for(int x = -radius; x <= radius; ++x) {
+          if(x * x + y * y + z * z > radius * radius)
+            continue;
+
+          ChunkKey k = { c.x + x, c.y + y, c.z + z };
+
+          if(!inBounds(k))
+            continue;
+
+          float priority = glm::length(chunkCenter(k) - eye) + penalty;
+
+          if(!wanted.count(k) || wanted[k] > priority)
+            wanted[k] = priority;
+        }
+      }
+    }
+  }
+
+  static bool comparePriority(PagedChunk<T>* a, PagedChunk<T>* b) {
+    return a->priority > b->priority;
+  }
+
+  bool inRadius(ChunkKey k, glm::vec3 eye) {
+    ChunkKey c = keyAt(eye);
+    int x = k.x - c.x;
+    int y = k.y - c.y;
+    int z = k.z - c.z;
+
+    return x * x + y * y + z * z <= radius * radius;
+  }
+
+  // Evicts loaded chunks outside the radius, farthest first, until the memory
+  // used is within the budget. Must be called with the mutex held.
+  void evict(glm::vec3 eye) {
+    size_t total = 0;
+    std::vector<std::pair<float, PagedChunk<T>*> > candidates;
+
+    for(typename std::map<ChunkKey, PagedChunk<T>*>::iterator i = chunks.begin(); i != chunks.end(); ++i) {
+      PagedChunk<T>* c = i->second;
+
+      if(c->state == PAGE_QUEUED || c->state == PAGE_LOADING)
+        continue;
+
+      total += c->memoryUsage();
+
+      if(!inRadius(c->key, eye))
+        candidates.push_back(std::make_pair(glm::length(chunkCenter(c->key) - eye), c));
+    }
+
+    std::sort(candidates.begin(), candidates.end());
+
+    while(total > memory_budget && candidates.size() != 0) {
+      PagedChunk<T>* c = candidates.back().second;
+
+      candidates.pop_back();
+      total -= c->memoryUsage();
+
+      if(c->state == PAGE_READY)
+        ready.erase(std::remove(ready.begin(), ready.end(), c->key), ready.end());
+      else
+        evicted.push_back(c->key);
+
+      chunks.erase(c->key);
+      delete c;
+    }
+  }
+
+  void workerLoop() {
+    while(true) {
+      PagedChunk<T>* chunk;
+
+      {
+        std::unique_lock<std::mutex> lock(mutex);
+
+        while(!stop && queue.size() == 0)
+          work_available.wait(lock);
+
+        if(stop)
+          return;
+
+        chunk = queue.back();
+        queue.pop_back();
+        chunk->state = PAGE_LOADING;
+      }
+
+      // The chunk can't be evicted or dropped while it's loading, so it's
+      // safe to fill in without holding the mutex
+      loadChunk(chunk);
+
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+
+        chunk->state = PAGE_READY;
+        ready.push_back(chunk->key);
+      }
+    }
+  }
+
+  void loadChunk(PagedChunk<T>* chunk) {
+    const int size = GRID_CHUNK_SIZE + 2;
+    Grid3D<T> g(size, size, size, grid_dx, grid_dy, grid_dz, empty);
+    ChunkKey k = chunk->key;
+
+    source(k.x * GRID_CHUNK_SIZE - 1, k.y * GRID_CHUNK_SIZE - 1, k.z * GRID_CHUNK_SIZE - 1, size, size, size, g.data);
+
+    // Kept palette compressed, so a chunk of a few materials costs a few bits
+    // per voxel (and a chunk of one value almost nothing) while it's resident.
+    // This is the only copy get() reads; g is gone once the mesh is built.
+    chunk->voxels = PaletteChunk<T>(empty);
+
+    for(int z = 1, i = 0; z <= GRID_CHUNK_SIZE; ++z) {
+      for(int y = 1; y <= GRID_CHUNK_SIZE; ++y) {
+        for(int x = 1; x <= GRID_CHUNK_SIZE; ++x, ++i) {
+          chunk->voxels.set(i, g.get(x, y, z));
+        }
+      }
+    }
+
+    chunk->voxels.compact();
+
+    g.triangulateRegion(1, 1, 1, size - 1, size - 1, size - 1, empty, false, chunk->mesh);
+
+    // Move the mesh from the coordinates of g to world coordinates
+    glm::vec3 offset = glm::vec3(k.x, k.y, k.z) * chunkSize() - glm::vec3(grid_dx, grid_dy, grid_dz);
+
+    for(int i = 0; i < (int)chunk->mesh.size(); ++i) {
+      for(int d = 0; d < 3; ++d)
+        chunk->mesh[i].v[d] += offset;
+    }
+  }
+
+  // Returns the chunks that finished loading since the last call. The
+  // renderer should upload their meshes and then call releaseMesh().
+  std::vector<ChunkKey> takeReady() {
+    std::lock_guard<std::mutex> lock(mutex);
+    std::vector<ChunkKey> r;
+
+    r.swap(ready);
+
+    for(int i = 0; i < (int)r.size(); ++i)
+      chunks[r[i]]->state = PAGE_RESIDENT;
+
+    return r;
+  }
+
+  // Returns the resident chunks that were evicted since the last call, so the
+  // renderer can free their buffers
+  std::vector<ChunkKey> takeEvicted() {
+    std::lock_guard<std::mutex> lock(mutex);
+    std::vector<ChunkKey> r;
+
+    r.swap(evicted);
+
+    return r;
+  }
+
+  // Only valid for resident chunks, and only on the main thread
+  PagedChunk<T>* find(ChunkKey k) {
+    std::lock_guard<std::mutex> lock(mutex);
+    typename std::map<ChunkKey, PagedChunk<T>*>::iterator i = chunks.find(k);
+
+    return i == chunks.end() ? NULL : i->second;
+  }
+
+  // Value of the world voxel (x, y, z), or empty if its chunk isn't resident.
+  // Only on the main thread, like find().
+  T get(int x, int y, int z) {
+    std::lock_guard<std::mutex> lock(mutex);
+    ChunkKey k = { x >> GRID_CHUNK_SHIFT, y >> GRID_CHUNK_SHIFT, z >> GRID_CHUNK_SHIFT };
+    typename std::map<ChunkKey, PagedChunk<T>*>::iterator i = chunks.find(k);
+
+    if(i == chunks.end() || i->second->state != PAGE_RESIDENT)
+      return empty;
+
+    const int mask = GRID_CHUNK_SIZE - 1;
+
+    return i->second->voxels.get((x & mask) + ((y & mask) + (z & mask) * GRID_CHUNK_SIZE) * GRID_CHUNK_SIZE);
+  }
+
+  // Drops the CPU copy of a resident chunk's mesh once it has been uploaded
+  void releaseMesh(PagedChunk<T>* chunk) {
+    std::lock_guard<std::mutex> lock(mutex);
+
+    chunk->gpu_triangles = chunk->mesh.size();
+    std::vector<Triangle>().swap(chunk->mesh);
+  }
+
+  size_t memoryUsage() {
+    std::lock_guard<std::mutex> lock(mutex);
+    size_t total = 0;
+
+    for(typename std::map<ChunkKey, PagedChunk<T>*>::iterator i = chunks.begin(); i != chunks.end(); ++i)
+      total += i->second->memoryUsage();
+
+    return total;
+  }
+};
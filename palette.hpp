@@ -0,0 +1,143 @@
+#pragma once
+
+#include <vector>
+#include <stdint.h>
+
+#include "grid.hpp"
+
+const int CHUNK_VOLUME = GRID_CHUNK_SIZE * GRID_CHUNK_SIZE * GRID_CHUNK_SIZE;
+
+// Stores the voxels of one chunk as indices into a palette of the distinct
+// values in the chunk. Indices are bit packed using 0, 1, 2, 4, 8 or 16 bits,
+// depending on the size of the palette, so they never straddle a word. A chunk
+// with a single value uses no index storage at all.
+template<typename T>
+class PaletteChunk {
+public:
+  std::vector<T> palette;
+  std::vector<uint64_t> bits;
+  int index_bits;
+
+  // Every voxel starts out as value
+  explicit PaletteChunk(T value = T()) {
+    palette.push_back(value);
+    index_bits = 0;
+  }
+
+  int getIndex(int i) {
+    if(index_bits == 0)
+      return 0;
+
+    int bit = i * index_bits;
+    uint64_t mask = ((uint64_t)1 << index_bits) - 1;
+
+    return (bits[bit >> 6] >> (bit & 63)) & mask;
+  }
+
+  void setIndex(int i, int index) {
+    int bit = i * index_bits;
+    uint64_t mask = ((uint64_t)1 << index_bits) - 1;
+    uint64_t& word = bits[bit >> 6];
+
+    word = (word & ~(mask << (bit & 63))) | ((uint64_t)index << (bit & 63));
+  }
+
+  T get(int i) {
+    return palette[getIndex(i)];
+  }
+
+  void set(int i, T value) {
+    int index = findValue(value);
+
+    if(index == -1) {
+      index = palette.size();
+      palette.push_back(value);
+
+      if(palette.size() > ((size_t)1 << index_bits))
+        repack(bitsForPalette(palette.size()));
+    }
+
+    if(index_bits != 0)
+      setIndex(i, index);
+  }
+
+  int findValue(T value) {
+    for(int i = 0; i < (int)palette.size(); ++i) {
+      if(palette[i] == value)
+        return i;
+    }
+
+    return -1;
+  }
+
+  static int bitsForPalette(int size) {
+    int b = 0;
+
+    while(((size_t)1 << b) < (size_t)size)
+      b = (b == 0 ? 1 : b * 2);
+
+    if(b > 16)
+      throw "Too many distinct values in chunk";
+
+    return b;
+  }
+
+  // Changes the width of the indices, keeping their values
+  void repack(int new_bits) {
+    std::vector<int> index(CHUNK_VOLUME);
+
+    for(int i = 0; i < CHUNK_VOLUME; ++i)
+      index[i] = getIndex(i);
+
+    index_bits = new_bits;
+    bits.assign((CHUNK_VOLUME * index_bits + 63) / 64, 0);
+
+    if(index_bits != 0) {
+      for(int i = 0; i < CHUNK_VOLUME; ++i)
+        setIndex(i, index[i]);
+    }
+  }
+
+  // Drops palette entries that are no longer referenced and shrinks the
+  // indices to match
+  void compact() {
+    std::vector<int> count(palette.size(), 0);
+    std::vector<int> remap(palette.size(), -1);
+    std::vector<T> new_palette;
+
+    for(int i = 0; i < CHUNK_VOLUME; ++i)
+      ++count[getIndex(i)];
+
+    for(int i = 0; i < (int)palette.size(); ++i) {
+      if(count[i] != 0) {
+        remap[i] = new_palette.size();
+        new_palette.push_back(palette[i]);
+      }
+    }
+
+    if(new_palette.size() == palette.size())
+      return;
+
+    std::vector<int> index(CHUNK_VOLUME);
+
+    for(int i = 0; i < CHUNK_VOLUME; ++i)
+      index[i] = remap[getIndex(i)];
+
+    palette = new_palette;
+    index_bits = bitsForPalette(palette.size());
+    bits.assign((CHUNK_VOLUME * index_bits + 63) / 64, 0);
+
+    if(index_bits != 0) {
+      for(int i = 0; i < CHUNK_VOLUME; ++i)
+        setIndex(i, index[i]);
+    }
+  }
+
+  bool isUniform() {
+    return palette.size() == 1;
+  }
+
+  size_t memoryUsage() {
+    return sizeof(*this) + palette.capacity() * sizeof(T) + bits.capacity() * sizeof(uint64_t);
+  }
+};
@@ -0,0 +1,59 @@
+#pragma once
+
+#include <vector>
+#include <algorithm>
+#include <string>
+#include <thread>
+#include <atomic>
+#include <mutex>
+
+// Calls f(i) for i in [0, count) spread over all hardware threads. Errors
+// thrown as const char* or std::string by f are rethrown (as std::string) once
+// every thread has finished.
+template<typename F>
+void parallelFor(int count, F f) {
+  int total_threads = std::thread::hardware_concurrency();
+
+  if(total_threads <= 0)
+    total_threads = 1;
+
+  total_threads = std::min(total_threads, count);
+
+  std::atomic<int> next(0);
+  std::mutex error_mutex;
+  std::string error;
+  bool failed = false;
+
+  auto worker = [&]() {
+    int i;
+
+    while((i = next++) < count) {
+      try {
+        f(i);
+      }
+      catch(const char* s) {
+        std::lock_guard<std::mutex> lock(error_mutex);
+        failed = true;
+        error = s;
+      }
+      catch(std::string s) {
+        std::lock_guard<std::mutex> lock(error_mutex);
+        failed = true;
+        error = s;
+      }
+    }
+  };
+
+  std::vector<std::thread> threads;
+
+  for(int i = 1; i < total_threads; ++i)
+    threads.push_back(std::thread(worker));
+
+  worker();
+
+  for(int i = 0; i < (int)threads.size(); ++i)
+    threads[i].join();
+
+  if(failed)
+    throw error;
+}
@@ -0,0 +1,279 @@
+#pragma once
+
+#include <vector>
+#include <cmath>
+#include <limits>
+
+#include "grid.hpp"
+#include "parallel.hpp"
+#include "octree.hpp"
+
+struct Ray {
+  glm::vec3 origin;       // In the grid's model space
+  glm::vec3 dir;          // Doesn't need to be normalized
+  float max_distance;
+};
+
+struct RayHit {
+  bool hit;
+  int x, y, z;            // Voxel that was hit
+  int face;               // Face the ray entered the voxel through, -1 if it started inside it
+  float distance;         // Distance from the origin to the hit point
+};
+
+// Casts rays through a grid voxel by voxel (Amanatides & Woo's DDA). Which
+// voxels are solid is kept in a sparse voxel octree, so the ray jumps straight
+// across each empty octree cube instead of stepping through it, and boxes can
+// be tested for solid voxels (see anySolid()). Call markDirty() after
+// changing a voxel; the octree is updated a chunk at a time before the next
+// query.
+template<typename T, typename Layout = LinearLayout>
+class GridRaycaster {
+public:
+  Grid3D<T, Layout>* grid;
+  T empty;
+  ChunkGrid chunks;
+  SparseVoxelOctree<uint8_t> occupancy;   // 1 for solid voxels
+  std::vector<bool> stale;
+  std::vector<int> stale_chunks;
+
+  GridRaycaster(Grid3D<T, Layout>* g, T empty_value) : occupancy(g->x_size, g->y_size, g->z_size, 0) {
+    grid = g;
+    empty = empty_value;
+    chunks.init(g->x_size, g->y_size, g->z_size);
+    stale.assign(chunks.total(), false);
+
+    for(int i = 0; i < chunks.total(); ++i)
+      markChunkDirty(i);
+  }
+
+  void markDirty(int x, int y, int z) {
+    markChunkDirty(chunks.chunkOf(x, y, z));
+  }
+
+  void markChunkDirty(int chunk) {
+    if(!stale[chunk]) {
+      stale[chunk] = true;
+      stale_chunks.push_back(chunk);
+    }
+  }
+
+  // Treats every chunk as empty without reading the grid, for a grid that is
+  // still being filled in. Each chunk must be marked dirty once it's done.
+  void assumeEmpty() {
+    occupancy.clear();
+    stale.assign(chunks.total(), false);
+    stale_chunks.clear();
+  }
+
+  void refresh() {
+    auto solid = [this](int x, int y, int z) -> uint8_t { return grid->get(x, y, z) != empty; };
+
+    if((int)stale_chunks.size() == chunks.total()) {
+      occupancy.generate(solid);
+    }
+    else {
+      // Chunks are aligned cubes of the octree, unless the whole grid fits
+      // in one
+      int s = std::min(GRID_CHUNK_SIZE, occupancy.size);
+
+      for(int i = 0; i < (int)stale_chunks.size(); ++i) {
+        int x1, y1, z1, x2, y2, z2;
+
+        chunks.bounds(stale_chunks[i], x1, y1, z1, x2, y2, z2);
+        occupancy.generateRegion(x1, y1, z1, s, solid);
+      }
+    }
+
+    for(int i = 0; i < (int)stale_chunks.size(); ++i)
+      stale[stale_chunks[i]] = false;
+
+    stale_chunks.clear();
+  }
+
+  // Returns whether any voxel in [x1, x2) x [y1, y2) x [z1, z2) is solid,
+  // for collision tests
+  bool anySolid(int x1, int y1, int z1, int x2, int y2, int z2) {
+    refresh();
+
+    return occupancy.anySolid(x1, y1, z1, x2, y2, z2, 0);
+  }
+
+  RayHit cast(const Ray& ray) {
+    refresh();
+
+    return castRay(ray);
+  }
+
+  // Casts many rays in parallel
+  void castMany(const std::vector<Ray>& rays, std::vector<RayHit>& hits) {
+    const int BATCH = 256;
+
+    refresh();
+    hits.resize(rays.size());
+
+    parallelFor((rays.size() + BATCH - 1) / BATCH, [&](int batch) {
+      int end = std::min((int)rays.size(), (batch + 1) * BATCH);
+
+      for(int i = batch * BATCH; i < end; ++i)
+        hits[i] = castRay(rays[i]);
+    });
+  }
+
+  // Casts a ray without refreshing the octree, so it's safe to call from
+  // several threads at once
+  RayHit castRay(const Ray& ray) const {
+    const float inf = std::numeric_limits<float>::infinity();
+
+    RayHit result;
+    result.hit = false;
+    result.x = result.y = result.z = -1;
+    result.face = -1;
+    result.distance = ray.max_distance;
+
+    float length = glm::length(ray.dir);
+
+    if(length == 0)
+      return result;
+
+    // Work in voxel units, with t measured along the ray in model space units
+    // divided by length
+    float p[3] = { ray.origin.x / grid->grid_dx, ray.origin.y / grid->grid_dy, ray.origin.z / grid->grid_dz };
+    float d[3] = { ray.dir.x / grid->grid_dx, ray.dir.y / grid->grid_dy, ray.dir.z / grid->grid_dz };
+    int size[3] = { grid->x_size, grid->y_size, grid->z_size };
+    float max_t = ray.max_distance / length;
+
+    // Clip the ray to the grid
+    float t_enter = 0;
+    float t_exit = max_t;
+    int enter_axis = -1;
+
+    for(int i = 0; i < 3; ++i) {
+      if(d[i] == 0) {
+        if(p[i] < 0 || p[i] >= size[i])
+          return result;
+
+        continue;
+      }
+
+      float t1 = (0 - p[i]) / d[i];
+      float t2 = (size[i] - p[i]) / d[i];
+
+      if(t1 > t2)
+        std::swap(t1, t2);
+
+      if(t1 > t_enter) {
+        t_enter = t1;
+        enter_axis = i;
+      }
+
+      t_exit = std::min(t_exit, t2);
+    }
+
+    if(t_enter > t_exit)
+      return result;
+
+    int step[3];
+    int v[3];
+    float t_max[3];
+    float t_delta[3];
+    float t = t_enter;
+    int axis = enter_axis;
+
+    for(int i = 0; i < 3; ++i) {
+      step[i] = d[i] > 0 ? 1 : -1;
+      t_delta[i] = d[i] != 0 ? std::fabs(1 / d[i]) : inf;
+    }
+
+    // Finds the voxel the ray is in at t (entered along axis) and when it
+    // crosses the next boundary along each axis
+    auto locate = [&]() {
+      for(int i = 0; i < 3; ++i) {
+        if(i == axis)
+          v[i] = (int)std::floor(p[i] + d[i] * t + step[i] * 0.5f);
+        else
+          v[i] = (int)std::floor(p[i] + d[i] * t);
+
+        v[i] = std::max(0, std::min(size[i] - 1, v[i]));
+
+        if(d[i] == 0)
+          t_max[i] = inf;
+        else
+          t_max[i] = (v[i] + (step[i] > 0) - p[i]) / d[i];
+      }
+    };
+
+    locate();
+
+    while(t <= t_exit) {
+      int cx, cy, cz, s;
+
+      if(!occupancy.leaf(v[0], v[1], v[2], cx, cy, cz, s)) {
+        // Jump to where the ray leaves the empty cube
+        int lo[3] = { cx, cy, cz };
+        int hi[3] = { std::min(cx + s, size[0]), std::min(cy + s, size[1]), std::min(cz + s, size[2]) };
+        float cube_exit = inf;
+
+        for(int i = 0; i < 3; ++i) {
+          if(d[i] == 0)
+            continue;
+
+          float ti = ((step[i] > 0 ? hi[i] : lo[i]) - p[i]) / d[i];
+
+          if(ti < cube_exit) {
+            cube_exit = ti;
+            axis = i;
+          }
+        }
+
+        t = cube_exit;
+
+        if(t > t_exit)
+          break;
+
+        int next = (step[axis] > 0 ? hi[axis] : lo[axis] - 1);
+
+        if(next < 0 || next >= size[axis])
+          break;
+
+        locate();
+        continue;
+      }
+
+      if(grid->get(v[0], v[1], v[2]) != empty) {
+        result.hit = true;
+        result.x = v[0];
+        result.y = v[1];
+        result.z = v[2];
+        result.distance = t * length;
+
+        if(axis == 0)
+          result.face = step[0] > 0 ? FACE_LEFT : FACE_RIGHT;
+        else if(axis == 1)
+          result.face = step[1] > 0 ? FACE_TOP : FACE_BOTTOM;
+        else if(axis == 2)
+          result.face = step[2] > 0 ? FACE_FRONT : FACE_BACK;
+
+        return result;
+      }
+
+      // Step to the next voxel along the axis with the nearest boundary
+      axis = 0;
+
+      if(t_max[1] < t_max[axis])
+        axis = 1;
+
+      if(t_max[2] < t_max[axis])
+        axis = 2;
+
+      t = t_max[axis];
+      v[axis] += step[axis];
+      t_max[axis] += t_delta[axis];
+
+      if(v[axis] < 0 || v[axis] >= size[axis])
+        break;
+    }
+
+    return result;
+  }
+};
@@ -0,0 +1,123 @@
+#pragma once
+
+#include <vector>
+#include <algorithm>
+
+#include "grid.hpp"
+
+// Stores a grid as runs of equal values along y, one list of runs per (x, z)
+// column. Terrain like grids (solid below a surface, empty above it) collapse
+// to a couple of runs per column, which is what generateHeightmap() fills
+// straight from the height of each column.
+template<typename T>
+class ColumnGrid3D {
+public:
+  // Covers [end of previous run, end). Adjacent runs never share a value.
+  struct Run {
+    int end;
+    T value;
+  };
+
+  std::vector<std::vector<Run> > columns;
+  int x_size, y_size, z_size;
+  float grid_dx, grid_dy, grid_dz;
+
+  ColumnGrid3D(int xx, int yy, int zz, float dx, float dy, float dz, T default_value) {
+    x_size = xx;
+    y_size = yy;
+    z_size = zz;
+
+    grid_dx = dx;
+    grid_dy = dy;
+    grid_dz = dz;
+
+    Run r = { yy, default_value };
+
+    columns.assign(xx * zz, std::vector<Run>(1, r));
+  }
+
+  bool validPos(int x, int y, int z) {
+    return x >= 0 && x < x_size && y >= 0 && y < y_size && z >= 0 && z < z_size;
+  }
+
+  std::vector<Run>& column(int x, int z) {
+    return columns[x + z * x_size];
+  }
+
+  // Index of the run containing y
+  static int findRun(std::vector<Run>& col, int y) {
+    int lo = 0;
+    int hi = col.size() - 1;
+
+    while(lo < hi) {
+      int mid = (lo + hi) / 2;
+
+      if(col[mid].end > y)
+        hi = mid;
+      else
+        lo = mid + 1;
+    }
+
+    return lo;
+  }
+
+  T get(int x, int y, int z) {
+    std::vector<Run>& col = column(x, z);
+
+    return col[findRun(col, y)].value;
+  }
+
+  // Fills the grid from a heightmap formula (see Formula::height), with r
+  // half its smallest dimension as in Formula::generate(). Only the height of
+  // each column is evaluated, and its voxels become at most three runs:
+  // empty, solid, empty.
+  void generateHeightmap(const Formula& formula, T solid, T empty) {
+    int r = std::min(x_size, std::min(y_size, z_size)) / 2;
+
+    formula.evaluateColumns(0, 0, 0, x_size, y_size, z_size, r, [&](int x, int z, int y1, int y2) {
+      std::vector<Run>& col = column(x, z);
+      Run below = { y1, empty };
+      Run inside = { y2, solid };
+      Run above = { y_size, empty };
+
+      col.clear();
+
+      if(y1 >= y2) {
+        col.push_back(above);
+        return;
+      }
+
+      if(y1 > 0)
+        col.push_back(below);
+
+      col.push_back(inside);
+
+      if(y2 < y_size)
+        col.push_back(above);
+    });
+  }
+
+  template<typename Layout>
+  void toGrid(Grid3D<T, Layout>& g) {
+    for(int z = 0; z < z_size; ++z) {
+      for(int x = 0; x < x_size; ++x) {
+        std::vector<Run>& col = column(x, z);
+        int y = 0;
+
+        for(int i = 0; i < (int)col.size(); ++i) {
+          for(; y < col[i].end; ++y)
+            g.get(x, y, z) = col[i].value;
+        }
+      }
+    }
+  }
+
+  int totalRuns() {
+    int total = 0;
+
+    for(int i = 0; i < (int)columns.size(); ++i)
+      total += columns[i].size();
+
+    return total;
+  }
+};
@@ -8,8 +8,16 @@ layout(location = 1) in vec4 vertexColor;
 uniform mat4 MVP;
 out vec4 fragmentColor;
 
+// Position of the vertex, and of the corner that identifies its face: both
+// triangles of a face end with the same corner (see Quad::triangulate()),
+// which is the vertex flat outputs take their value from
+out vec3 fragmentPosition_modelspace;
+flat out vec3 faceCorner;
+
 void main(){
   // Output position of the vertex, in clip space : MVP * position
   gl_Position =  MVP * vec4(vertexPosition_modelspace, 1);
   fragmentColor = vertexColor;
+  fragmentPosition_modelspace = vertexPosition_modelspace;
+  faceCorner = vertexPosition_modelspace;
 }
\ No newline at end of file